@@ -0,0 +1,119 @@
+#include "syscall-policy.h"
+
+#include <chrono>
+#include <iostream>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+/**
+ * Measures how long the sandbox's seccomp filter takes to let common syscalls
+ * through, for each filter layout. Each layout is loaded into a forked child,
+ * which times a loop of cheap syscalls that the default policy allows. The
+ * same loop timed without a filter is subtracted.
+ */
+
+static const char* names[] = {"futex", "read", "write", "getpid", "sched_yield"};
+static const size_t sampleCount = sizeof (names) / sizeof (names[0]);
+
+static void
+measure (int iterations, double* results)
+{
+  int word = 0;
+  char buf;
+
+  for (size_t s = 0; s < sampleCount; s++) {
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < iterations; i++) {
+      switch (s) {
+        case 0:
+          syscall (SYS_futex, &word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+          break;
+        // fd 1000 is not open, so these fail after the filter has run
+        case 1:
+          syscall (SYS_read, 1000, &buf, 1);
+          break;
+        case 2:
+          syscall (SYS_write, 1000, &buf, 1);
+          break;
+        case 3:
+          syscall (SYS_getpid);
+          break;
+        case 4:
+          syscall (SYS_sched_yield);
+          break;
+      }
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    results[s] = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / double (iterations);
+  }
+}
+
+static void
+run (const char* name, SyscallPolicy::Layout layout, int iterations, const double* baseline)
+{
+  SyscallPolicy policy (SyscallPolicy::defaultPolicy());
+  int fds[2];
+  pid_t pid;
+
+  policy.setLayout (layout);
+
+  std::cout << name << ": "
+            << policy.exportBPF (SCMP_ACT_TRACE (0)).size() << " instructions"
+            << std::endl;
+
+  if (pipe (fds) < 0)
+    return;
+
+  pid = fork();
+
+  if (pid == 0) {
+    double results[sampleCount];
+    scmp_filter_ctx ctx = policy.compile (SCMP_ACT_TRACE (0));
+
+    prctl (PR_SET_NO_NEW_PRIVS, 1);
+    if (!ctx || seccomp_load (ctx) < 0)
+      _exit (EXIT_FAILURE);
+
+    measure (iterations, results);
+    if (write (fds[1], results, sizeof (results)) < 0)
+      _exit (EXIT_FAILURE);
+    _exit (EXIT_SUCCESS);
+  } else if (pid > 0) {
+    double results[sampleCount];
+    ssize_t len;
+    int status;
+
+    close (fds[1]);
+    len = read (fds[0], results, sizeof (results));
+    waitpid (pid, &status, 0);
+
+    if (len != sizeof (results)) {
+      std::cout << "  could not load filter" << std::endl;
+    } else {
+      for (size_t s = 0; s < sampleCount; s++)
+        std::cout << "  " << names[s] << ": " << results[s] - baseline[s] << "ns" << std::endl;
+    }
+  }
+
+  close (fds[0]);
+}
+
+int main(int argc, char** argv)
+{
+  int iterations = argc > 1 ? atoi (argv[1]) : 1000000;
+  double baseline[sampleCount];
+
+  measure (iterations, baseline);
+
+  run ("linear", SyscallPolicy::Layout::Linear, iterations, baseline);
+  run ("binary-tree", SyscallPolicy::Layout::BinaryTree, iterations, baseline);
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include "sandbox.h"
+
+#include <chrono>
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <uv.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef BUILD_PATH
+#define BUILD_PATH "./"
+#endif
+
+#define strx(s) #s
+
+#define STRINGIFY(s) strx(s)
+
+#define TESTER_BINARY STRINGIFY(BUILD_PATH) "/build/Release/syscall-tester"
+
+/**
+ * Compares the cost of servicing trapped syscalls with each interception
+ * backend. The child calls getuid(), which is trapped and passed through
+ * unchanged, as many times as asked. The time spent in the handler itself is
+ * reported separately.
+ */
+
+class BenchSandbox : public Sandbox {
+public:
+  BenchSandbox() : Sandbox(),
+                   exitStatus(-1),
+                   calls(0) {
+    claimSyscall (SYS_getuid, [this](SyscallCall& call) {calls++;});
+  }
+
+  void handleIPC(codius_request_t*) override {}
+
+  void handleSignal(int signal) override {}
+
+  void handleExit(int status) override {
+    exitStatus = status;
+  }
+
+  void waitExit() {
+    uv_loop_t* loop = uv_default_loop ();
+    while (exitStatus == -1)
+      uv_run (loop, UV_RUN_ONCE);
+  }
+
+  int exitStatus;
+  size_t calls;
+};
+
+static void
+run (const char* name, Sandbox::Backend backend, bool tracerThread, int iterations)
+{
+  std::unique_ptr<BenchSandbox> sbox (new BenchSandbox());
+  sbox->setTracerThread (tracerThread);
+  std::map<std::string, std::string> envp;
+  char* argv[4];
+
+  argv[0] = strdup (TESTER_BINARY);
+  argv[1] = (char*)calloc (sizeof (char), 15);
+  argv[2] = (char*)calloc (sizeof (char), 15);
+  sprintf (argv[1], "%d", SYS_getuid);
+  sprintf (argv[2], "%d", iterations);
+  argv[3] = nullptr;
+
+  auto start = std::chrono::steady_clock::now();
+  sbox->spawn (argv, envp, backend);
+  sbox->waitExit();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  for (size_t i = 0; argv[i]; i++)
+    free (argv[i]);
+
+  if (sbox->getBackend() != backend) {
+    std::cout << name << ": unsupported on this system" << std::endl;
+    return;
+  }
+
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::cout << name << ": " << sbox->calls << " trapped calls in "
+            << ns / 1000000 << "ms, "
+            << ns / std::max<size_t> (sbox->calls, 1) << "ns per call, "
+            << sbox->getHandlerStats (SYS_getuid).time.count() / std::max<size_t> (sbox->calls, 1)
+            << "ns of it in the handler" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  int iterations = argc > 1 ? atoi (argv[1]) : 100000;
+
+  run ("ptrace", Sandbox::Backend::Ptrace, false, iterations);
+  run ("ptrace-tracer-thread", Sandbox::Backend::Ptrace, true, iterations);
+  run ("user-notification", Sandbox::Backend::UserNotification, false, iterations);
+
+  return 0;
+}
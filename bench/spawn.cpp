@@ -0,0 +1,116 @@
+#include "sandbox.h"
+
+#include <chrono>
+#include <iostream>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <uv.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef BUILD_PATH
+#define BUILD_PATH "./"
+#endif
+
+#define strx(s) #s
+
+#define STRINGIFY(s) strx(s)
+
+#define TESTER_BINARY STRINGIFY(BUILD_PATH) "/build/Release/syscall-tester"
+
+/**
+ * Measures how long a child takes from spawn() until it has exited, with
+ * more and more file descriptors open in the host. The child has to get rid
+ * of all of them before it execs.
+ *
+ * The soft RLIMIT_NOFILE is raised to the hard one. Counts that don't fit
+ * under it are reported as such, along with the limit.
+ */
+
+class BenchSandbox : public Sandbox {
+public:
+  BenchSandbox() : Sandbox(),
+                   exitStatus(-1) {}
+
+  void handleIPC(codius_request_t*) override {}
+
+  void handleSignal(int signal) override {}
+
+  void handleExit(int status) override {
+    exitStatus = status;
+  }
+
+  void waitExit() {
+    uv_loop_t* loop = uv_default_loop ();
+    while (exitStatus == -1)
+      uv_run (loop, UV_RUN_ONCE);
+  }
+
+  int exitStatus;
+};
+
+static void
+run (size_t openFDs, int iterations)
+{
+  std::chrono::steady_clock::duration total (0);
+  std::vector<int> fds;
+
+  for (size_t i = 0; i < openFDs; i++) {
+    int fd = open ("/dev/null", O_RDONLY);
+    if (fd < 0) {
+      struct rlimit limit;
+      getrlimit (RLIMIT_NOFILE, &limit);
+      std::cout << openFDs << " open fds: over the fd limit of "
+                << limit.rlim_cur << std::endl;
+      break;
+    }
+    fds.push_back (fd);
+  }
+
+  if (fds.size() == openFDs) {
+    for (int i = 0; i < iterations; i++) {
+      std::unique_ptr<BenchSandbox> sbox (new BenchSandbox());
+      std::map<std::string, std::string> envp;
+      char* argv[3];
+
+      argv[0] = strdup (TESTER_BINARY);
+      argv[1] = (char*)calloc (sizeof (char), 15);
+      sprintf (argv[1], "%d", SYS_getpid);
+      argv[2] = nullptr;
+
+      auto start = std::chrono::steady_clock::now();
+      sbox->spawn (argv, envp);
+      sbox->waitExit();
+      total += std::chrono::steady_clock::now() - start;
+
+      for (size_t j = 0; argv[j]; j++)
+        free (argv[j]);
+    }
+
+    double us = std::chrono::duration_cast<std::chrono::microseconds>(total).count();
+    std::cout << openFDs << " open fds: " << us / iterations
+              << "us from spawn to exit" << std::endl;
+  }
+
+  for (auto i = fds.cbegin(); i != fds.cend(); i++)
+    close (*i);
+}
+
+int main(int argc, char** argv)
+{
+  int iterations = argc > 1 ? atoi (argv[1]) : 100;
+  struct rlimit limit;
+
+  getrlimit (RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit (RLIMIT_NOFILE, &limit);
+
+  run (0, iterations);
+  run (1000, iterations);
+  run (10000, iterations);
+  run (50000, iterations);
+
+  return 0;
+}
@@ -24,6 +24,26 @@
         'test/syscall-tester.c'
       ]
     },
+    { 'target_name': 'vfs-tester',
+      'type': 'executable',
+      'sources': [
+        'test/vfs-tester.c'
+      ]
+    },
+    { 'target_name': 'codius-spawn-helper',
+      'type': 'executable',
+      'sources': [
+        'src/spawn-helper.cpp',
+        'src/spawn-vm.cpp',
+        'src/fd-util.cpp'
+      ],
+      'include_dirs': [
+        'include'
+      ],
+      'cflags': [
+        '--std=c++11 -Wall -Werror'
+      ]
+    },
     { 'target_name': 'node-codius-sandbox',
       'sources': [
         'src/sandbox-node-module.cpp',
@@ -36,7 +56,8 @@
         '--std=c++11'
       ],
       'dependencies': [
-        'codius-sandbox'
+        'codius-sandbox',
+        'codius-spawn-helper'
       ],
       'cflags': [
         '<!@(<(pkg-config) --cflags libseccomp) -fPIC --std=c++11 -g -Wall -Werror'
@@ -53,14 +74,20 @@
       'sources': [
         'test/main.cpp',
         'test/sandbox.cpp',
-        'test/ipc.cpp'
+        'test/ipc.cpp',
+        'test/syscall-policy.cpp',
+        'test/scratch-arena.cpp',
+        'test/mount-table.cpp',
+        'test/path-resolver.cpp',
+        'test/vfs.cpp'
       ],
       'include_dirs': [
         'include',
       ],
       'dependencies': [
         'codius-sandbox',
-        'codius-sandbox-rpc'
+        'codius-sandbox-rpc',
+        'codius-spawn-helper'
       ],
       'cflags': [
         '<!@(<(pkg-config) --cflags cppunit libuv libseccomp) -fPIC --std=c++11 -g -Wall -Werror -DBUILD_PATH=<(module_root_dir)'
@@ -74,6 +101,73 @@
       'libraries': [
         '<!@(<(pkg-config) --libs-only-l cppunit libuv libseccomp) -ldl'
       ]
+    },
+    { 'target_name': 'codius-bench-intercept',
+      'type': 'executable',
+      'sources': [
+        'bench/intercept.cpp'
+      ],
+      'include_dirs': [
+        'include',
+      ],
+      'dependencies': [
+        'codius-sandbox',
+        'codius-sandbox-rpc',
+        'syscall-tester'
+      ],
+      'cflags': [
+        '<!@(<(pkg-config) --cflags libuv libseccomp) -fPIC --std=c++11 -O2 -Wall -Werror -DBUILD_PATH=<(module_root_dir)'
+      ],
+      'ldflags': [
+        '<!@(<(pkg-config) --libs-only-L --libs-only-other libuv libseccomp)'
+      ],
+      'libraries': [
+        '<!@(<(pkg-config) --libs-only-l libuv libseccomp) -ldl'
+      ]
+    },
+    { 'target_name': 'codius-bench-spawn',
+      'type': 'executable',
+      'sources': [
+        'bench/spawn.cpp'
+      ],
+      'include_dirs': [
+        'include',
+      ],
+      'dependencies': [
+        'codius-sandbox',
+        'codius-sandbox-rpc',
+        'syscall-tester'
+      ],
+      'cflags': [
+        '<!@(<(pkg-config) --cflags libuv libseccomp) -fPIC --std=c++11 -O2 -Wall -Werror -DBUILD_PATH=<(module_root_dir)'
+      ],
+      'ldflags': [
+        '<!@(<(pkg-config) --libs-only-L --libs-only-other libuv libseccomp)'
+      ],
+      'libraries': [
+        '<!@(<(pkg-config) --libs-only-l libuv libseccomp) -ldl'
+      ]
+    },
+    { 'target_name': 'codius-bench-filter',
+      'type': 'executable',
+      'sources': [
+        'bench/filter.cpp'
+      ],
+      'include_dirs': [
+        'include',
+      ],
+      'dependencies': [
+        'codius-sandbox'
+      ],
+      'cflags': [
+        '<!@(<(pkg-config) --cflags libuv libseccomp) -fPIC --std=c++11 -O2 -Wall -Werror'
+      ],
+      'ldflags': [
+        '<!@(<(pkg-config) --libs-only-L --libs-only-other libuv libseccomp)'
+      ],
+      'libraries': [
+        '<!@(<(pkg-config) --libs-only-l libuv libseccomp) -ldl'
+      ]
     }
   ],
   'conditions': [
@@ -87,7 +181,14 @@
           'src/sandbox-ipc.cpp',
           'src/vfs.cpp',
           'src/dirent-builder.cpp',
-          'src/native-filesystem.cpp'
+          'src/native-filesystem.cpp',
+          'src/syscall-policy.cpp',
+          'src/fd-util.cpp',
+          'src/spawn-pool.cpp',
+          'src/spawn-vm.cpp',
+          'src/scratch-arena.cpp',
+          'src/mount-table.cpp',
+          'src/path-resolver.cpp'
         ],
         'include_dirs': [
           'include',
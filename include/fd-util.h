@@ -0,0 +1,18 @@
+#ifndef CODIUS_FD_UTIL_H
+#define CODIUS_FD_UTIL_H
+
+#include <vector>
+
+/**
+ * Closes every file descriptor of the calling process, except for those in
+ * @p keep. Meant for freshly forked children. Uses close_range(2) where the
+ * kernel has it, and walks /proc/self/fd otherwise. Does not allocate, so it
+ * is safe to call from a child that shares its parent's memory.
+ *
+ * @param keep File descriptors to leave open
+ * @param onExec Only mark the descriptors close-on-exec where possible, for
+ * a child that is about to exec anyway
+ */
+void closeInheritedFDs(const std::vector<int>& keep, bool onExec = false);
+
+#endif // CODIUS_FD_UTIL_H
@@ -24,6 +24,28 @@ public:
   virtual int stat(const char* path, struct stat *buf) = 0;
   virtual int lstat(const char* path, struct stat *buf) = 0;
   virtual ssize_t readlink(const char* path, char* buf, size_t bufsize) = 0;
+
+  /**
+   * Returns a host file descriptor behind @p fd, which a sandboxed process
+   * can be given to use directly, or -1 if there is none
+   */
+  virtual int nativeFD(int fd) { return -1; }
+
+  /**
+   * Whether this filesystem must be called from the libuv default loop,
+   * e.g. because it calls back into the embedder. Others may also be called
+   * from a sandbox's tracer thread.
+   */
+  virtual bool needsLoop() const { return true; }
+
+  /**
+   * Opens @p name again for a copy of a sandbox, as a new file that doesn't
+   * share its offset with the original
+   *
+   * @param native Host file descriptor behind the original, or -1. It
+   * still refers to the file if @p name has since been removed.
+   */
+  virtual int reopen(const char* name, int flags, int native) { return open (name, flags, 0); }
 };
 
 #endif // FILESYSTEM_H
@@ -0,0 +1,68 @@
+#ifndef CODIUS_MOUNT_TABLE_H
+#define CODIUS_MOUNT_TABLE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class Filesystem;
+
+/**
+ * Filesystems mounted into a VFS, kept in a trie with one level per path
+ * component. Looking up a path walks it once, picks the deepest mount along
+ * the way and allocates nothing.
+ */
+class MountTable {
+public:
+  /**
+   * Result of lookup()
+   */
+  struct Match {
+    /**
+     * Filesystem that the path is in, or null if there is none
+     */
+    const std::shared_ptr<Filesystem>* fs;
+
+    /**
+     * Rest of the path, inside the looked up path. It starts with a slash,
+     * or is empty for the mountpoint itself.
+     */
+    const char* rest;
+    size_t restLength;
+  };
+
+  MountTable();
+
+  /**
+   * Mounts @p fs at @p path, replacing whatever was mounted there. Repeated
+   * and trailing slashes in @p path don't matter.
+   */
+  void mount(const std::string& path, std::shared_ptr<Filesystem> fs);
+
+  /**
+   * Finds the filesystem mounted closest to absolute path @p path
+   *
+   * @param length Length of @p path
+   */
+  Match lookup(const char* path, size_t length) const;
+
+  /**
+   * Number of mounted filesystems
+   */
+  size_t size() const;
+
+private:
+  struct Node {
+    std::string name;
+    std::shared_ptr<Filesystem> fs;
+    // Sorted by name
+    std::vector<std::unique_ptr<Node> > children;
+
+    const Node* child(const char* name, size_t length) const;
+  };
+
+  Node m_root;
+  size_t m_size;
+};
+
+#endif // CODIUS_MOUNT_TABLE_H
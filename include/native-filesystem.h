@@ -27,6 +27,9 @@ public:
   virtual int stat(const char* path, struct stat* buf);
   virtual int lstat(const char* path, struct stat* buf);
   virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual int nativeFD(int fd);
+  virtual bool needsLoop() const;
+  virtual int reopen(const char* name, int flags, int native);
 
 private:
   std::string m_root;
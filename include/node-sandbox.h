@@ -8,6 +8,7 @@
 #include <future>
 
 class NodeSandbox;
+class SpawnPool;
 
 class SandboxWrapper : public node::ObjectWrap {
   public:
@@ -25,7 +26,8 @@ public:
   std::vector<char> mapFilename(std::vector<char> fname);
   void emitEvent(const std::string& name, std::vector<v8::Handle<v8::Value> >& argv);
   SyscallCall mapFilename(const SyscallCall& call);
-  SyscallCall handleSyscall(const SyscallCall &call) override;
+  void handleSocket(SyscallCall& call);
+  void handleBind(SyscallCall& call);
 
   using VFSPromise = std::promise<v8::Persistent<v8::Value> >;
   using VFSFuture = std::shared_future<v8::Persistent<v8::Value> >;
@@ -33,6 +35,7 @@ public:
 
   void handleIPC(codius_request_t* request) override;
   void handleExit(int status) override;
+  void handleSnapshot() override;
   void launchDebugger();
   void handleSignal(int signal) override;
   static void Init(v8::Handle<v8::Object> exports);
@@ -42,12 +45,16 @@ private:
     bool m_debuggerOnCrash;
     static v8::Handle<v8::Value> node_spawn(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_kill(const v8::Arguments& args);
+    static v8::Handle<v8::Value> node_flush_filesystem_cache(const v8::Arguments& args);
+    static v8::Handle<v8::Value> node_spawn_from_snapshot(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_finish_ipc(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_finish_vfs(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_new(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_getDebugOnCrash(v8::Local<v8::String> property, const v8::AccessorInfo& info);
     static void node_setDebugOnCrash(v8::Local<v8::String> property, v8::Local<v8::Value> value, const v8::AccessorInfo& info);
+    static v8::Handle<v8::Value> node_setSpawnPoolSize(const v8::Arguments& args);
     static v8::Persistent<v8::Function> s_constructor;
+    static std::shared_ptr<SpawnPool> s_spawnPool;
 };
 
 #endif // NODE_SANDBOX_H
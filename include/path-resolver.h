@@ -0,0 +1,136 @@
+#ifndef CODIUS_PATH_RESOLVER_H
+#define CODIUS_PATH_RESOLVER_H
+
+#include "mount-table.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Turns paths given to a VFS into canonical absolute paths, without ".",
+ * ".." or repeated slashes, and with symlinks followed through the mounted
+ * filesystems.
+ *
+ * What each path turned out to be, including that it doesn't exist, is kept
+ * in a bounded cache of dentries, with the least recently used ones dropped
+ * first. Paths that share a directory then cost no more Filesystem calls
+ * than it takes to look up their last component, and paths that were found
+ * missing, as most of those probed by require() and the dynamic linker are,
+ * cost none at all.
+ *
+ * Dentries stay valid until the next generation is started with
+ * newGeneration(). Those of missing paths can also be given a time to live.
+ */
+class PathResolver {
+public:
+  /**
+   * What a canonical path names
+   */
+  struct Dentry {
+    bool exists;
+    // As returned by lstat()
+    struct stat attr;
+    // Target of a symlink
+    std::string link;
+  };
+
+  /**
+   * Constructor
+   *
+   * @param mounts Filesystems that paths are looked up in
+   * @param capacity Number of dentries kept
+   */
+  PathResolver(const MountTable& mounts, size_t capacity = defaultCapacity);
+
+  /**
+   * Makes @p path absolute against directory @p base, and removes ".", ".."
+   * and repeated slashes from it. Nothing is looked up.
+   */
+  static std::string normalize(const std::string& path, const std::string& base);
+
+  /**
+   * Finds the canonical path of @p path, relative to directory @p base.
+   * Components are walked in order, so ".." goes up from wherever the
+   * symlinks before it led. A trailing slash requires a directory.
+   *
+   * @param followLast Whether a symlink in the last component is followed,
+   * which it always is if @p path ends in a slash
+   * @param resolved Set to the canonical path
+   * @param missing Set to whether the path is known not to exist
+   * @param dentry If given, set to the dentry of the canonical path, or null
+   * if it couldn't be looked up. It stays valid until the next lookup.
+   * @return 0 on success, or a negative error number if a directory along
+   * the way is missing (ENOENT), isn't one (ENOTDIR) or has too many
+   * symlinks (ELOOP)
+   */
+  int resolve(const std::string& path, const std::string& base, bool followLast,
+              std::string& resolved, bool& missing, const Dentry** dentry = nullptr);
+
+  /**
+   * Forgets what @p path is, for when it was created or removed
+   */
+  void invalidate(const std::string& path);
+
+  /**
+   * Forgets every dentry
+   */
+  void clear();
+
+  /**
+   * Starts a new generation, for when the mounted filesystems changed. Every
+   * dentry from before is looked up again when it is next needed.
+   */
+  void newGeneration();
+
+  /**
+   * Sets how long a path stays known to be missing. Zero, the default, keeps
+   * it until the next generation.
+   */
+  void setNegativeTTL(std::chrono::milliseconds ttl);
+
+  /**
+   * Number of dentries kept
+   */
+  size_t size() const;
+
+  /**
+   * Number of dentries found in the cache
+   */
+  unsigned long hits() const;
+
+  /**
+   * Number of dentries that had to be looked up in a Filesystem
+   */
+  unsigned long misses() const;
+
+  static constexpr size_t defaultCapacity = 4096;
+
+private:
+  struct Cached {
+    Dentry dentry;
+    unsigned long generation;
+    // Only for missing paths
+    std::chrono::steady_clock::time_point expires;
+  };
+  using Entry = std::pair<std::string, Cached>;
+
+  const Dentry* lookup(const std::string& path);
+
+  const MountTable& m_mounts;
+  size_t m_capacity;
+  unsigned long m_generation;
+  unsigned long m_hits;
+  unsigned long m_misses;
+  std::chrono::milliseconds m_negativeTTL;
+  // Most recently used first
+  std::list<Entry> m_lru;
+  std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+  // Returned by lookup() when nothing is kept
+  Dentry m_uncached;
+};
+
+#endif // CODIUS_PATH_RESOLVER_H
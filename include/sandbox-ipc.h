@@ -45,7 +45,19 @@ public:
    */
   bool stopPoll();
 
-  uv_poll_t poll;
+  /**
+   * Passes anything the child wrote before going away to onReadReady(), which
+   * the event loop may not have gotten around to yet
+   */
+  void drain();
+
+  /**
+   * Replaces both ends of the channel with @p parentFD, a socket that is
+   * already connected to the child's @p dupAs
+   */
+  void adopt(int parentFD);
+
+  uv_poll_t* poll;
 
   /**
    * Parent side of the IPC pipe
@@ -1,6 +1,8 @@
 #ifndef CODIUS_SANDBOX_H
 #define CODIUS_SANDBOX_H
 
+#include <chrono>
+#include <functional>
 #include <map>
 #include <vector>
 #include <unistd.h>
@@ -10,6 +12,8 @@
 
 class SandboxPrivate;
 class SandboxIPC;
+class SyscallPolicy;
+class SpawnPool;
 class VFS;
 
 //FIXME: This shouldn't be public API. It is only used for libuv
@@ -25,11 +29,109 @@ class Sandbox {
     Sandbox();
     ~Sandbox();
 
+    /**
+     * Mechanisms that can be used to intercept syscalls made by the child
+     */
+    enum class Backend {
+      /**
+       * Syscalls trap with SECCOMP_RET_TRACE and are serviced from ptrace
+       * stops
+       */
+      Ptrace,
+
+      /**
+       * Syscalls trap with SECCOMP_RET_USER_NOTIF and are serviced from a
+       * seccomp listener fd, without ptrace. Calls can be answered by the
+       * handlers or allowed through unchanged, but their arguments cannot be
+       * rewritten. Nor is a call allowed through once its handler has read
+       * the child's memory, as another thread could change it before the
+       * kernel reads it again; such calls fail with ENOSYS unless the handler
+       * answers them itself, for instance with returnFD().
+       */
+      UserNotification
+    };
+
     /**
      * Spawns a binary inside this sandbox. Arguments are the same as for
      * execv(3)
+     *
+     * With Backend::Ptrace the child is started with clone(CLONE_VM |
+     * CLONE_VFORK) where possible, so that the embedder's heap isn't copied
+     * just to be thrown away by exec.
+     *
+     * @param backend Mechanism used to intercept the child's syscalls. Falls
+     * back to Backend::Ptrace if the system lacks user notification support.
+     */
+    void spawn(char** argv, std::map<std::string, std::string>& envp, Backend backend = Backend::Ptrace);
+
+    /**
+     * Returns the mechanism used to intercept the child's syscalls
+     */
+    Backend getBackend() const;
+
+    /**
+     * Services the stops of children spawned with Backend::Ptrace from a
+     * thread dedicated to this sandbox, rather than from the libuv default
+     * loop. Unclaimed syscalls, exec and clone events are handled entirely on
+     * that thread, as are the VFS and identity handlers while every mounted
+     * Filesystem allows it. Other syscall handlers and the callbacks below
+     * are still run on the default loop, which the tracer thread waits for
+     * when it needs an answer. The VFS must not be changed while the child
+     * runs.
+     *
+     * A later spawn() waits for the previous child's tracer thread to
+     * finish, and does nothing if that child is still running.
+     *
+     * Once a child is spawned this way, releaseChild() can only kill it.
+     *
+     * @param enabled Whether to use a tracer thread for later spawn() calls
      */
-    void spawn(char** argv, std::map<std::string, std::string>& envp);
+    void setTracerThread(bool enabled);
+
+    /**
+     * Starts children spawned with Backend::Ptrace, without a tracer thread,
+     * in warm children taken from @p pool instead of forking. If the pool is
+     * empty, spawn() forks as usual.
+     *
+     * @param pool Pool to take children from, or null to always fork
+     */
+    void setSpawnPool(std::shared_ptr<SpawnPool> pool);
+
+    /**
+     * Turns the child into a template for other sandboxes. Once the child has
+     * booted, it makes a synchronous codius IPC call to method "snapshot" of
+     * api "sandbox" from its main thread. The child is then stopped for good
+     * at that call, and handleSnapshot() is run. spawnFromSnapshot() starts
+     * copies of it.
+     *
+     * Only children spawned with Backend::Ptrace and no tracer thread can be
+     * used as templates. The template must be down to the one thread that
+     * makes the call; otherwise the call fails, and may be made again.
+     *
+     * @param enabled Whether to handle "sandbox.snapshot" calls, rather than
+     * passing them to handleIPC()
+     */
+    void setSnapshotServer(bool enabled);
+
+    /**
+     * Returns true once the child has stopped at its snapshot call
+     */
+    bool hasSnapshot() const;
+
+    /**
+     * Starts a copy of @p server's snapshot in this sandbox, instead of
+     * spawning a new program. The copy is forked from the template, so it
+     * shares its memory copy-on-write, and is given this sandbox's IPC
+     * channels. It returns from the snapshot call with a successful result.
+     *
+     * The template is down to the thread that made the snapshot call, so
+     * the copy is complete. It also inherits the template's open virtual
+     * files and current directory.
+     *
+     * @param server Sandbox whose child has stopped at its snapshot call
+     * @return true on success
+     */
+    bool spawnFromSnapshot(Sandbox& server);
 
     using Word = unsigned long;
     using Address = Word;
@@ -58,13 +160,178 @@ class Sandbox {
     };
 
     /**
-     * Called when a syscall is called from within the sandbox. Return a
-     * different SyscallCall object to rewrite the call used
+     * A batch of reads and writes of a child process' memory. Queued reads
+     * and writes are carried out together by commit(), using a single
+     * process_vm_readv() for all the reads and a single process_vm_writev()
+     * for all the writes where possible.
+     *
+     * Reads see the child's memory as it was before any of the writes in the
+     * same transaction.
+     */
+    class MemoryTransaction {
+      public:
+        /**
+         * Constructor
+         *
+         * @param sandbox Sandbox the child belongs to
+         * @param pid Child process whose memory will be accessed
+         */
+        MemoryTransaction (Sandbox* sandbox, pid_t pid);
+
+        /**
+         * Queue a read from the child's memory
+         *
+         * @param addr Address to read from
+         * @param length Bytes to read
+         * @param buf Buffer to read into. Must stay valid until commit()
+         */
+        void read (Address addr, size_t length, void* buf);
+
+        /**
+         * Queue a write to the child's memory. The data is copied, so @p buf
+         * may be released as soon as this returns.
+         *
+         * @param addr Address to write to
+         * @param length Length of @p buf
+         * @param buf Data to write
+         */
+        void write (Address addr, size_t length, const void* buf);
+
+        /**
+         * Queue a write to the scratch buffer inside the child's memory
+         *
+         * @see Sandbox::writeScratch()
+         * @return Address the data will be written to
+         */
+        Address writeScratch (size_t length, const void* buf);
+
+        /**
+         * Carry out all queued reads and writes, then empty the queue
+         *
+         * @return @p true if every read and write completed, @p false
+         * otherwise. @p errno will be set upon failure.
+         */
+        bool commit ();
+
+      private:
+        struct Segment {
+          Address addr;
+          size_t length;
+          char* buf;
+          size_t offset;
+        };
+
+        bool transfer (std::vector<Segment>& segments, bool write);
+
+        Sandbox* m_sbox;
+        pid_t m_pid;
+        std::vector<Segment> m_reads;
+        std::vector<Segment> m_writes;
+        std::vector<char> m_writeData;
+    };
+
+    /**
+     * A piece of the scratch arena inside the child's memory. It is given
+     * back when the lease goes out of scope, or at the latest when its thread
+     * makes its next trapped syscall.
+     */
+    class ScratchLease {
+      public:
+        ScratchLease ();
+        ScratchLease (ScratchLease&& other);
+        ScratchLease& operator= (ScratchLease&& other);
+        ScratchLease (const ScratchLease&) = delete;
+        ScratchLease& operator= (const ScratchLease&) = delete;
+        ~ScratchLease ();
+
+        /**
+         * Returns the address of the lease inside the child, or 0 if the
+         * scratch arena had no room
+         */
+        Address address () const;
+
+        /**
+         * Returns the number of bytes leased
+         */
+        size_t length () const;
+
+        explicit operator bool () const;
+
+        /**
+         * Writes @p buf into the child's memory at @p offset into the lease
+         *
+         * @return @p true if successful, @p false if it doesn't fit or the
+         * write failed
+         */
+        bool write (const void* buf, size_t length, size_t offset = 0);
+
+        /**
+         * Gives the lease back early
+         */
+        void release ();
+
+      private:
+        friend class Sandbox;
+        ScratchLease (Sandbox* sandbox, pid_t tid, Address addr, size_t length);
+
+        Sandbox* m_sbox;
+        pid_t m_tid;
+        Address m_addr;
+        size_t m_length;
+        uint64_t m_epoch;
+    };
+
+    /**
+     * Services a trapped syscall in place. Change the id or arguments of
+     * @p call to rewrite it, or set its id to -1 and its returnVal to skip it
+     * and return a value instead.
+     */
+    using SyscallHandler = std::function<void(SyscallCall& call)>;
+
+    /**
+     * Time spent in the handler of a syscall
+     */
+    struct HandlerStats {
+      uint64_t calls;
+      std::chrono::nanoseconds time;
+    };
+
+    /**
+     * Routes trapped calls to @p syscall to @p handler. Trapped calls that
+     * nobody has claimed continue unchanged.
+     *
+     * A syscall has one handler at a time, so this takes over any previous
+     * claim and hands back its handler. A handler that only wants to see
+     * some calls passes the others on to it, or makes sure it got back an
+     * empty function.
+     *
+     * When the sandbox is constructed, the VFS claims open, openat, close,
+     * read, readv, write, writev, lseek, fstat, stat, lstat, access,
+     * getdents, chdir, getcwd, readlink and mmap. setIdentity() claims
+     * getuid, geteuid, getgid, getegid, getppid, getresuid, getresgid and
+     * capget.
      *
-     * @param call Call that was attempted
-     * @return Call that will be executed instead of @call
+     * @param syscall Syscall number
+     * @param handler Handler to use, or an empty function to drop the claim
+     * @return The previous handler, or an empty function if there was none
      */
-    virtual SyscallCall handleSyscall(const SyscallCall &call) = 0;
+    SyscallHandler claimSyscall(int syscall, SyscallHandler handler);
+
+    /**
+     * Like claimSyscall(), for a handler that only calls back into the
+     * embedder when @p needsLoop says so. With a tracer thread, the handler
+     * is run right on that thread whenever @p needsLoop returns false,
+     * instead of on the default loop.
+     *
+     * @param needsLoop Asked on the tracer thread before each call
+     * @return The previous handler, or an empty function if there was none
+     */
+    SyscallHandler claimSyscall(int syscall, SyscallHandler handler, std::function<bool()> needsLoop);
+
+    /**
+     * Returns how often the handler of @p syscall has run, and for how long
+     */
+    HandlerStats getHandlerStats(int syscall) const;
 
     /**
      * Called when an IPC request from within the sandbox is generated.
@@ -88,6 +355,13 @@ class Sandbox {
      */
     virtual void handleExit(int status) = 0;
 
+    /**
+     * Called when the child has stopped at its snapshot call
+     *
+     * @see setSnapshotServer()
+     */
+    virtual void handleSnapshot();
+
     /**
      * Map a sandbox-side file descriptor to an outside handler
      * 
@@ -114,6 +388,19 @@ class Sandbox {
      */
     bool copyData (pid_t pid, Address addr, size_t length, void* buf);
 
+    /**
+     * Read a contiguous chunk of the child process' memory in as few
+     * transfers as possible.
+     *
+     * @param addr Address to start reading from
+     * @param length Bytes to read
+     * @param buf Buffer to write to
+     * @return Number of bytes read, which is less than @p length if a fault
+     * was hit part way through, or -1 if nothing could be read. @p errno will
+     * be set upon a short or failed read.
+     */
+    ssize_t readMemory (pid_t pid, Address addr, size_t length, void* buf);
+
     /**
      * Read a contiguous chunk of the child process' memory, stopping at the
      * first null byte.
@@ -126,6 +413,22 @@ class Sandbox {
      */
     bool copyString (pid_t pid, Address addr, size_t maxLength, char* buf);
 
+    /**
+     * Read a null terminated string out of the child process' memory. The
+     * string is read a page at a time, and reading never continues past the
+     * page holding the terminating null byte.
+     *
+     * @param addr Address to read from
+     * @param maxLength Maximum length of string to read, including the null
+     * byte
+     * @param str String that the read data will be stored in, without the
+     * terminating null byte
+     * @return @p true if successful, @p false otherwise. @p errno will be set
+     * upon failure, and is @p ENAMETOOLONG if no null byte was found within
+     * @p maxLength bytes.
+     */
+    bool readString (pid_t pid, Address addr, size_t maxLength, std::string& str);
+
     /**
      * Write a single word to the child process' memory
      * 
@@ -138,19 +441,79 @@ class Sandbox {
 
     /**
      * Write a chunk of data to the scratch buffer inside the child's memory,
-     * and return the address it was written to
+     * and return the address it was written to. The space belongs to the
+     * thread whose syscall is being handled until its next trapped syscall.
      *
      * @param length Length of @p buf
      * @param buf Data to write
-     * @return Address the data was written to, aligned up to the nearest word.
+     * @return Address the data was written to, aligned up to the nearest
+     * word, or 0 if the scratch arena had no room
      */
     Address writeScratch(size_t length, const char* buf);
 
     /**
-     * Frees all used scratch memory for re-use
+     * Frees all scratch memory used by the thread whose syscall is being
+     * handled, for re-use. Done before every handler runs.
      */
     void resetScratch();
 
+    /**
+     * Leases @p length bytes of scratch memory for thread @p tid of the
+     * child. Each thread has its own part of the arena, so that a thread
+     * running its rewritten syscall isn't clobbered by another's handler.
+     *
+     * @return The lease, which is empty if the arena had no room
+     */
+    ScratchLease leaseScratch(pid_t tid, size_t length);
+
+    /**
+     * Sets the size of the scratch arena mapped into children spawned after
+     * this call. Defaults to 64 KiB. Children that the arena can't be mapped
+     * into fall back to a 2 KiB buffer in their environment.
+     */
+    void setScratchSize(size_t size);
+
+    /**
+     * Sets the size of the memory window shared with children spawned after
+     * this call with Backend::Ptrace. Defaults to 1 MiB, and 0 turns it off,
+     * as does anything under 64 KiB.
+     *
+     * The window is a memfd that the child has open. Data placed in it by a
+     * syscall handler is copied into the child by the kernel, through a
+     * rewritten syscall, rather than by the tracer. Children spawned from a
+     * snapshot have no window.
+     */
+    void setWindowSize(size_t size);
+
+    /**
+     * Finds room in the window shared with the child for thread @p tid to
+     * receive data. The room belongs to @p tid until its next trapped
+     * syscall.
+     *
+     * @param length Bytes wanted. Lowered to what there is room for, which
+     * suits calls that may come up short, like read().
+     * @return Where to put the data, or nullptr if there is no window or no
+     * room in it
+     */
+    char* windowBuffer(pid_t tid, size_t& length);
+
+    /**
+     * Rewrites @p call into a pread() of the window, which copies @p length
+     * bytes at @p buf to @p addr in the child and returns @p length.
+     *
+     * @param buf Data inside the window, from windowBuffer()
+     */
+    void readFromWindow(SyscallCall& call, const char* buf, size_t length, Address addr);
+
+    /**
+     * Rewrites @p call into a preadv() of the window, which scatters the data
+     * at @p buf across the @p count iovecs at @p iov in the child. All of the
+     * iovecs are filled, so @p buf must hold as many bytes as they add up to.
+     *
+     * @param buf Data inside the window, from windowBuffer()
+     */
+    void readvFromWindow(SyscallCall& call, const char* buf, Address iov, size_t count);
+
     /**
      * Writes a chunk of data to the child process' memory
      *
@@ -163,10 +526,71 @@ class Sandbox {
     bool writeData (pid_t pid, Address addr, size_t length, const char* buf);
 
     /**
-     * Returns the address of the scratch buffer inside the child process
+     * Writes a chunk of data to the child process' memory in as few transfers
+     * as possible.
+     *
+     * @param addr Address to write to
+     * @param length Length of @p buf
+     * @param buf Data to write
+     * @return Number of bytes written, which is less than @p length if a fault
+     * was hit part way through, or -1 if nothing could be written. @p errno
+     * will be set upon a short or failed write.
+     */
+    ssize_t writeMemory (pid_t pid, Address addr, size_t length, const void* buf);
+
+    /**
+     * Returns the address of the scratch arena inside the child process
      */
     Address getScratchAddress () const;
 
+    /**
+     * Installs a copy of one of our file descriptors into the child while it
+     * is stopped in a syscall. Only supported by Backend::UserNotification.
+     *
+     * @param localFD File descriptor to copy
+     * @param remoteFD File descriptor number it will have inside the child
+     * @return @p remoteFD on success, negative error number otherwise.
+     */
+    int installFD(int localFD, int remoteFD);
+
+    /**
+     * Takes a copy of one of the child's file descriptors, sharing its file
+     * description, the way the child's own dup() would. Only supported by
+     * Backend::UserNotification.
+     *
+     * @param remoteFD File descriptor number inside the child
+     * @return A file descriptor that is ours to close, or a negative error
+     * number
+     */
+    int copyFD(int remoteFD);
+
+    /**
+     * Makes the trapped @p call return a copy of one of our file descriptors,
+     * installed in the child at the lowest free number, as open() would.
+     * Unlike installFD(), this works with Backend::Ptrace as well, where the
+     * child receives the copy over a socket once the syscall handler returns.
+     * If the child has no room for it by then, @p call fails with EMFILE.
+     *
+     * @param localFD File descriptor to copy. It can be closed right away.
+     * Only to be called from a syscall handler.
+     *
+     * @param flags O_CLOEXEC, or 0
+     * @return false if the copy can't be sent, which leaves @p call alone
+     */
+    bool returnFD(SyscallCall& call, int localFD, int flags = 0);
+
+    /**
+     * Makes the trapped mmap() @p call map one of our file descriptors in
+     * place of the one it was given, with the same address, length,
+     * protection, flags and offset. The child holds a copy of @p localFD
+     * only while the mapping is made. Only supported by Backend::Ptrace, and
+     * only to be called from a syscall handler.
+     *
+     * @param localFD File descriptor to map. It can be closed right away.
+     * @return false if the file can't be sent, which leaves @p call alone
+     */
+    bool mapFD(SyscallCall& call, int localFD);
+
     /**
      * Returns the child's PID
      */
@@ -194,10 +618,46 @@ class Sandbox {
     
     VFS& getVFS() const;
 
+    /**
+     * Replaces the seccomp policy used for children spawned after this call.
+     * Defaults to SyscallPolicy::defaultPolicy().
+     *
+     * @param policy Policy to use
+     */
+    void setPolicy(const SyscallPolicy& policy);
+
+    /**
+     * Returns the seccomp policy used when spawning children
+     */
+    const SyscallPolicy& getPolicy() const;
+
+    /**
+     * User, group and parent process that a child believes it has
+     */
+    struct Identity {
+      uid_t uid;
+      gid_t gid;
+      pid_t ppid;
+    };
+
+    /**
+     * Makes getuid(), getgid(), getppid() and their relatives report
+     * @p identity in children spawned after this call. They are claimed
+     * with claimSyscall(), and any handler they had before is dropped.
+     * Calls whose answer is 0 are answered by the seccomp filter itself and
+     * never stop the child. capget() reports no capabilities.
+     *
+     * Until this is called, those syscalls trap with their real values.
+     *
+     * @param identity Identity to report
+     */
+    void setIdentity(const Identity& identity);
+
 
   private:
     SandboxPrivate* m_p;
     void traceChild();
+    void watchChild();
     void execChild(char** argv, std::map<std::string, std::string>& envp) __attribute__ ((noreturn));
 };
 
@@ -0,0 +1,103 @@
+#ifndef CODIUS_SCRATCH_ARENA_H
+#define CODIUS_SCRATCH_ARENA_H
+
+#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Bookkeeping for the scratch memory inside a child, where rewritten syscall
+ * arguments are placed. Only addresses are handed out here; nothing is read
+ * or written.
+ *
+ * The first half of the arena is cut into equally sized slots, and each
+ * thread that needs scratch memory gets a slot of its own. That way a thread
+ * running its rewritten syscall isn't clobbered by another thread's handler.
+ * Allocations that don't fit their thread's slot go to the second half, which
+ * belongs to one thread at a time until that thread is rewound. An arena too
+ * small to split, like the buffer in a child's environment, is shared by
+ * every thread.
+ */
+class ScratchArena {
+public:
+  using Address = unsigned long;
+
+  ScratchArena();
+
+  /**
+   * Starts handing out [@p base, @p base + @p size), forgetting any previous
+   * region and allocations
+   *
+   * @param slotSize Bytes each thread can use before spilling over
+   */
+  void assign(Address base, size_t size, size_t slotSize = defaultSlotSize);
+
+  /**
+   * Returns the start of the region, or 0 if there is none
+   */
+  Address base() const;
+
+  /**
+   * Returns the size of the region
+   */
+  size_t size() const;
+
+  /**
+   * Allocates @p length bytes for thread @p tid, aligned to a word
+   *
+   * @return Address of the allocation, or 0 if it doesn't fit
+   */
+  Address allocate(pid_t tid, size_t length);
+
+  /**
+   * Gives back an allocation if it is still the latest one of thread @p tid,
+   * and was made since its last rewind(). Anything else is left until then.
+   */
+  void release(pid_t tid, Address addr, size_t length, uint64_t epoch);
+
+  /**
+   * Frees everything thread @p tid has allocated
+   */
+  void rewind(pid_t tid);
+
+  /**
+   * Frees everything thread @p tid has allocated, and gives its slot to the
+   * next thread that needs one
+   */
+  void forget(pid_t tid);
+
+  /**
+   * Counter that changes with every rewind(), for release()
+   */
+  uint64_t epoch() const;
+
+  /**
+   * Returns the largest allocation that fits in a thread's slot
+   */
+  size_t slotSize() const;
+
+  /**
+   * Size of a slot unless given to assign()
+   */
+  static constexpr size_t defaultSlotSize = 1024;
+
+private:
+  struct Slot {
+    pid_t tid;
+    Address start;
+    Address end;
+    Address next;
+  };
+
+  Slot* slotFor(pid_t tid, bool create);
+  static Address take(Slot& slot, size_t length);
+
+  Address m_base;
+  size_t m_size;
+  size_t m_slotSize;
+  std::vector<Slot> m_slots;
+  Slot m_overflow;
+  uint64_t m_epoch;
+};
+
+#endif // CODIUS_SCRATCH_ARENA_H
@@ -0,0 +1,51 @@
+#ifndef CODIUS_SPAWN_HELPER_H
+#define CODIUS_SPAWN_HELPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * What SpawnPool and codius-spawn-helper say to each other.
+ *
+ * The pool starts the helper once, with its end of a socket on
+ * @ref spawnHelperFD, and sends it the filter that warm children install:
+ * a uint32_t count of instructions followed by the instructions. From then
+ * on, every byte the pool writes asks for one more warm child. The helper
+ * answers each with the child's pid_t, carrying the pool's end of the child's
+ * control socket as SCM_RIGHTS. The helper exits once the pool closes its
+ * end.
+ *
+ * Once the pool has seized a warm child, it sends the child a SpawnPayload
+ * with the descriptors the child gets, then the argv and environment
+ * strings, each NUL terminated. The child installs the filter it was forked
+ * with and execs.
+ */
+
+/**
+ * Where the helper finds its socket to the pool
+ */
+static const int spawnHelperFD = 3;
+
+/**
+ * Where a warm child finds its control socket, out of the way of any
+ * descriptor a payload might want to use
+ */
+static const int warmControlFD = 512;
+
+/**
+ * Most file descriptors a warm child can be given
+ */
+static const size_t spawnMaxFDs = 16;
+
+/**
+ * Sent to a warm child along with the file descriptors it should use
+ */
+struct SpawnPayload {
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t fdCount;
+  uint64_t stringLength;
+  int dupAs[spawnMaxFDs];
+};
+
+#endif // CODIUS_SPAWN_HELPER_H
@@ -0,0 +1,102 @@
+#ifndef CODIUS_SPAWN_POOL_H
+#define CODIUS_SPAWN_POOL_H
+
+#include "syscall-policy.h"
+#include "spawn-helper.h"
+
+#include <unistd.h>
+#include <uv.h>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Children forked ahead of time, so that Sandbox::spawn() doesn't have to
+ * fork on the request path.
+ *
+ * Warm children are forked by codius-spawn-helper, a small process that the
+ * pool starts once with spawnVM(), rather than by the process running the
+ * sandboxes. Neither the loop nor a large heap is held up by fork, and no
+ * copy-on-write copy of that heap is kept around for each warm child. A warm
+ * child has already closed the file descriptors it inherited, moved into its
+ * own process group and been given the compiled seccomp filter. It then waits
+ * for the program to run, its environment and IPC channels to arrive over a
+ * socket, and installs the filter right before exec.
+ *
+ * The helper is started by the first spawn(), with that call's filter, which
+ * is then the only filter the pool serves. A warm child lets the process that
+ * created the pool trace it with PR_SET_PTRACER, and is seized with
+ * PTRACE_SEIZE as it is handed out. Pools must be created and used on the
+ * libuv default loop, and are only used for Sandbox::Backend::Ptrace without
+ * a tracer thread. A warm child that dies while it waits is replaced, unless
+ * more of them die in a row than the pool holds.
+ */
+class SpawnPool {
+public:
+  /**
+   * Constructor. Nothing is started until the first spawn().
+   *
+   * @param size Number of warm children to keep around
+   * @param helper Path of the codius-spawn-helper executable
+   */
+  SpawnPool(size_t size, const std::string& helper);
+  ~SpawnPool();
+
+  /**
+   * Starts a program in one of the warm children, seized with @p options.
+   * The helper is asked for a replacement right away.
+   *
+   * The first call starts the helper with @p filter and returns -1, for the
+   * caller to start this child itself. Later calls only take a warm child
+   * if @p filter is that same program, as handed out by
+   * SyscallPolicy::cachedBPF() for equal policies.
+   *
+   * @param argv Arguments, as for execv(3)
+   * @param envp Environment, as "NAME=value" strings
+   * @param fds Pairs of (our file descriptor, number it gets in the child)
+   * @param filter Seccomp filter the child has to run under
+   * @param options Options for PTRACE_SEIZE
+   * @return PID of the child, or -1 if no warm child was available
+   */
+  pid_t spawn(char** argv, const std::vector<std::string>& envp,
+              const std::vector<std::pair<int, int> >& fds,
+              const SyscallPolicy::Program& filter, long options);
+
+  /**
+   * Returns the number of warm children that are ready right now
+   */
+  size_t available() const;
+
+  /**
+   * Most file descriptors a warm child can be given
+   */
+  static constexpr size_t maxFDs = spawnMaxFDs;
+
+private:
+  struct Child {
+    pid_t pid;
+    int control;
+    uv_poll_t* watch;
+  };
+
+  bool startHelper(const SyscallPolicy::Program& filter);
+  void stopHelper();
+  void topUp();
+  void discard(const Child& child, bool seized);
+  static void unwatch(const Child& child);
+  static void helperReply(uv_poll_t* handle, int status, int events);
+  static void childGone(uv_poll_t* handle, int status, int events);
+
+  size_t m_size;
+  std::string m_helperPath;
+  SyscallPolicy::Program m_filter;
+  pid_t m_helper;
+  int m_helperSocket;
+  uv_poll_t* m_helperWatch;
+  size_t m_pending;
+  size_t m_lost;
+  std::deque<Child> m_children;
+};
+
+#endif // CODIUS_SPAWN_POOL_H
@@ -0,0 +1,65 @@
+#ifndef CODIUS_SPAWN_VM_H
+#define CODIUS_SPAWN_VM_H
+
+#include <linux/filter.h>
+#include <signal.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Everything a child started by spawnVM() needs, prepared by the parent.
+ * The child shares our memory until it execs, so it must not allocate.
+ */
+struct VMSpawnArgs {
+  /**
+   * Program to exec, as a path
+   */
+  const char* path;
+
+  /**
+   * Arguments and environment, as for execve(2)
+   */
+  char** argv;
+  char** envp;
+
+  /**
+   * Pairs of (our file descriptor, number it gets in the child)
+   */
+  std::vector<std::pair<int, int> > fds;
+
+  /**
+   * Descriptors the child keeps open, including the targets of @ref fds
+   */
+  std::vector<int> keep;
+
+  /**
+   * If set, the child moves into its own process group, asks to be traced
+   * and installs this filter before exec. Otherwise it just execs.
+   */
+  const std::vector<struct sock_filter>* filter;
+
+  /**
+   * Signal mask to restore in the child. Filled in by spawnVM().
+   */
+  sigset_t mask;
+};
+
+/**
+ * Starts a child with clone(CLONE_VM | CLONE_VFORK), so that none of our
+ * memory has to be copied, or its pages marked copy-on-write, for a child
+ * that is about to exec anyway. Returns once the child has exec'd or died.
+ *
+ * @return PID of the child, or -1 if it has to be forked after all
+ */
+pid_t spawnVM(VMSpawnArgs& args);
+
+/**
+ * Installs @p filter with a raw seccomp(2) call, which unlike
+ * seccomp_load() is safe between fork and exec
+ *
+ * @return As for seccomp(2)
+ */
+int installFilter(const std::vector<struct sock_filter>& filter, unsigned int flags);
+
+#endif // CODIUS_SPAWN_VM_H
@@ -0,0 +1,164 @@
+#ifndef SYSCALL_POLICY_H
+#define SYSCALL_POLICY_H
+
+#include <seccomp.h>
+#include <linux/filter.h>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Table of rules describing how the seccomp filter treats each syscall made
+ * inside a sandbox. The table is compiled into a BPF program the first time
+ * a child is spawned with it. Any syscall not matched by a rule kills the
+ * child.
+ *
+ * Rules may compare syscall arguments, so that only some uses of a syscall are
+ * trapped while the rest run directly in the kernel.
+ */
+class SyscallPolicy {
+public:
+  /**
+   * What happens when a rule matches
+   */
+  enum class Action {
+    /**
+     * The child is killed
+     */
+    Kill,
+
+    /**
+     * The syscall runs in the kernel without involving the sandbox
+     */
+    Allow,
+
+    /**
+     * The syscall is passed to the handler registered with
+     * Sandbox::claimSyscall()
+     */
+    Trap,
+
+    /**
+     * The syscall is not run, and returns a fixed error number without
+     * involving the sandbox. An error number of 0 makes it return 0.
+     */
+    Errno
+  };
+
+  /**
+   * How the compiled filter finds the rules for a syscall
+   */
+  enum class Layout {
+    /**
+     * Syscalls are checked one after another, highest priority first
+     */
+    Linear,
+
+    /**
+     * Syscalls are found with a binary search on their number, so every
+     * syscall costs roughly the same. Needs libseccomp 2.5 or later, and
+     * falls back to Layout::Linear otherwise.
+     */
+    BinaryTree
+  };
+
+  using Condition = struct scmp_arg_cmp;
+
+  struct Rule {
+    int syscall;
+    Action action;
+    int errnum;
+    std::vector<Condition> conditions;
+  };
+
+  /**
+   * Kill the child when @p syscall is called
+   */
+  void kill(int syscall);
+
+  /**
+   * Let @p syscall run in the kernel when all of @p conditions match
+   */
+  void allow(int syscall, std::initializer_list<Condition> conditions = {});
+
+  /**
+   * Pass @p syscall to the sandbox's handlers when all of @p conditions match
+   */
+  void trap(int syscall, std::initializer_list<Condition> conditions = {});
+
+  /**
+   * Make @p syscall return @p errnum without running when all of
+   * @p conditions match
+   */
+  void fail(int syscall, int errnum, std::initializer_list<Condition> conditions = {});
+
+  /**
+   * Removes every rule for @p syscall, so it can be given new rules
+   */
+  void remove(int syscall);
+
+  /**
+   * Returns the rules in this policy, in the order they were added
+   */
+  const std::vector<Rule>& rules() const;
+
+  /**
+   * Sets how early @p syscall is checked in a Layout::Linear filter. Higher
+   * priorities are checked first. Syscalls without a priority are checked
+   * last.
+   */
+  void setPriority(int syscall, uint8_t priority);
+
+  /**
+   * Sets the layout of the compiled filter. Defaults to Layout::BinaryTree.
+   */
+  void setLayout(Layout layout);
+
+  Layout getLayout() const;
+
+  /**
+   * Builds a libseccomp filter from this policy. The caller owns the result
+   * and must free it with seccomp_release().
+   *
+   * @param trapAction libseccomp action used for Action::Trap rules
+   * @return A filter context, or null on failure
+   */
+  scmp_filter_ctx compile(uint32_t trapAction) const;
+
+  /**
+   * Compiles this policy and returns the BPF program the kernel would run,
+   * e.g. to measure its length.
+   *
+   * @param trapAction libseccomp action used for Action::Trap rules
+   * @return The program's instructions, or nothing on failure
+   */
+  std::vector<struct sock_filter> exportBPF(uint32_t trapAction) const;
+
+  using Program = std::shared_ptr<const std::vector<struct sock_filter> >;
+
+  /**
+   * Like exportBPF(), but each distinct policy is only compiled once per
+   * process, and the result shared by every caller after that. Safe to call
+   * from any thread.
+   *
+   * @param trapAction libseccomp action used for Action::Trap rules
+   * @return The program's instructions, or null on failure
+   */
+  Program cachedBPF(uint32_t trapAction) const;
+
+  /**
+   * Returns the policy used by sandboxes that are not given one
+   */
+  static SyscallPolicy defaultPolicy();
+
+private:
+  void add(int syscall, Action action, int errnum, std::initializer_list<Condition> conditions);
+  std::string cacheKey(uint32_t trapAction) const;
+  std::vector<Rule> m_rules;
+  std::map<int, uint8_t> m_priorities;
+  Layout m_layout = Layout::BinaryTree;
+};
+
+#endif // SYSCALL_POLICY_H
@@ -4,34 +4,70 @@
 #include "dirent-builder.h"
 #include "sandbox.h"
 #include "filesystem.h"
+#include "mount-table.h"
+#include "path-resolver.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 class File {
 public:
-  File(int localFD, const std::string& path, std::shared_ptr<Filesystem>& fs);
+  File(int localFD, int flags, const std::string& path, std::shared_ptr<Filesystem>& fs, int virtualFD = -1);
   ~File();
 
   using Ptr = std::shared_ptr<File>;
 
   int localFD() const;
   int virtualFD() const;
+  int flags() const;
   std::shared_ptr<Filesystem> fs() const;
 
   int close();
+
+  /**
+   * Gets the attributes of this file. They are kept until the file is
+   * written to or invalidateAttributes() is called.
+   */
   int fstat(struct stat* buf);
+  bool attributesCached() const;
+  void invalidateAttributes();
+
   int getdents(struct linux_dirent* dirs, unsigned int count);
   ssize_t read(void* buf, size_t count);
   off_t lseek(off_t offset, int whence);
   ssize_t write(void* buf, size_t count);
 
+  /**
+   * Returns a host file descriptor with the contents of this file, for
+   * mmap(). Files without one in their Filesystem are copied into a sealed
+   * memfd, which is kept until the file is written to or closed.
+   *
+   * @return File descriptor owned by this File, or -1 with errno set
+   */
+  int mapFD();
+
+  /**
+   * Opens this file again on @p fs, where its path leads in another VFS.
+   * The new file starts at the same offset, but doesn't share it.
+   *
+   * @param localPath Path of this file within @p fs
+   * @return File descriptor local to @p fs, or a negative value on failure
+   * @see Filesystem::reopen()
+   */
+  int reopen(Filesystem& fs, const std::string& localPath);
+
   std::string path() const;
 
 private:
-  static int s_nextFD;
   int m_localFD;
+  int m_mapFD;
   int m_virtualFD;
+  int m_flags;
+  bool m_attrValid;
+  struct stat m_attr;
   std::string m_path;
   std::shared_ptr<Filesystem> m_fs;
 };
@@ -49,19 +85,25 @@ public:
   VFS(Sandbox* sandbox);
 
   /**
-   * Handles filesystem related syscalls
+   * Registers handlers for filesystem related syscalls with the sandbox.
+   * Sandbox::claimSyscall() lists them.
    */
-  Sandbox::SyscallCall handleSyscall(const Sandbox::SyscallCall& call);
+  void claimSyscalls();
 
   /**
-   * Copies a string out of a sandboxed process' memory
+   * Copies a path out of a sandboxed process' memory
    *
-   * @see Sandbox::copyString()
+   * @param fname String the path is stored in
+   * @return 0 on success, -EFAULT if @p addr could not be read, or
+   * -ENAMETOOLONG if no null byte was found within PATH_MAX bytes
+   * @see Sandbox::readString()
    */
-  std::string getFilename(pid_t pid, Sandbox::Address addr) const;
+  int getFilename(pid_t pid, Sandbox::Address addr, std::string& fname) const;
 
   /**
-   * Get the filesystem and filesystem-specific path for a given path
+   * Get the filesystem and filesystem-specific path for a given path. The
+   * deepest filesystem mounted along @p path is used. Relative paths start
+   * from the current directory, and nothing but "." and ".." is resolved.
    *
    * @param path Path to use
    * @return A pair of (filesystem-local path, Filesystem object). If no such
@@ -73,9 +115,10 @@ public:
    * Get a previously-opened file from a virtual file descriptor
    *
    * @param fd Virtual file descriptor
-   * @return A previously opened File, or null pointer
+   * @return A previously opened File, or null pointer. It is owned by the
+   * VFS and stays valid until @p fd is closed.
    */
-  File::Ptr getFile(int fd) const;
+  File* getFile(int fd) const;
 
   /**
    * Determines if a given file descriptor number is within the range of virtual
@@ -93,10 +136,18 @@ public:
   static constexpr int firstVirtualFD = 4096;
 
   /**
-   * Mount a Filesystem onto a given path
+   * Mount a Filesystem onto a given path, which may be inside another mount
    */
   void mountFilesystem(const std::string& path, std::shared_ptr<Filesystem> fs);
 
+  /**
+   * Whether any mounted Filesystem must be called from the libuv default
+   * loop. Otherwise the syscall handlers may run on the tracer thread.
+   *
+   * @see Filesystem::needsLoop()
+   */
+  bool needsLoop() const;
+
   /**
    * Get the path of the current directory for this VFS
    *
@@ -113,16 +164,100 @@ public:
    */
   int setCWD(const std::string& path);
 
+  /**
+   * Finds the canonical path of @p path, following symlinks
+   *
+   * @param base Directory that relative paths start from
+   * @param followLast Whether a symlink in the last component is followed
+   * @param create Whether a missing last component is fine
+   * @param resolved Set to the canonical path
+   * @param dentry If given, set to the cached dentry of the canonical path
+   * @return 0 on success, negative error number otherwise
+   *
+   * @see PathResolver::resolve()
+   */
+  int resolvePath(const std::string& path, const std::string& base, bool followLast,
+                  bool create, std::string& resolved,
+                  const PathResolver::Dentry** dentry = nullptr);
+
+  /**
+   * Forgets what was looked up about paths, including which ones are
+   * missing, and the attributes of open files, for when files were changed
+   * behind the back of the VFS. Safe to call from the loop while a tracer
+   * thread runs the handlers: the cache is flushed by the handlers' thread,
+   * before the next call it handles.
+   */
+  void flushCache();
+
+  /**
+   * Sets how long a path that was found missing is answered with ENOENT
+   * without asking its Filesystem again. Takes effect like flushCache().
+   *
+   * @param ttl Time to live, or zero to keep it until flushCache()
+   */
+  void setNegativeCacheTTL(std::chrono::milliseconds ttl);
+
+  /**
+   * How often file attributes and path lookups were answered from the cache
+   */
+  struct CacheStats {
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  CacheStats cacheStats() const;
+
+  /**
+   * Takes over the open files and current directory of @p other, as a child
+   * forked from @p other's sandbox would. Each file is reopened on this
+   * VFS's own mounts, at the same offset and number, so that neither side
+   * sees the other's reads, seeks or closes. Files that can't be reopened
+   * are left closed.
+   */
+  void copyState(const VFS& other);
+
+  /**
+   * Sets whether regular files opened read-only are handed to the sandboxed
+   * process as real file descriptors, when their Filesystem has one. Reads
+   * on those then run natively without trapping, but are no longer seen by
+   * the Filesystem. Off by default.
+   *
+   * @see Filesystem::nativeFD()
+   */
+  void setDelegation(bool enabled);
+
 private:
   Sandbox* m_sbox;
-  std::map<std::string, std::shared_ptr <Filesystem>> m_mountpoints;
-  std::map<int, File::Ptr> m_openFiles;
+  MountTable m_mountpoints;
+  PathResolver m_resolver;
+  // Open files, indexed by fd - firstVirtualFD
+  std::vector<File::Ptr> m_files;
+  // Empty slots in m_files, as a min-heap
+  std::vector<int> m_freeSlots;
+  // Virtual fds open on each path, so changes only touch their own files
+  std::unordered_map<std::string, std::vector<int> > m_openPaths;
   std::vector<std::string> m_whitelist;
   File::Ptr m_cwd;
+  bool m_delegate;
+  bool m_needsLoop;
+  CacheStats m_fileStats;
+  // Cache changes asked for by flushCache() and setNegativeCacheTTL(), until
+  // applyCacheRequests() runs them on the handlers' thread
+  std::mutex m_requestLock;
+  std::atomic<bool> m_requestsPending;
+  bool m_flushRequested;
+  bool m_ttlRequested;
+  std::chrono::milliseconds m_requestedTTL;
+
+  void applyCacheRequests();
 
   bool isWhitelisted(const std::string& str);
+  void attributesChanged(const std::string& path);
 
-  void openFile(Sandbox::SyscallCall& call, const std::string& fname, int flags, mode_t mode);
+  std::string cwdPath() const;
+  void openFile(Sandbox::SyscallCall& call, const std::string& fname, const std::string& base, int flags, mode_t mode);
+  bool delegateFile(Sandbox::SyscallCall& call, Filesystem& fs, int fd, int flags);
+  void passThrough(Sandbox::SyscallCall& call, std::string fname);
 
   void do_open(Sandbox::SyscallCall& call);
   void do_close(Sandbox::SyscallCall& call);
@@ -132,6 +267,8 @@ private:
   void do_openat(Sandbox::SyscallCall& call);
   void do_lseek(Sandbox::SyscallCall& call);
   void do_write(Sandbox::SyscallCall& call);
+  void do_readv(Sandbox::SyscallCall& call);
+  void do_writev(Sandbox::SyscallCall& call);
   void do_access(Sandbox::SyscallCall& call);
   void do_chdir(Sandbox::SyscallCall& call);
   void do_fchdir(Sandbox::SyscallCall& call);
@@ -139,8 +276,11 @@ private:
   void do_lstat(Sandbox::SyscallCall& call);
   void do_getcwd(Sandbox::SyscallCall& call);
   void do_readlink(Sandbox::SyscallCall& call);
+  void do_mmap(Sandbox::SyscallCall& call);
 
-  File::Ptr makeFile (int fd, const std::string& path, std::shared_ptr<Filesystem>& fs);
+  File::Ptr makeFile (int fd, int flags, const std::string& path, std::shared_ptr<Filesystem>& fs);
+  File::Ptr cloneFile (File& file, int virtualFD);
+  void releaseFD (int fd);
 };
 
 #endif // VFS_H
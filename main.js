@@ -31,6 +31,14 @@ inherits(Sandbox, events.EventEmitter);
  */
 exports.Sandbox = Sandbox;
 
+/**
+ * Keeps the given number of children forked ahead of time, so that spawning
+ * with the ptrace backend doesn't have to fork. 0 turns the pool off.
+ * @function setSpawnPoolSize
+ * @param {number} size
+ */
+exports.setSpawnPoolSize = nativeModule.setSpawnPoolSize;
+
 /**
  * Called when a filename used in open(), stat(), etc should be mapped from a
  * real filename to one within the sandbox's environment
@@ -108,6 +116,14 @@ Sandbox.prototype.onData = function (fd, chunk) {
  * @instance
  */
 
+/**
+ * Forget which paths were looked up and found missing or symlinked. Call it
+ * after changing files that the sandbox can see.
+ * @function flushFilesystemCache
+ * @memberof Sandbox
+ * @instance
+ */
+
 /** 
  * Launch GDB when the child crashes
  * @member debuggerOnCrash
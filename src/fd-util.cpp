@@ -0,0 +1,115 @@
+#include "fd-util.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+// Nothing in here allocates, since it may run in a child that shares our
+// memory
+
+/**
+ * Closes everything but @p keep with one close_range() call per gap between
+ * the descriptors that are kept.
+ *
+ * @return false if the kernel supports neither close_range() nor @p flags,
+ * in which case nothing was closed
+ */
+static bool
+close_ranges (const std::vector<int>& keep, unsigned int flags)
+{
+  unsigned int first = 0;
+
+  while (true) {
+    unsigned int next = ~0U;
+
+    // Lowest kept descriptor from first on, rather than sorting a copy
+    for (auto i = keep.cbegin(); i != keep.cend(); i++) {
+      if (*i >= 0 && static_cast<unsigned int>(*i) >= first)
+        next = std::min (next, static_cast<unsigned int>(*i));
+    }
+
+    if (next == ~0U)
+      return syscall (__NR_close_range, first, ~0U, flags) == 0;
+
+    if (next > first && syscall (__NR_close_range, first, next - 1, flags) < 0)
+      return false;
+
+    first = next + 1;
+  }
+}
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[256];
+};
+
+/**
+ * Fallback for kernels older than 5.9, which closes whatever /proc lists
+ */
+static void
+close_listed (const std::vector<int>& keep)
+{
+  char buf[4096];
+  int dir = open ("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  bool closed = true;
+  long length;
+
+  if (dir < 0)
+    return;
+
+  // Entries can be skipped when closing while reading the directory, so
+  // read it again until there is nothing left to close
+  while (closed) {
+    closed = false;
+    lseek (dir, 0, SEEK_SET);
+
+    while ((length = syscall (SYS_getdents64, dir, buf, sizeof (buf))) > 0) {
+      for (long offset = 0; offset < length;) {
+        struct linux_dirent64* dp = reinterpret_cast<struct linux_dirent64*>(buf + offset);
+        char* end = NULL;
+        int fdnum;
+
+        offset += dp->d_reclen;
+        fdnum = strtol (dp->d_name, &end, 10);
+
+        if (end == dp->d_name || fdnum == dir)
+          continue;
+
+        if (std::find (keep.cbegin(), keep.cend(), fdnum) == keep.cend()) {
+          close (fdnum);
+          closed = true;
+        }
+      }
+    }
+  }
+
+  close (dir);
+}
+
+void
+closeInheritedFDs(const std::vector<int>& keep, bool onExec)
+{
+  // CLOSE_RANGE_CLOEXEC only needs 5.11, and saves closing every socket of a
+  // busy host one by one
+  if (onExec && close_ranges (keep, CLOSE_RANGE_CLOEXEC))
+    return;
+
+  if (close_ranges (keep, 0))
+    return;
+
+  close_listed (keep);
+}
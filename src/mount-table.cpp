@@ -0,0 +1,111 @@
+#include "mount-table.h"
+
+#include <algorithm>
+#include <string.h>
+
+/**
+ * Orders names like std::string does, without needing one to compare with
+ */
+static int
+compare_name (const std::string& name, const char* other, size_t length)
+{
+  int ret = memcmp (name.data(), other, std::min (name.size(), length));
+
+  if (ret != 0)
+    return ret;
+  if (name.size() == length)
+    return 0;
+  return name.size() < length ? -1 : 1;
+}
+
+const MountTable::Node*
+MountTable::Node::child(const char* name, size_t length) const
+{
+  auto i = std::lower_bound (children.cbegin(), children.cend(), name,
+      [length](const std::unique_ptr<Node>& node, const char* name) {
+        return compare_name (node->name, name, length) < 0;
+      });
+
+  if (i != children.cend() && compare_name ((*i)->name, name, length) == 0)
+    return i->get();
+  return nullptr;
+}
+
+MountTable::MountTable()
+  : m_size (0)
+{
+}
+
+void
+MountTable::mount(const std::string& path, std::shared_ptr<Filesystem> fs)
+{
+  Node* node = &m_root;
+  size_t start = 0;
+
+  while (start < path.size()) {
+    size_t end = path.find ('/', start);
+    if (end == std::string::npos)
+      end = path.size();
+
+    if (end > start) {
+      std::string name (path, start, end - start);
+      auto i = std::lower_bound (node->children.begin(), node->children.end(), name,
+          [](const std::unique_ptr<Node>& node, const std::string& name) {
+            return node->name < name;
+          });
+
+      if (i == node->children.end() || (*i)->name != name) {
+        std::unique_ptr<Node> child (new Node);
+        child->name = name;
+        i = node->children.insert (i, std::move (child));
+      }
+      node = i->get();
+    }
+
+    start = end + 1;
+  }
+
+  if (!node->fs)
+    m_size++;
+  node->fs = fs;
+}
+
+MountTable::Match
+MountTable::lookup(const char* path, size_t length) const
+{
+  const Node* node = &m_root;
+  Match match = {nullptr, path, length};
+  size_t start = 0;
+
+  if (length == 0 || path[0] != '/')
+    return match;
+
+  if (node->fs)
+    match.fs = &node->fs;
+
+  while (start < length) {
+    const char* end = static_cast<const char*>(memchr (path + start, '/', length - start));
+    size_t stop = end ? end - path : length;
+
+    if (stop > start) {
+      node = node->child (path + start, stop - start);
+      if (!node)
+        break;
+      if (node->fs) {
+        match.fs = &node->fs;
+        match.rest = path + stop;
+        match.restLength = length - stop;
+      }
+    }
+
+    start = stop + 1;
+  }
+
+  return match;
+}
+
+size_t
+MountTable::size() const
+{
+  return m_size;
+}
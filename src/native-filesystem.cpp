@@ -78,3 +78,24 @@ NativeFilesystem::readlink(const char* name, char* buf, size_t bufsize)
 {
   return ::readlink (name, buf, bufsize);
 }
+
+int
+NativeFilesystem::nativeFD(int fd)
+{
+  return fd;
+}
+
+bool
+NativeFilesystem::needsLoop() const
+{
+  return false;
+}
+
+int
+NativeFilesystem::reopen(const char* name, int flags, int native)
+{
+  // Unlike dup(), a new open file description has its own offset
+  if (native >= 0)
+    return ::open (("/proc/self/fd/" + std::to_string (native)).c_str(), flags);
+  return open (name, flags, 0);
+}
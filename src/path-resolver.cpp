@@ -0,0 +1,267 @@
+#include "path-resolver.h"
+#include "filesystem.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+// Same limit as Linux
+static const int maxSymlinks = 40;
+
+/**
+ * Turns what a Filesystem call returned, which is either -1 with errno set
+ * or a negative error number on failure, into an error number
+ *
+ * @return Error number, or 0 on success
+ */
+static int
+fs_error (int ret)
+{
+  if (ret >= 0)
+    return 0;
+  return ret == -1 ? errno : -ret;
+}
+
+PathResolver::PathResolver(const MountTable& mounts, size_t capacity)
+  : m_mounts (mounts),
+    m_capacity (capacity),
+    m_generation (0),
+    m_hits (0),
+    m_misses (0),
+    m_negativeTTL (0)
+{
+}
+
+std::string
+PathResolver::normalize(const std::string& path, const std::string& base)
+{
+  std::string out;
+  const std::string* parts[] = {&base, &path};
+
+  for (int i = (!path.empty() && path[0] == '/') ? 1 : 0; i < 2; i++) {
+    const std::string& part = *parts[i];
+    size_t start = 0;
+
+    while (start <= part.size()) {
+      size_t end = part.find ('/', start);
+      if (end == std::string::npos)
+        end = part.size();
+
+      size_t length = end - start;
+      if (length == 2 && part.compare (start, 2, "..") == 0) {
+        out.resize (out.rfind ('/') == std::string::npos ? 0 : out.rfind ('/'));
+      } else if (length > 0 && !(length == 1 && part[start] == '.')) {
+        out += '/';
+        out.append (part, start, length);
+      }
+
+      start = end + 1;
+    }
+  }
+
+  if (out.empty())
+    out = "/";
+  return out;
+}
+
+/**
+ * Returns the dentry of canonical path @p path, asking its Filesystem if it
+ * isn't cached
+ *
+ * @return The dentry, or nullptr if the Filesystem failed with something
+ * other than ENOENT. It stays valid until the next lookup.
+ */
+const PathResolver::Dentry*
+PathResolver::lookup(const std::string& path)
+{
+  auto cached = m_index.find (path);
+  if (cached != m_index.end()) {
+    const Cached& entry = cached->second->second;
+    if (entry.generation == m_generation &&
+        (entry.dentry.exists || m_negativeTTL.count() == 0 ||
+         std::chrono::steady_clock::now() < entry.expires)) {
+      m_lru.splice (m_lru.begin(), m_lru, cached->second);
+      m_hits++;
+      return &entry.dentry;
+    }
+    m_lru.erase (cached->second);
+    m_index.erase (cached);
+  }
+
+  Dentry dentry;
+  MountTable::Match match = m_mounts.lookup (path.data(), path.size());
+
+  m_misses++;
+  dentry.exists = false;
+  memset (&dentry.attr, 0, sizeof (dentry.attr));
+
+  if (match.fs) {
+    std::string rest (match.restLength ? std::string (match.rest, match.restLength) : "/");
+    int err = fs_error ((*match.fs)->lstat (rest.c_str(), &dentry.attr));
+
+    if (err == 0)
+      dentry.exists = true;
+    else if (err != ENOENT)
+      return nullptr;
+
+    if (dentry.exists && S_ISLNK (dentry.attr.st_mode)) {
+      std::vector<char> buf (PATH_MAX);
+      ssize_t length = (*match.fs)->readlink (rest.c_str(), buf.data(), buf.size());
+      if (length <= 0 || static_cast<size_t>(length) >= buf.size())
+        return nullptr;
+      dentry.link.assign (buf.data(), length);
+    }
+  }
+
+  if (m_capacity == 0) {
+    m_uncached = dentry;
+    return &m_uncached;
+  }
+
+  while (m_lru.size() >= m_capacity) {
+    m_index.erase (m_lru.back().first);
+    m_lru.pop_back();
+  }
+
+  Cached entry = {dentry, m_generation, std::chrono::steady_clock::time_point()};
+  if (!dentry.exists && m_negativeTTL.count() > 0)
+    entry.expires = std::chrono::steady_clock::now() + m_negativeTTL;
+
+  m_lru.push_front (std::make_pair (path, entry));
+  m_index[path] = m_lru.begin();
+  return &m_lru.front().second.dentry;
+}
+
+int
+PathResolver::resolve(const std::string& path, const std::string& base, bool followLast,
+                      std::string& resolved, bool& missing, const Dentry** dentry)
+{
+  // Walked one component at a time, so that ".." is taken from wherever
+  // the symlinks before it led, as the kernel does
+  std::string pending (!path.empty() && path[0] == '/' ? path : base + "/" + path);
+  std::string done;
+  const Dentry* found = nullptr;
+  // A trailing slash asks for a directory, following a symlink to one
+  bool wantDir = !path.empty() && path.back() == '/';
+  bool foundDone = true;
+  int links = 0;
+  size_t start = 0;
+
+  missing = false;
+
+  while ((start = pending.find_first_not_of ('/', start)) != std::string::npos) {
+    size_t end = pending.find ('/', start);
+    if (end == std::string::npos)
+      end = pending.size();
+
+    size_t length = end - start;
+    bool last = pending.find_first_not_of ('/', end) == std::string::npos;
+
+    if (length == 1 && pending[start] == '.') {
+      start = end;
+      continue;
+    }
+
+    if (length == 2 && pending.compare (start, 2, "..") == 0) {
+      done.resize (done.rfind ('/') == std::string::npos ? 0 : done.rfind ('/'));
+      foundDone = false;
+      start = end;
+      continue;
+    }
+
+    std::string next (done + "/" + pending.substr (start, length));
+    found = lookup (next);
+    foundDone = true;
+
+    // Left for the Filesystem to fail on
+    if (!found) {
+      done = normalize (next + pending.substr (end), "/");
+      break;
+    }
+
+    if (!found->exists) {
+      if (!last)
+        return -ENOENT;
+      missing = true;
+      done = next;
+      break;
+    }
+
+    if (S_ISLNK (found->attr.st_mode) && (followLast || wantDir || !last)) {
+      if (++links > maxSymlinks)
+        return -ELOOP;
+      // Relative links start from the directory holding them, which is
+      // what done still is
+      if (!found->link.empty() && found->link[0] == '/')
+        done.clear();
+      pending = found->link + "/" + pending.substr (end);
+      foundDone = false;
+      start = 0;
+      continue;
+    }
+
+    if ((wantDir || !last) && !S_ISDIR (found->attr.st_mode))
+      return -ENOTDIR;
+
+    done = next;
+    start = end;
+  }
+
+  // Ended on "." or "..", so the dentry is of the directory they led to
+  if (!foundDone)
+    found = done.empty() ? nullptr : lookup (done);
+
+  resolved = done.empty() ? "/" : done;
+  if (dentry)
+    *dentry = found;
+  return 0;
+}
+
+void
+PathResolver::invalidate(const std::string& path)
+{
+  auto cached = m_index.find (path);
+  if (cached != m_index.end()) {
+    m_lru.erase (cached->second);
+    m_index.erase (cached);
+  }
+}
+
+void
+PathResolver::clear()
+{
+  m_lru.clear();
+  m_index.clear();
+}
+
+void
+PathResolver::newGeneration()
+{
+  m_generation++;
+}
+
+void
+PathResolver::setNegativeTTL(std::chrono::milliseconds ttl)
+{
+  m_negativeTTL = ttl;
+}
+
+size_t
+PathResolver::size() const
+{
+  return m_lru.size();
+}
+
+unsigned long
+PathResolver::hits() const
+{
+  return m_hits;
+}
+
+unsigned long
+PathResolver::misses() const
+{
+  return m_misses;
+}
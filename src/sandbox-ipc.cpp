@@ -1,8 +1,10 @@
 #include "sandbox-ipc.h"
+#include <poll.h>
 #include <unistd.h>
 
 SandboxIPC::SandboxIPC(int _dupAs)
-  : dupAs (_dupAs)
+  : poll (nullptr),
+    dupAs (_dupAs)
 {
   int ipc_fds[2];
   socketpair (AF_UNIX, SOCK_STREAM, 0, ipc_fds);
@@ -10,9 +12,17 @@ SandboxIPC::SandboxIPC(int _dupAs)
   parent = ipc_fds[IPC_PARENT_IDX];
 }
 
+static void
+free_poll (uv_handle_t* handle)
+{
+  delete reinterpret_cast<uv_poll_t*>(handle);
+}
+
 SandboxIPC::~SandboxIPC()
 {
-  stopPoll();
+  // libuv keeps hold of the handle until it is closed, which also stops it
+  if (poll)
+    uv_close (reinterpret_cast<uv_handle_t*>(poll), free_poll);
   close (child);
   close (parent);
 }
@@ -52,9 +62,12 @@ CallbackIPC::onReadReady()
 bool
 SandboxIPC::startPoll(uv_loop_t* loop)
 {
-  uv_poll_init_socket (loop, &poll, parent);
-  poll.data = this;
-  if (uv_poll_start (&poll, UV_READABLE, SandboxIPC::cb_forward) < 0)
+  if (!poll) {
+    poll = new uv_poll_t;
+    uv_poll_init_socket (loop, poll, parent);
+    poll->data = this;
+  }
+  if (uv_poll_start (poll, UV_READABLE, SandboxIPC::cb_forward) < 0)
     return false;
   return true;
 }
@@ -62,7 +75,26 @@ SandboxIPC::startPoll(uv_loop_t* loop)
 bool
 SandboxIPC::stopPoll()
 {
-  if (uv_poll_stop (&poll) < 0)
+  if (!poll || uv_poll_stop (poll) < 0)
     return false;
   return true;
 }
+
+void
+SandboxIPC::drain()
+{
+  struct pollfd fd = {parent, POLLIN, 0};
+
+  // Bounded, in case onReadReady() leaves data behind
+  for (int i = 0; i < 64 && ::poll (&fd, 1, 0) > 0 && (fd.revents & POLLIN); i++)
+    onReadReady();
+}
+
+void
+SandboxIPC::adopt(int parentFD)
+{
+  close (child);
+  close (parent);
+  child = -1;
+  parent = parentFD;
+}
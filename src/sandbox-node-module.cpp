@@ -4,14 +4,22 @@
 
 #include "vfs.h"
 #include "node-filesystem.h"
+#include "syscall-policy.h"
+#include "spawn-pool.h"
 #include <node.h>
 #include <vector>
 #include <v8.h>
 #include <memory>
 #include <iostream>
 #include <asm/unistd.h>
+#include <dlfcn.h>
 #include <error.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <future>
 
@@ -56,6 +64,25 @@ NodeSandbox::NodeSandbox(SandboxWrapper* _wrap)
     m_debuggerOnCrash(false)
 {
   getVFS().mountFilesystem (std::string("/"), std::shared_ptr<Filesystem>(new CodiusNodeFilesystem (this)));
+
+  // Nothing claims these, so there is no point in trapping them
+  SyscallPolicy policy (getPolicy());
+  //FIXME: getsockopt and setsockopt need emulation
+  policy.remove (SCMP_SYS (getsockopt));
+  policy.allow (SCMP_SYS (getsockopt));
+  policy.remove (SCMP_SYS (setsockopt));
+  policy.allow (SCMP_SYS (setsockopt));
+  policy.remove (SCMP_SYS (uname));
+  policy.allow (SCMP_SYS (uname));
+  policy.remove (SCMP_SYS (getrlimit));
+  policy.allow (SCMP_SYS (getrlimit));
+  setPolicy (policy);
+
+  //FIXME: getsockname should return what was originally passed in via bind()
+  //or similar
+  claimSyscall (__NR_bind, [this](SyscallCall& call) {handleBind (call);});
+  claimSyscall (__NR_socket, [this](SyscallCall& call) {handleSocket (call);});
+  claimSyscall (__NR_execve, [this](SyscallCall& call) {kill();});
 }
 
 std::vector<char>
@@ -90,47 +117,86 @@ Sandbox::SyscallCall
 NodeSandbox::mapFilename(const SyscallCall& call)
 {
   SyscallCall ret (call);
-  std::vector<char> fname (1024);
-  copyString (call.pid, call.args[0], fname.size(), fname.data());
+  std::string path;
+  if (!readString (call.pid, call.args[0], PATH_MAX, path)) {
+    ret.id = -1;
+    ret.returnVal = errno == ENAMETOOLONG ? -ENAMETOOLONG : -EFAULT;
+    return ret;
+  }
+  std::vector<char> fname (path.c_str(), path.c_str() + path.size() + 1);
   fname = mapFilename (fname);
   if (fname.size()) {
     ret.args[0] = writeScratch (fname.size(), fname.data());
+    if (!ret.args[0]) {
+      ret.id = -1;
+      ret.returnVal = -ENAMETOOLONG;
+    }
   } else {
     ret.id = -1;
   }
   return ret;
 }
 
-Sandbox::SyscallCall
-NodeSandbox::handleSyscall(const SyscallCall &call)
+/**
+ * Makes every socket a unix domain socket. Calls can't be rewritten with user
+ * notifications, so the socket is made here and handed over instead.
+ */
+void
+NodeSandbox::handleSocket(SyscallCall& call)
 {
-  SyscallCall ret (call);
+  if (getBackend() != Backend::UserNotification) {
+    call.args[0] = AF_UNIX;
+    return;
+  }
 
-  if (ret.id == __NR_getsockname) {
-    //FIXME: Should return what was originally passed in via bind() or
-    //similar
-  } else if (ret.id == __NR_getsockopt) {
-    //FIXME: Needs emulation
-  } else if (ret.id == __NR_setsockopt) {
-    //FIXME: Needs emulation
-  } else if (ret.id == __NR_bind) {
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    snprintf (addr.sun_path, sizeof (addr.sun_path), "/tmp/codius-sandbox-socket-%d-%d", getChildPID(), static_cast<int>(ret.args[0]));
-    ret.args[1] = writeScratch (sizeof (addr), reinterpret_cast<char*>(&addr));
-    ret.args[2] = sizeof (addr);
-    std::vector<Handle<Value> > args = {
-      String::New (addr.sun_path)
-    };
-    emitEvent ("newSocket", args);
-  } else if (ret.id == __NR_socket) {
-    ret.args[0] = AF_UNIX;
-  } else if (ret.id == __NR_execve) {
-    kill();
+  int fd = ::socket (AF_UNIX, call.args[1] | SOCK_CLOEXEC, call.args[2]);
+  call.id = -1;
+  if (fd < 0) {
+    call.returnVal = -errno;
   } else {
+    if (!returnFD (call, fd, (call.args[1] & SOCK_CLOEXEC) ? O_CLOEXEC : 0))
+      call.returnVal = -EMFILE;
+    ::close (fd);
   }
-  return ret;
-};
+}
+
+/**
+ * Binds sockets to a unix domain socket named after the child and the fd,
+ * whatever address was asked for. With user notifications, the socket is
+ * bound through a copy of it taken from the child.
+ */
+void
+NodeSandbox::handleBind(SyscallCall& call)
+{
+  struct sockaddr_un addr;
+  addr.sun_family = AF_UNIX;
+  snprintf (addr.sun_path, sizeof (addr.sun_path), "/tmp/codius-sandbox-socket-%d-%d", getChildPID(), static_cast<int>(call.args[0]));
+  if (getBackend() == Backend::UserNotification) {
+    int fd = copyFD (call.args[0]);
+    call.id = -1;
+    if (fd < 0) {
+      call.returnVal = fd;
+      return;
+    }
+    int ret = ::bind (fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof (addr));
+    call.returnVal = ret < 0 ? -errno : 0;
+    ::close (fd);
+    if (ret < 0)
+      return;
+  } else {
+    call.args[1] = writeScratch (sizeof (addr), reinterpret_cast<char*>(&addr));
+    call.args[2] = sizeof (addr);
+    if (!call.args[1]) {
+      call.id = -1;
+      call.returnVal = -ENOMEM;
+      return;
+    }
+  }
+  std::vector<Handle<Value> > args = {
+    String::New (addr.sun_path)
+  };
+  emitEvent ("newSocket", args);
+}
 
 static Handle<Value> fromJsonNode(JsonNode* node) {
   char* buf;
@@ -200,6 +266,13 @@ NodeSandbox::handleExit(int status)
   emitEvent ("exit", args);
 }
 
+void
+NodeSandbox::handleSnapshot()
+{
+  std::vector<Handle<Value> > args;
+  emitEvent ("snapshot", args);
+}
+
 void
 NodeSandbox::launchDebugger() {
   releaseChild (SIGSTOP);
@@ -228,6 +301,7 @@ NodeSandbox::handleSignal(int signal)
 };
 
 Persistent<Function> NodeSandbox::s_constructor;
+std::shared_ptr<SpawnPool> NodeSandbox::s_spawnPool;
 
 Handle<Value>
 NodeSandbox::node_finish_vfs (const Arguments& args)
@@ -273,6 +347,32 @@ NodeSandbox::node_kill(const Arguments& args)
   return Undefined();
 }
 
+Handle<Value>
+NodeSandbox::node_flush_filesystem_cache(const Arguments& args)
+{
+  SandboxWrapper* wrap;
+  wrap = node::ObjectWrap::Unwrap<SandboxWrapper>(args.This());
+  wrap->sbox->getVFS().flushCache();
+  return Undefined();
+}
+
+Handle<Value>
+NodeSandbox::node_spawn_from_snapshot(const Arguments& args)
+{
+  HandleScope scope;
+  SandboxWrapper* wrap;
+  SandboxWrapper* server;
+
+  if (args.Length() < 1 || !args[0]->IsObject() || args[0]->ToObject()->InternalFieldCount() < 1) {
+    ThrowException(Exception::TypeError(String::New("Argument must be a Sandbox.")));
+    return scope.Close(Undefined());
+  }
+
+  wrap = node::ObjectWrap::Unwrap<SandboxWrapper>(args.This());
+  server = node::ObjectWrap::Unwrap<SandboxWrapper>(args[0]->ToObject());
+  return scope.Close(Boolean::New (wrap->sbox->spawnFromSnapshot (*server->sbox)));
+}
+
 /*static void
 handle_stdio_read (SandboxIPC& ipc, void* data)
 {
@@ -294,6 +394,7 @@ NodeSandbox::node_spawn(const Arguments& args)
   HandleScope scope;
   char** argv;
   std::map<std::string, std::string> envp;
+  Sandbox::Backend backend = Sandbox::Backend::Ptrace;
   SandboxWrapper* wrap;
 
   wrap = node::ObjectWrap::Unwrap<SandboxWrapper>(args.This());
@@ -339,6 +440,33 @@ NodeSandbox::node_spawn(const Arguments& args)
               goto err_env;
             }
           }
+          if (options->HasRealNamedProperty(String::NewSymbol("backend"))) {
+            String::Utf8Value backendName (options->Get(String::NewSymbol("backend"))->ToString());
+            if (strcmp (*backendName, "notify") == 0)
+              backend = Sandbox::Backend::UserNotification;
+            else if (strcmp (*backendName, "ptrace") != 0)
+              goto err_backend;
+          }
+          if (options->HasRealNamedProperty(String::NewSymbol("tracerThread"))) {
+            wrap->sbox->setTracerThread (options->Get(String::NewSymbol("tracerThread"))->BooleanValue());
+          }
+          if (options->HasRealNamedProperty(String::NewSymbol("snapshotServer"))) {
+            wrap->sbox->setSnapshotServer (options->Get(String::NewSymbol("snapshotServer"))->BooleanValue());
+          }
+          if (options->HasRealNamedProperty(String::NewSymbol("identity"))) {
+            Local<Value> identityValue = options->Get(String::NewSymbol("identity"));
+            Local<Object> identityOptions;
+            Sandbox::Identity identity;
+
+            if (!identityValue->IsObject())
+              goto err_identity;
+
+            identityOptions = identityValue->ToObject();
+            identity.uid = identityOptions->Get(String::NewSymbol("uid"))->Uint32Value();
+            identity.gid = identityOptions->Get(String::NewSymbol("gid"))->Uint32Value();
+            identity.ppid = identityOptions->Get(String::NewSymbol("ppid"))->Int32Value();
+            wrap->sbox->setIdentity (identity);
+          }
         } else {
           goto err_options;
         }
@@ -347,7 +475,8 @@ NodeSandbox::node_spawn(const Arguments& args)
   }
 
   wrap->sbox->getVFS().setCWD ("/contract/");
-  wrap->sbox->spawn(argv, envp);
+  wrap->sbox->setSpawnPool (s_spawnPool);
+  wrap->sbox->spawn(argv, envp, backend);
 
   goto out;
 
@@ -355,6 +484,14 @@ err_env:
   ThrowException(Exception::TypeError(String::New("'env' option must be a map of string:string")));
   goto out;
 
+err_backend:
+  ThrowException(Exception::TypeError(String::New("'backend' option must be 'ptrace' or 'notify'")));
+  goto out;
+
+err_identity:
+  ThrowException(Exception::TypeError(String::New("'identity' option must be an object")));
+  goto out;
+
 err_options:
   ThrowException(Exception::TypeError(String::New("Last argument must be an options structure.")));
   goto out;
@@ -368,6 +505,40 @@ out:
   return Undefined();
 }
 
+/**
+ * codius-spawn-helper is built next to this module
+ */
+static std::string
+spawn_helper_path()
+{
+  Dl_info info;
+  std::string path;
+
+  if (dladdr (reinterpret_cast<void*>(&spawn_helper_path), &info) && info.dli_fname)
+    path = info.dli_fname;
+
+  return path.substr (0, path.rfind ('/') + 1) + "codius-spawn-helper";
+}
+
+Handle<Value>
+NodeSandbox::node_setSpawnPoolSize(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+    ThrowException(Exception::TypeError(String::New("Pool size must be a non-negative number.")));
+    return scope.Close(Undefined());
+  }
+
+  // Sandboxes that are already running keep the old pool alive
+  if (args[0]->IntegerValue() == 0)
+    s_spawnPool.reset();
+  else
+    s_spawnPool = std::make_shared<SpawnPool> (args[0]->IntegerValue(), spawn_helper_path());
+
+  return scope.Close(Undefined());
+}
+
 SandboxWrapper::SandboxWrapper()
   : sbox (new NodeSandbox(this))
 {}
@@ -419,10 +590,13 @@ NodeSandbox::Init(Handle<Object> exports)
   tpl->InstanceTemplate()->SetInternalFieldCount(2);
   node::SetPrototypeMethod(tpl, "spawn", node_spawn);
   node::SetPrototypeMethod(tpl, "kill", node_kill);
+  node::SetPrototypeMethod(tpl, "flushFilesystemCache", node_flush_filesystem_cache);
+  node::SetPrototypeMethod(tpl, "spawnFromSnapshot", node_spawn_from_snapshot);
   node::SetPrototypeMethod(tpl, "finishIPC", node_finish_ipc);
   node::SetPrototypeMethod(tpl, "finishVFS", node_finish_vfs);
   s_constructor = Persistent<Function>::New(tpl->GetFunction());
   exports->Set(String::NewSymbol("Sandbox"), s_constructor);
+  exports->Set(String::NewSymbol("setSpawnPoolSize"), FunctionTemplate::New(node_setSpawnPoolSize)->GetFunction());
 
   Local<FunctionTemplate> channelTpl = FunctionTemplate::New(node_new);
   channelTpl->SetClassName (String::NewSymbol ("Channel"));
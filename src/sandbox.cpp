@@ -8,23 +8,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/prctl.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <sys/ptrace.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <seccomp.h>
 #include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <linux/capability.h>
+#include <linux/seccomp.h>
 #include <uv.h>
 #include <memory>
+#include <algorithm>
 #include <cassert>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
 #include "vfs.h"
+#include "syscall-policy.h"
+#include "fd-util.h"
+#include "spawn-pool.h"
+#include "spawn-vm.h"
+#include "scratch-arena.h"
 #include <dirent.h>
 #include <sys/types.h>
 #include <iostream>
 
 #include "codius-util.h"
 #include "sandbox-ipc.h"
+#include "debug.h"
 
 #ifndef PTRACE_EVENT_SECCOMP
 #define PTRACE_EVENT_SECCOMP 7
@@ -38,25 +60,276 @@
 #define PTRACE_O_TRACESECCOMP (1 << PTRACE_EVENT_SECCOMP)
 #endif
 
+#if defined(SCMP_ACT_NOTIFY) && defined(SECCOMP_IOCTL_NOTIF_RECV) && defined(__NR_pidfd_getfd)
+#define HAVE_SECCOMP_NOTIFY
+#endif
+
+#if defined(__NR_pidfd_open) && defined(__NR_pidfd_getfd)
+#define HAVE_PIDFD_GETFD
+#endif
+
+// Left in a tracee's rax when a signal interrupts a syscall that the kernel
+// will restart
+#ifndef ERESTARTSYS
+#define ERESTARTSYS 512
+#define ERESTARTNOINTR 513
+#define ERESTARTNOHAND 514
+#define ERESTART_RESTARTBLOCK 516
+#endif
+
 static void handle_ipc_read (SandboxIPC& ipc, void* user_data);
 
+// Size of the CODIUS_SCRATCH_BUFFER variable, which is used as scratch memory
+// when no arena could be mapped
+static const size_t envScratchLength = 2047;
+
+// Where a child has the memfd behind its data window
+static const int windowChildFD = 1023;
+
+// Where a child has the socket that Sandbox::returnFD() sends files over
+static const int handoffChildFD = 1022;
+
+// Bytes of the data window each thread can use before spilling over, which
+// is enough for most read() buffers. Smaller windows get smaller slots, down
+// to a page.
+static const size_t windowSlotSize = 64 * 1024;
+static const size_t windowMinSlotSize = 4096;
+
+/**
+ * Routes SIGCHLD to the sandboxes whose children changed state, so that the
+ * ptrace backend needs no signal handler per sandbox. Every child leads a
+ * process group of its own, which its threads share, so each sandbox costs a
+ * single waitpid() on its group per signal, and children started by anyone
+ * else in this process are never touched.
+ *
+ * Only used from the loop thread. Busy sandboxes that shouldn't share a
+ * signal with any others can use Sandbox::setTracerThread() instead.
+ */
+class TraceeDispatcher {
+  public:
+    static TraceeDispatcher& get();
+    void add(SandboxPrivate* sandbox);
+    void remove(SandboxPrivate* sandbox);
+
+  private:
+    TraceeDispatcher() : m_started(false) {}
+    static void handleSignal(uv_signal_t* handle, int signum);
+    void dispatch();
+    uv_signal_t m_signal;
+    bool m_started;
+    // Sandboxes by the process group of their child. Sandboxes that have
+    // gone away leave their group with a null owner, to be reaped and
+    // forgotten.
+    std::map<pid_t, SandboxPrivate*> m_groups;
+};
+
+static void handle_tracer_jobs (uv_async_t* handle, int status);
+static void close_poll (uv_poll_t*& poll);
+static Sandbox::Address map_scratch (pid_t pid, size_t length, bool inEvent, std::vector<int>* signals);
+
+/**
+ * Registers of a stopped child. They are only fetched when first needed during
+ * a stop, and only written back if something modified them.
+ */
+class RegisterCache {
+  public:
+    RegisterCache() : m_pid(0), m_valid(false), m_dirty(false) {}
+
+    /**
+     * Forgets any cached registers. Must be called at every new stop.
+     */
+    void reset(pid_t pid);
+
+    /**
+     * Returns the registers of the stopped child, fetching them if needed
+     */
+    const struct user_regs_struct& get();
+
+    /**
+     * Returns the registers of the stopped child for modification. They will
+     * be written back by flush().
+     */
+    struct user_regs_struct& modify();
+
+    /**
+     * Writes the registers back to the child if they were modified
+     */
+    void flush();
+
+  private:
+    pid_t m_pid;
+    bool m_valid;
+    bool m_dirty;
+    struct user_regs_struct m_regs;
+};
+
+void
+RegisterCache::reset(pid_t pid)
+{
+  m_pid = pid;
+  m_valid = false;
+  m_dirty = false;
+}
+
+const struct user_regs_struct&
+RegisterCache::get()
+{
+  if (!m_valid) {
+    memset (&m_regs, 0, sizeof (m_regs));
+    if (ptrace (PTRACE_GETREGS, m_pid, 0, &m_regs) < 0) {
+      error (EXIT_FAILURE, errno, "Failed to fetch registers");
+    }
+    m_valid = true;
+  }
+  return m_regs;
+}
+
+struct user_regs_struct&
+RegisterCache::modify()
+{
+  get();
+  m_dirty = true;
+  return m_regs;
+}
+
+void
+RegisterCache::flush()
+{
+  if (m_dirty) {
+    if (ptrace (PTRACE_SETREGS, m_pid, 0, &m_regs) < 0) {
+      error (EXIT_FAILURE, errno, "Failed to set registers");
+    }
+    m_dirty = false;
+  }
+}
+
 class SandboxPrivate {
   public:
     SandboxPrivate(Sandbox* d)
       : d (d),
         pid(0),
+        pidFD(-1),
+        exitPoll(nullptr),
         entered_main(false),
-        scratchAddr(0),
+        scratchTid(0),
+        scratchSize(64 * 1024),
+        windowFD(-1),
+        windowMap(nullptr),
+        windowSize(1024 * 1024),
+        handoffSocket {-1, -1},
+        handoffPending(false),
+        handoffFlags(0),
+        handoffMap(false),
+        haveProcessVM(true),
+        haveSyscallInfo(true),
+        backend(Sandbox::Backend::Ptrace),
+        notifyFD(-1),
+        notifyPoll(nullptr),
+        handlingNotification(false),
+        notifyInspected(false),
+        childExited(false),
+        policy(SyscallPolicy::defaultPolicy()),
+        haveIdentity(false),
+        useTracerThread(false),
+        tracerAsync(nullptr),
+        tracerStopping(false),
+        snapshotServer(false),
+        snapshotRequest(nullptr),
+        haveSnapshot(false),
         vfs(new VFS(d)) {}
     Sandbox* d;
     std::vector<std::unique_ptr<SandboxIPC> > ipcSockets;
     pid_t pid;
-    uv_signal_t signal;
+    int pidFD;
+    uv_poll_t* exitPoll;
     bool entered_main;
-    Sandbox::Address scratchAddr;
-    Sandbox::Address nextScratchSegment;
+    ScratchArena scratch;
+    pid_t scratchTid;
+    size_t scratchSize;
+    int windowFD;
+    char* windowMap;
+    size_t windowSize;
+    ScratchArena window;
+    void openWindow();
+    void closeWindow();
+    int handoffSocket[2];
+    bool handoffPending;
+    int handoffFlags;
+    bool handoffMap;
+    Sandbox::Word handoffMapArgs[6];
+    void openHandoff();
+    void closeHandoff();
+    bool sendFD(int localFD);
+    long receiveFD(pid_t pid);
+    std::vector<std::pair<int, int> > childFDs() const;
     void handleSeccompEvent(pid_t pid);
-    void handleExecEvent(pid_t pid);
+    void handleExecEvent(pid_t pid, bool inEvent);
+    void findEnvScratch(pid_t pid);
+    // Signals that arrived while a thread was stepped through injected
+    // syscalls, for resume() to deliver
+    std::map<pid_t, std::vector<int> > deferredSignals;
+    void resume(pid_t pid);
+    ssize_t transferMemory(pid_t pid, Sandbox::Address addr, size_t length, char* buf, bool write);
+    Sandbox::Address allocScratch(pid_t tid, size_t length);
+    bool fetchSyscallInfo(pid_t pid, Sandbox::SyscallCall& call);
+    void dispatchSyscall(Sandbox::SyscallCall& call);
+    void handleNotification();
+    bool haveProcessVM;
+    bool haveSyscallInfo;
+    RegisterCache regs;
+    Sandbox::Backend backend;
+    int notifySocket[2];
+    int notifyFD;
+    uv_poll_t* notifyPoll;
+    uint64_t notifyID;
+    bool handlingNotification;
+    // Whether the handler read the notified call's memory, which another
+    // thread of the child may have changed since
+    bool notifyInspected;
+    std::atomic<bool> childExited;
+    SyscallPolicy policy;
+    bool haveIdentity;
+    Sandbox::Identity identity;
+    void applyIdentity(SyscallPolicy& policy) const;
+    void answerIdentity(Sandbox::SyscallCall& call);
+    struct HandlerSlot {
+      Sandbox::SyscallHandler handler;
+      std::function<bool()> needsLoop;
+      Sandbox::HandlerStats stats;
+    };
+    std::vector<HandlerSlot> handlers;
+    std::mutex handlersLock;
+    bool isClaimed(Sandbox::Word id);
+    bool handlerNeedsLoop(Sandbox::Word id);
+    void handleStop(pid_t pid, int status);
+
+    struct TracerJob {
+      std::function<void()> run;
+      std::promise<void>* done;
+    };
+    bool useTracerThread;
+    std::thread tracer;
+    uv_async_t* tracerAsync;
+    std::mutex tracerLock;
+    std::deque<TracerJob> tracerJobs;
+    bool tracerStopping;
+    void runTracer();
+    void callEmbedder(std::function<void()> job, bool wait);
+    void runTracerJobs();
+    void finishTracer();
+    void stopTracer();
+    std::shared_ptr<SpawnPool> spawnPool;
+    pid_t spawnFromPool(char** argv, std::map<std::string, std::string>& envp);
+    pid_t spawnVM(char** argv, std::map<std::string, std::string>& envp);
+    SyscallPolicy::Program buildFilter(uint32_t trap) const;
+    SyscallPolicy::Program filter;
+    bool handleFirstStop(int status);
+    bool snapshotServer;
+    codius_request_t* snapshotRequest;
+    bool haveSnapshot;
+    struct user_regs_struct snapshotRegs;
+    bool takeSnapshot(pid_t pid);
+    void refuseSnapshot();
     std::vector<int> openFiles;
     std::unique_ptr<VFS> vfs;
 };
@@ -67,42 +340,102 @@ Sandbox::enteredMain() const
   return m_p->entered_main;
 }
 
+/**
+ * Finds the scratch memory of a child that has just exec'd, preferring an
+ * arena mapped into it over the buffer in its environment.
+ *
+ * @param inEvent Whether the child is in PTRACE_EVENT_EXEC, rather than the
+ * SIGTRAP stop that follows exec without PTRACE_O_TRACEEXEC
+ */
 void
-SandboxPrivate::handleExecEvent(pid_t pid)
+SandboxPrivate::handleExecEvent(pid_t pid, bool inEvent)
 {
   if (!entered_main) {
-    struct user_regs_struct regs;
     Sandbox::Address stackAddr;
     Sandbox::Address environAddr;
     Sandbox::Address strAddr;
+    Sandbox::Address scratchAddr = 0;
+    Sandbox::Address arenaAddr;
     int argc;
 
     entered_main = true;
 
-    memset (&regs, 0, sizeof (regs));
-
-    if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0) {
-      error (EXIT_FAILURE, errno, "Failed to fetch registers on exec");
-    }
-
-    stackAddr = regs.rsp;
+    regs.reset (pid);
+    stackAddr = regs.get().rsp;
     d->copyData (pid, stackAddr, sizeof (argc), &argc);
     environAddr = stackAddr + (sizeof (stackAddr) * (argc+2));
 
     strAddr = d->peekData (pid, environAddr);
     while (strAddr != 0) {
-      char buf[1024];
+      std::string buf;
       std::string needle("CODIUS_SCRATCH_BUFFER=");
-      d->copyString (pid, strAddr, sizeof (buf), buf);
+      d->readString (pid, strAddr, needle.length() + 1, buf);
       environAddr += sizeof (stackAddr);
-      if (strncmp (buf, needle.c_str(), needle.length()) == 0) {
+      if (buf.compare (0, needle.length(), needle) == 0) {
         scratchAddr = strAddr + needle.length();
         break;
       }
       strAddr = d->peekData (pid, environAddr);
     }
     assert (scratchAddr);
+
+    arenaAddr = map_scratch (pid, scratchSize, inEvent, &deferredSignals[pid]);
+    regs.reset (pid);
+    if (arenaAddr)
+      scratch.assign (arenaAddr, scratchSize);
+    else
+      scratch.assign (scratchAddr, envScratchLength);
+  }
+}
+
+/**
+ * Finds the scratch buffer in the environment of a child that isn't traced,
+ * from where the kernel says its environment starts and what it holds
+ */
+void
+SandboxPrivate::findEnvScratch(pid_t pid)
+{
+  std::string needle("CODIUS_SCRATCH_BUFFER=");
+  std::string env;
+  Sandbox::Address envStart = 0;
+  char path[32];
+  char buf[4096];
+  const char* fields;
+  ssize_t len;
+  size_t pos;
+  int fd;
+
+  // env_start is field 50, and the command name before field 3 may hold
+  // anything but the last ')'
+  snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  len = fd >= 0 ? read (fd, buf, sizeof (buf) - 1) : -1;
+  if (fd >= 0)
+    close (fd);
+  if (len > 0) {
+    buf[len] = 0;
+    fields = strrchr (buf, ')');
+    for (int field = 2; fields && field < 50; field++)
+      fields = strchr (fields + 1, ' ');
+    if (fields)
+      envStart = strtoull (fields + 1, nullptr, 10);
   }
+
+  snprintf (path, sizeof (path), "/proc/%d/environ", pid);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  while (fd >= 0 && (len = read (fd, buf, sizeof (buf))) > 0)
+    env.append (buf, len);
+  if (fd >= 0)
+    close (fd);
+
+  pos = env.compare (0, needle.length(), needle) == 0 ? 0 : env.find ('\0' + needle);
+  if (!envStart || pos == std::string::npos) {
+    Debug() << "could not find the scratch buffer of" << pid;
+    return;
+  }
+  if (pos > 0)
+    pos++;
+  scratch.assign (envStart + pos + needle.length(), envScratchLength);
 }
 
 void
@@ -114,6 +447,7 @@ Sandbox::addIPC(std::unique_ptr<SandboxIPC>&& ipc)
 Sandbox::Sandbox()
   : m_p(new SandboxPrivate(this))
 {
+  m_p->vfs->claimSyscalls();
 }
 
 void
@@ -125,12 +459,36 @@ Sandbox::kill()
 Sandbox::~Sandbox()
 {
   kill();
+  m_p->stopTracer();
+  TraceeDispatcher::get().remove (m_p);
+  // libuv keeps hold of handles until they are closed, and has to let go of
+  // them before their descriptors are
+  close_poll (m_p->exitPoll);
+  close_poll (m_p->notifyPoll);
+  if (m_p->pidFD >= 0)
+    close (m_p->pidFD);
+  if (m_p->snapshotRequest)
+    codius_request_free (m_p->snapshotRequest);
+  m_p->closeWindow();
+  m_p->closeHandoff();
   delete m_p;
 }
 
-void Sandbox::spawn(char **argv, std::map<std::string, std::string>& envp)
+void Sandbox::spawn(char **argv, std::map<std::string, std::string>& envp, Backend backend)
 {
   SandboxPrivate *priv = m_p;
+
+  // A std::thread can't be replaced while it is joinable
+  if (priv->tracer.joinable()) {
+    if (!priv->childExited) {
+      Debug() << "the previous child is still running";
+      return;
+    }
+    // Its last jobs are queued once the thread has finished
+    priv->finishTracer();
+    priv->runTracerJobs();
+  }
+
   SandboxWrap* wrap = new SandboxWrap;
   wrap->priv = priv;
   CallbackIPC::Ptr ipcSocket (new CallbackIPC (3));
@@ -138,21 +496,112 @@ void Sandbox::spawn(char **argv, std::map<std::string, std::string>& envp)
   ipcSocket->setCallback (handle_ipc_read, wrap);
   addIPC (std::move (ipcSocket));
 
+#ifndef HAVE_SECCOMP_NOTIFY
+  if (backend == Backend::UserNotification) {
+    Debug() << "seccomp user notifications are unavailable, using ptrace";
+    backend = Backend::Ptrace;
+  }
+#endif // HAVE_SECCOMP_NOTIFY
+
+  priv->backend = backend;
+
+#ifdef HAVE_SECCOMP_NOTIFY
+  const uint32_t trap = backend == Backend::UserNotification ? SCMP_ACT_NOTIFY : SCMP_ACT_TRACE (0);
+#else
+  const uint32_t trap = SCMP_ACT_TRACE (0);
+#endif // HAVE_SECCOMP_NOTIFY
+
+  // Syscalls can't be rewritten with user notifications
+  if (backend == Backend::Ptrace) {
+    priv->openWindow();
+    priv->openHandoff();
+  }
+
+  // libseccomp allocates, so it must not run between fork and exec
+  priv->filter = priv->buildFilter (trap);
+
+  if (backend == Backend::UserNotification) {
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, priv->notifySocket) < 0)
+      error (EXIT_FAILURE, errno, "Could not create seccomp listener channel");
+  }
+
+  if (backend == Backend::Ptrace && priv->useTracerThread) {
+    std::promise<pid_t> forked;
+    SandboxWrap* asyncWrap = new SandboxWrap;
+    asyncWrap->priv = priv;
+
+    // Left over from any previous child
+    priv->childExited = false;
+
+    priv->tracerAsync = new uv_async_t;
+    priv->tracerAsync->data = asyncWrap;
+    uv_async_init (uv_default_loop(), priv->tracerAsync, handle_tracer_jobs);
+
+    // Only the thread that forked the child may trace it
+    priv->tracer = std::thread ([this, priv, argv, &envp, &forked] {
+      pid_t pid = priv->spawnVM (argv, envp);
+      if (pid < 0)
+        pid = fork();
+      if (pid == 0)
+        execChild (argv, envp);
+      priv->pid = pid;
+      forked.set_value (pid);
+      priv->runTracer();
+    });
+
+    forked.get_future().wait();
+
+    for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+      (*i)->startPoll(uv_default_loop());
+
+    return;
+  }
+
+  if (backend == Backend::Ptrace && priv->spawnPool) {
+    priv->pid = priv->spawnFromPool (argv, envp);
+    if (priv->pid > 0) {
+      // Seized by the pool with our options, so there is no first stop to
+      // wait for. Its exec shows up as PTRACE_EVENT_EXEC.
+      for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+        (*i)->startPoll(uv_default_loop());
+      TraceeDispatcher::get().add (priv);
+      return;
+    }
+  }
+
+  // The listener handshake in execChild() needs the parent running, so
+  // UserNotification still forks
+  if (backend == Backend::Ptrace) {
+    priv->pid = priv->spawnVM (argv, envp);
+    if (priv->pid > 0) {
+      traceChild();
+      return;
+    }
+  }
+
   priv->pid = fork();
 
   if (priv->pid) {
-    traceChild();
+    if (backend == Backend::UserNotification)
+      watchChild();
+    else
+      traceChild();
   } else {
     execChild(argv, envp);
   }
 }
 
+Sandbox::Backend
+Sandbox::getBackend() const
+{
+  return m_p->backend;
+}
+
 void
 Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
 {
-  scmp_filter_ctx ctx;
+  int listener;
   std::vector<int> permittedFDs (m_p->ipcSockets.size());
-  std::vector<int> unusedFDs;
 
   for(auto i = m_p->ipcSockets.begin(); i != m_p->ipcSockets.end(); i++) {
     if (!(*i)->dup()) {
@@ -162,174 +611,62 @@ Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
     permittedFDs.push_back ((*i)->dupAs);
   }
 
-  DIR* dirp = opendir ("/proc/self/fd/");
-  struct dirent* dp;
-  do {
-    if ((dp = readdir (dirp)) != NULL) {
-      bool found = false;
-      int fdnum;
-      char* end = NULL;
-
-      fdnum = strtol (dp->d_name, &end, 10);
-
-      if (end == dp->d_name && fdnum == 0) {
-        continue;
-      }
+  if (m_p->windowFD >= 0) {
+    if (dup2 (m_p->windowFD, windowChildFD) != windowChildFD)
+      error (EXIT_FAILURE, errno, "Could not bind data window across #%d", windowChildFD);
+    permittedFDs.push_back (windowChildFD);
+  }
 
-      for (auto i = permittedFDs.cbegin(); i != permittedFDs.cend(); i++) {
-        if (*i == fdnum) {
-          found = true;
-          break;
-        }
-      }
+  if (m_p->handoffSocket[1] >= 0) {
+    if (dup2 (m_p->handoffSocket[1], handoffChildFD) != handoffChildFD)
+      error (EXIT_FAILURE, errno, "Could not bind handoff socket across #%d", handoffChildFD);
+    permittedFDs.push_back (handoffChildFD);
+  }
 
-      if (!found) {
-        unusedFDs.push_back (fdnum);
-      }
-    }
-  } while (dp != NULL);
-  closedir (dirp);
+  if (m_p->backend == Backend::UserNotification)
+    permittedFDs.push_back (m_p->notifySocket[1]);
 
-  for (auto i = unusedFDs.cbegin(); i != unusedFDs.cend(); i++) {
-    close (*i);
-  }
+  closeInheritedFDs (permittedFDs, true);
 
   setpgid (0, 0);
 
-  ptrace (PTRACE_TRACEME, 0, 0);
-  raise (SIGSTOP);
+  if (m_p->backend == Backend::Ptrace) {
+    ptrace (PTRACE_TRACEME, 0, 0);
+    raise (SIGSTOP);
+  }
   
   prctl (PR_SET_NO_NEW_PRIVS, 1);
 
-  ctx = seccomp_init (SCMP_ACT_KILL);
-
-  // A duplicate in case the seccomp_init() call is accidentally modified
-  seccomp_rule_add (ctx, SCMP_ACT_KILL, SCMP_SYS (ptrace), 0);
-
-  // This is actually caught via PTRACE_EVENT_EXEC
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (execve), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (clone), 0);
-
-  // Used to track chdir calls
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (chdir), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (fchdir), 0);
-
-  // These interact with the VFS layer
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (open), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (access), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (openat), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (stat), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (lstat), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getcwd), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (readlink), 0);
-
-#define VFS_FILTER(x) seccomp_rule_add (ctx, \
-                                        SCMP_ACT_TRACE (0), \
-                                        SCMP_SYS (x), 1, \
-                                        SCMP_A0 (SCMP_CMP_GE, VFS::firstVirtualFD)); \
-                      seccomp_rule_add (ctx, \
-                                        SCMP_ACT_ALLOW, \
-                                        SCMP_SYS (x), 1, \
-                                        SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD));
-  VFS_FILTER (read);
-  VFS_FILTER (close);
-  VFS_FILTER (ioctl);
-  VFS_FILTER (fstat);
-  VFS_FILTER (lseek);
-  VFS_FILTER (write);
-  VFS_FILTER (getdents);
-#ifdef __NR_readdir
-  VFS_FILTER (readdir);
-#endif // __NR_readdir
-  VFS_FILTER (getdents64);
-  VFS_FILTER (readv);
-  VFS_FILTER (writev);
-
-#undef VFS_FILTER
-
-  // This needs its arguments sanitized
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (fcntl), 0);
-
-  // These are traced to implement socket remapping
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (socket), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (connect), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (bind), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (setsockopt), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getsockname), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getpeername), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getsockopt), 0);
-
-  // These need their return values faked in some way
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (uname), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getrlimit), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getuid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getgid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (geteuid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getegid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getppid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getpgrp), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getgroups), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getresuid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getresgid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (capget), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (gettid), 0);
-
-  // All of these are allowed because they either:
-  // * Can't cause any harm outside the sandbox
-  // * Require some file descriptor from a previously-sanitized call to i.e.
-  // open()
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (fsync), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (fdatasync), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (sync), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (poll), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (mmap), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (mprotect), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (munmap), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (madvise), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (brk), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (rt_sigaction), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (rt_sigprocmask), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (select), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (sched_yield), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (getpid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (accept), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (listen), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (exit), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (gettimeofday), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (tkill), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (epoll_create), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (restart_syscall), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (clock_gettime), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (clock_getres), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (clock_nanosleep), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (gettid), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (ioctl), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (nanosleep), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (exit_group), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (epoll_wait), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (epoll_ctl), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (tgkill), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (pselect6), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (ppoll), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (arch_prctl), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (prctl), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (set_robust_list), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (get_robust_list), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (epoll_pwait), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (accept4), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (eventfd2), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (epoll_create1), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (pipe2), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (futex), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (set_tid_address), 0);
-  seccomp_rule_add (ctx, SCMP_ACT_ALLOW, SCMP_SYS (set_thread_area), 0);
-
-  if (0<seccomp_load (ctx))
+  if (!m_p->filter)
+    error(EXIT_FAILURE, 0, "Could not build sandbox policy");
+
+#ifdef HAVE_SECCOMP_NOTIFY
+  if (m_p->backend == Backend::UserNotification)
+    listener = installFilter (*m_p->filter, SECCOMP_FILTER_FLAG_NEW_LISTENER);
+  else
+#endif // HAVE_SECCOMP_NOTIFY
+    listener = installFilter (*m_p->filter, 0);
+
+  if (listener < 0)
     error(EXIT_FAILURE, errno, "Could not lock down sandbox");
-  seccomp_release (ctx);
 
-  char buf[2048];
-  memset (buf, CODIUS_MAGIC_BYTES, sizeof (buf));
+#ifdef HAVE_SECCOMP_NOTIFY
+  if (m_p->backend == Backend::UserNotification) {
+    // Tell the parent which fd the listener landed on, then wait for it to
+    // take its own copy before dropping ours
+    char ack;
+    if (listener < 0 ||
+        write (m_p->notifySocket[1], &listener, sizeof (listener)) != sizeof (listener) ||
+        read (m_p->notifySocket[1], &ack, sizeof (ack)) != sizeof (ack))
+      error (EXIT_FAILURE, errno, "Could not hand seccomp listener to parent");
+    close (listener);
+    close (m_p->notifySocket[1]);
+  }
+#endif // HAVE_SECCOMP_NOTIFY
+
+  char buf[envScratchLength + 1];
+  memset (buf, CODIUS_MAGIC_BYTES, envScratchLength);
+  buf[envScratchLength] = 0;
   clearenv ();
   for (auto i = envp.cbegin(); i != envp.cend(); i++) {
     setenv (i->first.c_str(), i->second.c_str(), 1);
@@ -345,289 +682,2354 @@ Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
 Sandbox::Word
 Sandbox::peekData(pid_t pid, Address addr)
 {
+  if (m_p->handlingNotification)
+    m_p->notifyInspected = true;
+  errno = 0;
   Word w = ptrace (PTRACE_PEEKDATA, pid, addr, NULL);
   assert (errno == 0);
   return w;
 }
 
-bool
-Sandbox::copyData(pid_t pid, Address addr, size_t length, void* buf)
+/**
+ * Moves memory in or out of the child with process_vm_readv/writev. Returns the
+ * number of bytes moved, which may be short if a fault was hit part way.
+ */
+static ssize_t
+transfer_process_vm (pid_t pid, Sandbox::Address addr, size_t length, char* buf, bool write)
 {
-  for (size_t i = 0; i < length; i += sizeof (Word)) {
-    Word ret = peekData (pid, addr+i);
-    memcpy (reinterpret_cast<void*>(reinterpret_cast<long>(buf)+i), &ret, sizeof (Word));
+  size_t done = 0;
+
+  while (done < length) {
+    struct iovec local = {buf + done, length - done};
+    struct iovec remote = {reinterpret_cast<void*>(addr + done), length - done};
+    ssize_t ret;
+
+    if (write)
+      ret = process_vm_writev (pid, &local, 1, &remote, 1, 0);
+    else
+      ret = process_vm_readv (pid, &local, 1, &remote, 1, 0);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return done ? done : -1;
+    if (ret == 0) {
+      errno = EFAULT;
+      break;
+    }
+    done += ret;
   }
-  if (errno)
-    return false;
-  return true;
+
+  return done;
 }
 
-bool
-Sandbox::copyString (pid_t pid, Address addr, size_t maxLength, char* buf)
+/**
+ * Moves memory in or out of the child through /proc/<pid>/mem. Unlike
+ * process_vm_writev(), this can write to read-only mappings the same way
+ * PTRACE_POKEDATA can.
+ */
+static ssize_t
+transfer_proc_mem (pid_t pid, Sandbox::Address addr, size_t length, char* buf, bool write)
 {
-  //FIXME: This causes a lot of redundant copying. Whole words are moved around
-  //and then only a single byte is taken out of it when we could be operating on
-  //bigger chunks of data.
-  bool endString = false;
-  size_t i;
-  for (i = 0; !endString && maxLength - i > sizeof (Word); i += sizeof (Word)) {
-    Word d = peekData(pid, addr + i);
-    for (size_t j = 0; j < sizeof (Word) && i + j < maxLength; j++) {
-      buf[i + j] = ((char*)(&d))[j];
-      if (buf[i + j] == 0) {
-        endString = true;
-        break;
-      }
+  char path[32];
+  size_t done = 0;
+  int fd;
+  int savedErrno;
+
+  snprintf (path, sizeof (path), "/proc/%d/mem", pid);
+  fd = open (path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  while (done < length) {
+    ssize_t ret;
+
+    if (write)
+      ret = pwrite64 (fd, buf + done, length - done, addr + done);
+    else
+      ret = pread64 (fd, buf + done, length - done, addr + done);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      if (ret == 0)
+        errno = EFAULT;
+      break;
     }
+    done += ret;
   }
 
-  if (i != maxLength && !endString) {
-    Word d = peekData (pid, addr + i);
-    for (size_t j = 0; j < sizeof (Word) && i + j < maxLength; j++) {
-      buf[i + j] = ((char*)(&d))[j];
-    }
-  }
+  savedErrno = errno;
+  close (fd);
+  errno = savedErrno;
 
-  if (errno)
-    return false;
-  return true;
+  if (done == 0 && length > 0)
+    return -1;
+  return done;
 }
 
-void
-SandboxPrivate::handleSeccompEvent(pid_t pid)
+/**
+ * Moves @p length bytes between @p buf and the child's memory at @p addr,
+ * trying process_vm_readv/writev first, then /proc/<pid>/mem, and finally
+ * falling back to moving a word at a time with ptrace. Each fallback only
+ * picks up where the previous method stopped.
+ */
+ssize_t
+SandboxPrivate::transferMemory(pid_t pid, Sandbox::Address addr, size_t length, char* buf, bool write)
 {
-  struct user_regs_struct regs;
-  
-  if (!entered_main)
-    return;
-  memset (&regs, 0, sizeof (regs));
-  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0) {
-    error (EXIT_FAILURE, errno, "Failed to fetch registers");
+  size_t done = 0;
+  ssize_t ret;
+
+  if (!write && handlingNotification)
+    notifyInspected = true;
+
+  if (haveProcessVM) {
+    ret = transfer_process_vm (pid, addr, length, buf, write);
+    if (ret < 0 && errno == ENOSYS)
+      haveProcessVM = false;
+    else if (ret > 0)
+      done = ret;
   }
 
-  Sandbox::SyscallCall call (pid);
-
-#ifdef __i386__
-  call.id = regs.orig_eax;
-  call.args[0] = regs.ebx;
-  call.args[1] = regs.ecx;
-  call.args[2] = regs.edx;
-  call.args[3] = regs.esi;
-  call.args[4] = regs.edi;
-  call.args[5] = regs.ebp;
-#else
-  call.id = regs.orig_rax;
-  call.args[0] = regs.rdi;
-  call.args[1] = regs.rsi;
-  call.args[2] = regs.rdx;
-  call.args[3] = regs.rcx;
-  call.args[4] = regs.r8;
-  call.args[5] = regs.r9;
-#endif
+  if (done < length) {
+    ret = transfer_proc_mem (pid, addr + done, length - done, buf + done, write);
+    if (ret > 0)
+      done += ret;
+  }
 
-  d->resetScratch();
-  call = Sandbox::SyscallCall (d->handleSyscall (call));
-  call = Sandbox::SyscallCall (vfs->handleSyscall (call));
+  errno = 0;
+  while (done < length) {
+    size_t chunk = std::min (sizeof (Sandbox::Word), length - done);
+    Sandbox::Word w = 0;
 
-#ifdef __i386__
-  regs.orig_eax = call.id;
-  regs.ebx = call.args[0];
-  regs.ecx = call.args[1];
-  regs.edx = call.args[2];
-  regs.esi = call.args[3];
-  regs.edi = call.args[4];
-  regs.ebp = call.args[5];
-  regs.eax = call.returnVal;
-#else
-  regs.orig_rax = call.id;
-  regs.rdi = call.args[0];
-  regs.rsi = call.args[1];
-  regs.rdx = call.args[2];
-  regs.rcx = call.args[3];
-  regs.r8 = call.args[4];
-  regs.r9 = call.args[5];
-  regs.rax = call.returnVal;
-#endif
+    if (!write || chunk < sizeof (w)) {
+      w = ptrace (PTRACE_PEEKDATA, pid, addr + done, NULL);
+      if (errno)
+        break;
+    }
 
-  if (ptrace (PTRACE_SETREGS, pid, 0, &regs) < 0) {
-    error (EXIT_FAILURE, errno, "Failed to set registers");
+    if (write) {
+      memcpy (&w, buf + done, chunk);
+      if (ptrace (PTRACE_POKEDATA, pid, addr + done, w) < 0)
+        break;
+    } else {
+      memcpy (buf + done, &w, chunk);
+    }
+    done += chunk;
   }
-}
 
-pid_t
-Sandbox::getChildPID() const
-{
-  return m_p->pid;
+  if (done == 0 && length > 0)
+    return -1;
+  return done;
 }
 
-void
-Sandbox::releaseChild(int signal)
+ssize_t
+Sandbox::readMemory(pid_t pid, Address addr, size_t length, void* buf)
 {
-  SandboxPrivate *priv = m_p;
-  ptrace (PTRACE_SETOPTIONS, priv->pid, 0, 0);
-  uv_signal_stop (&priv->signal);
-  priv->ipcSockets.clear();
-  ptrace (PTRACE_DETACH, m_p->pid, 0, signal);
+  return m_p->transferMemory (pid, addr, length, static_cast<char*>(buf), false);
 }
 
-Sandbox::Address
-Sandbox::getScratchAddress() const
+ssize_t
+Sandbox::writeMemory(pid_t pid, Address addr, size_t length, const void* buf)
 {
-  return m_p->scratchAddr;
+  // transferMemory() only reads from buf when writing
+  return m_p->transferMemory (pid, addr, length, static_cast<char*>(const_cast<void*>(buf)), true);
 }
 
 bool
-Sandbox::pokeData(pid_t pid, Address addr, Word word)
+Sandbox::copyData(pid_t pid, Address addr, size_t length, void* buf)
 {
-  return ptrace (PTRACE_POKEDATA, pid, addr, word);
+  ssize_t ret = readMemory (pid, addr, length, buf);
+  if (ret < 0)
+    return false;
+  if (static_cast<size_t>(ret) != length) {
+    if (!errno)
+      errno = EFAULT;
+    return false;
+  }
+  return true;
 }
 
-//FIXME: Needs some test to make sure we don't go outside the scratch area
-Sandbox::Address
-Sandbox::writeScratch(size_t length, const char* buf)
+/**
+ * Returns how many of the @p remaining bytes starting at @p addr can be read
+ * without crossing into the next page
+ */
+static size_t
+page_chunk (Sandbox::Address addr, size_t remaining)
 {
-  Address nextAddr;
-  Address curAddr = m_p->nextScratchSegment;
-  writeData (m_p->pid, curAddr, length, buf);
-  nextAddr = m_p->nextScratchSegment + length;
-  // Round up to nearest word boundary
-  if (nextAddr % sizeof (Address) != 0)
-    nextAddr += sizeof (Address) - nextAddr % sizeof (Address);
-  m_p->nextScratchSegment = nextAddr;
-  return curAddr;
+  static const size_t pageSize = sysconf (_SC_PAGESIZE);
+  return std::min (pageSize - addr % pageSize, remaining);
 }
 
-void
-Sandbox::resetScratch()
+bool
+Sandbox::copyString (pid_t pid, Address addr, size_t maxLength, char* buf)
 {
-  m_p->nextScratchSegment = m_p->scratchAddr;
+  size_t length = 0;
+
+  while (length < maxLength) {
+    size_t chunk = page_chunk (addr + length, maxLength - length);
+    ssize_t ret = readMemory (pid, addr + length, chunk, buf + length);
+
+    if (ret <= 0)
+      return false;
+    if (memchr (buf + length, 0, ret))
+      return true;
+    length += ret;
+    if (static_cast<size_t>(ret) < chunk) {
+      errno = EFAULT;
+      return false;
+    }
+  }
+
+  return true;
 }
 
 bool
-Sandbox::writeData (pid_t pid, Address addr, size_t length, const char* buf)
+Sandbox::readString (pid_t pid, Address addr, size_t maxLength, std::string& str)
 {
-  size_t i;
-  for (i = 0; length - i > sizeof (Word); i += sizeof (Word)) {
-    Word d;
-    for (size_t j = 0; j < sizeof (Word) && i+j < length; j++) {
-      ((char*)(&d))[j] = buf[i+j];
+  size_t length = 0;
+
+  str.clear();
+  str.reserve (page_chunk (addr, maxLength));
+
+  while (length < maxLength) {
+    size_t chunk = page_chunk (addr + length, maxLength - length);
+    ssize_t ret;
+    const char* end;
+
+    str.resize (length + chunk);
+    ret = readMemory (pid, addr + length, chunk, &str[length]);
+
+    if (ret <= 0) {
+      str.resize (length);
+      return false;
     }
-    pokeData (pid, addr + i, d);
-  }
-  if (i != length) {
-    Word d = peekData (pid, addr + i);
-    for (size_t j = 0; j < sizeof (Word) && i + j < length; j++) {
-      ((char*)(&d))[j] = buf[i+j];
+
+    // glibc's memchr() is vectorized, so this is where the scanning gets fast
+    end = static_cast<const char*>(memchr (&str[length], 0, ret));
+    if (end) {
+      str.resize (end - str.data());
+      return true;
+    }
+
+    length += ret;
+    if (static_cast<size_t>(ret) < chunk) {
+      str.resize (length);
+      errno = EFAULT;
+      return false;
     }
-    pokeData (pid, addr + i, d);
   }
-  if (errno)
-    return false;
-  return true;
+
+  errno = ENAMETOOLONG;
+  return false;
 }
 
-static void
-handle_trap(uv_signal_t *handle, int signum)
+/**
+ * Rewrites the identity syscalls in @p policy so that the ones answering 0
+ * are handled entirely by the filter, and the rest trap into
+ * answerIdentity().
+ */
+void
+SandboxPrivate::applyIdentity(SyscallPolicy& policy) const
 {
-  SandboxWrap* wrap = static_cast<SandboxWrap*>(handle->data);
-  SandboxPrivate* priv = wrap->priv;
-  int status = 0;
-  pid_t pid;
+  const struct {
+    int syscall;
+    Sandbox::Word value;
+  } answers[] = {
+    {SCMP_SYS (getuid), identity.uid},
+    {SCMP_SYS (geteuid), identity.uid},
+    {SCMP_SYS (getgid), identity.gid},
+    {SCMP_SYS (getegid), identity.gid},
+    {SCMP_SYS (getppid), static_cast<Sandbox::Word>(identity.ppid)},
+    // No supplementary groups
+    {SCMP_SYS (getgroups), 0}
+  };
+
+  for (size_t i = 0; i < sizeof (answers) / sizeof (answers[0]); i++) {
+    policy.remove (answers[i].syscall);
+    if (answers[i].value == 0)
+      policy.fail (answers[i].syscall, 0);
+    else
+      policy.trap (answers[i].syscall);
+  }
 
-  while (true) {
-    pid = waitpid (-priv->pid, &status, WNOHANG | __WALL);
+  // These write through pointers, so they always need a stop
+  policy.remove (SCMP_SYS (getresuid));
+  policy.remove (SCMP_SYS (getresgid));
+  policy.trap (SCMP_SYS (getresuid));
+  policy.trap (SCMP_SYS (getresgid));
+
+  // The child leads its own process group, so these agree with the real
+  // getpid() and gain nothing from a stop
+  policy.remove (SCMP_SYS (getpgrp));
+  policy.remove (SCMP_SYS (gettid));
+  policy.allow (SCMP_SYS (getpgrp));
+  policy.allow (SCMP_SYS (gettid));
+}
 
-    if (pid == 0)
+/**
+ * Answers an identity syscall that could not be answered by the filter
+ */
+void
+SandboxPrivate::answerIdentity(Sandbox::SyscallCall& call)
+{
+  Sandbox::Word value;
+
+  switch (call.id) {
+    case SCMP_SYS (getuid):
+    case SCMP_SYS (geteuid):
+      value = identity.uid;
+      break;
+    case SCMP_SYS (getgid):
+    case SCMP_SYS (getegid):
+      value = identity.gid;
       break;
+    case SCMP_SYS (getppid):
+      value = identity.ppid;
+      break;
+    case SCMP_SYS (getresuid):
+    case SCMP_SYS (getresgid): {
+      static_assert (sizeof (uid_t) == sizeof (gid_t), "uid_t and gid_t differ in size");
+      uid_t id = call.id == SCMP_SYS (getresuid) ? identity.uid : identity.gid;
+      Sandbox::MemoryTransaction txn (d, call.pid);
+
+      for (size_t i = 0; i < 3; i++)
+        txn.write (call.args[i], sizeof (id), &id);
+
+      call.id = -1;
+      call.returnVal = txn.commit() ? 0 : -EFAULT;
+      return;
+    }
+    case SCMP_SYS (capget): {
+      // Whatever we hold, the child holds no capabilities
+      struct __user_cap_header_struct header;
+      struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+      size_t count;
+
+      memset (data, 0, sizeof (data));
+      call.id = -1;
+      if (!d->copyData (call.pid, call.args[0], sizeof (header), &header)) {
+        call.returnVal = -EFAULT;
+        return;
+      }
 
-    if (WIFSTOPPED (status)) {
-      if (WSTOPSIG (status) == SIGTRAP) {
-        int s = ((status >> 8) & ~SIGTRAP) >> 8;
-        if (s == PTRACE_EVENT_SECCOMP) {
-          priv->handleSeccompEvent(pid);
-          ptrace (PTRACE_CONT, pid, 0, 0);
-        } else if (s == PTRACE_EVENT_EXIT) {
-          if (pid == priv->pid) {
-            ptrace (PTRACE_GETEVENTMSG, pid, 0, &status);
-            if (WIFSIGNALED (status)) {
-              if (WTERMSIG (status) == SIGSYS) {
-                struct user_regs_struct regs;
-                ptrace (PTRACE_GETREGS, pid, 0, &regs);
-                std::cout << "died on bad syscall " << regs.orig_rax << std::endl;
-              }
-              priv->d->handleSignal (WTERMSIG (status));
-              priv->d->handleExit (WTERMSIG (status));
-            } else {
-              assert (WIFEXITED (status));
-              priv->d->handleExit (WEXITSTATUS (status));
-            }
-            priv->d->releaseChild(0);
-          } else {
-            ptrace (PTRACE_CONT, pid, 0, 0);
-          }
-        } else if (s == PTRACE_EVENT_EXEC) {
-          priv->handleExecEvent(pid);
-          ptrace (PTRACE_CONT, pid, 0, 0);
-        } else if (s == PTRACE_EVENT_CLONE) {
-          pid_t childPID;
-          ptrace (PTRACE_GETEVENTMSG, pid, 0, &childPID);
-          ptrace (PTRACE_SETOPTIONS, childPID, 0,
-              PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
-          ptrace (PTRACE_CONT, childPID, 0, 0);
-          ptrace (PTRACE_CONT, pid, 0, 0);
-        } else {
-          assert(false);
-        }
-      } else {
-        priv->d->handleSignal (WSTOPSIG (status));
-        ptrace (PTRACE_CONT, pid, 0, WSTOPSIG (status));
+      switch (header.version) {
+        case _LINUX_CAPABILITY_VERSION_1:
+          count = _LINUX_CAPABILITY_U32S_1;
+          break;
+        case _LINUX_CAPABILITY_VERSION_2:
+        case _LINUX_CAPABILITY_VERSION_3:
+          count = _LINUX_CAPABILITY_U32S_3;
+          break;
+        default:
+          // Tells the caller which version we speak
+          header.version = _LINUX_CAPABILITY_VERSION_3;
+          if (!d->writeData (call.pid, call.args[0], sizeof (header.version), (const char*)&header.version))
+            call.returnVal = -EFAULT;
+          else
+            call.returnVal = call.args[1] ? -EINVAL : 0;
+          return;
       }
-    } else if (WIFCONTINUED (status)) {
-      ptrace (PTRACE_CONT, pid, 0, 0);
-    } else if (WIFSIGNALED (status) && pid == priv->pid) {
-      assert (false);
-    } else if (WIFEXITED (status) && pid == priv->pid) {
-      assert (false);
+
+      if (call.args[1] && !d->writeData (call.pid, call.args[1], count * sizeof (data[0]), (const char*)data))
+        call.returnVal = -EFAULT;
+      else
+        call.returnVal = 0;
+      return;
     }
+    default:
+      return;
   }
+
+  call.id = -1;
+  call.returnVal = value;
 }
 
-static void
-handle_ipc_read (SandboxIPC& ipc, void* data)
+/**
+ * Passes a trapped call to the handler that claimed it, if any
+ */
+void
+SandboxPrivate::dispatchSyscall(Sandbox::SyscallCall& call)
 {
-  codius_request_t* request;
-  SandboxWrap* wrap = static_cast<SandboxWrap*>(data);
-  SandboxPrivate* priv = wrap->priv;
+  const Sandbox::Word id = call.id;
+  Sandbox::SyscallHandler handler;
+
+  // The handler may claim more syscalls and move the table, so it is not
+  // safe to hold on to the slot
+  {
+    std::lock_guard<std::mutex> lock (handlersLock);
+    if (id >= handlers.size() || !handlers[id].handler)
+      return;
+    handler = handlers[id].handler;
+  }
 
-  request = codius_read_request (ipc.parent);
-  if (request == NULL)
-    error(EXIT_FAILURE, errno, "couldnt read IPC header");
+  scratchTid = call.pid;
+  d->resetScratch();
+  window.rewind (call.pid);
 
-  priv->d->handleIPC(request);
+  auto start = std::chrono::steady_clock::now();
+  handler (call);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  std::lock_guard<std::mutex> lock (handlersLock);
+  handlers[id].stats.time += elapsed;
+  handlers[id].stats.calls++;
+}
+
+/**
+ * Returns true if a handler has claimed syscall @p id. Safe to call from the
+ * tracer thread.
+ */
+bool
+SandboxPrivate::isClaimed(Sandbox::Word id)
+{
+  std::lock_guard<std::mutex> lock (handlersLock);
+  return id < handlers.size() && handlers[id].handler;
+}
+
+/**
+ * Returns true if the handler of syscall @p id has to run on the loop
+ * thread. Safe to call from the tracer thread.
+ */
+bool
+SandboxPrivate::handlerNeedsLoop(Sandbox::Word id)
+{
+  std::function<bool()> needsLoop;
+
+  {
+    std::lock_guard<std::mutex> lock (handlersLock);
+    if (id >= handlers.size())
+      return false;
+    needsLoop = handlers[id].needsLoop;
+  }
+
+  return !needsLoop || needsLoop();
+}
+
+/**
+ * Fetches the syscall number and arguments of a seccomp stop without
+ * transferring the whole register set, on kernels that support it.
+ *
+ * @return @p true if @p call was filled in, @p false if the registers need
+ * to be read instead.
+ */
+bool
+SandboxPrivate::fetchSyscallInfo(pid_t pid, Sandbox::SyscallCall& call)
+{
+#ifdef PTRACE_GET_SYSCALL_INFO
+  if (haveSyscallInfo) {
+    struct __ptrace_syscall_info info;
+    long ret = ptrace (PTRACE_GET_SYSCALL_INFO, pid, sizeof (info), &info);
+
+    if (ret > 0 && info.op == PTRACE_SYSCALL_INFO_SECCOMP) {
+      call.id = info.seccomp.nr;
+      for (size_t i = 0; i < 6; i++)
+        call.args[i] = info.seccomp.args[i];
+      return true;
+    }
+
+    // Older kernels reject the request outright
+    if (ret < 0 && errno == EIO)
+      haveSyscallInfo = false;
+  }
+#endif // PTRACE_GET_SYSCALL_INFO
+  return false;
 }
 
 void
-Sandbox::traceChild()
+SandboxPrivate::handleSeccompEvent(pid_t pid)
 {
-  SandboxPrivate* priv = m_p;
-  uv_loop_t* loop = uv_default_loop ();
-  int status = 0;
+  if (!entered_main)
+    return;
 
-  ptrace (PTRACE_ATTACH, priv->pid, 0, 0);
-  waitpid (priv->pid, &status, 0);
-  ptrace (PTRACE_SETOPTIONS, priv->pid, 0,
-      PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
+  regs.reset (pid);
 
-  uv_signal_init (loop, &priv->signal);
-  SandboxWrap* wrap = new SandboxWrap;
-  wrap->priv = priv;
-  priv->signal.data = wrap;
+  Sandbox::SyscallCall call (pid);
 
-  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
-    (*i)->startPoll(loop);
+  if (!fetchSyscallInfo (pid, call)) {
+    const struct user_regs_struct& r = regs.get();
+#ifdef __i386__
+    call.id = r.orig_eax;
+    call.args[0] = r.ebx;
+    call.args[1] = r.ecx;
+    call.args[2] = r.edx;
+    call.args[3] = r.esi;
+    call.args[4] = r.edi;
+    call.args[5] = r.ebp;
+#else
+    call.id = r.orig_rax;
+    call.args[0] = r.rdi;
+    call.args[1] = r.rsi;
+    call.args[2] = r.rdx;
+    call.args[3] = r.r10;
+    call.args[4] = r.r8;
+    call.args[5] = r.r9;
+#endif
+  }
+
+  Sandbox::SyscallCall original (call);
+
+  if (useTracerThread) {
+    // Unclaimed calls are continued without waking up the loop, and so are
+    // calls whose handler doesn't call into the embedder
+    if (!isClaimed (call.id))
+      return;
+    if (handlerNeedsLoop (call.id))
+      callEmbedder ([this, &call] { dispatchSyscall (call); }, true);
+    else
+      dispatchSyscall (call);
+  } else {
+    dispatchSyscall (call);
+  }
+
+  // Only this thread may use ptrace, so files are received here
+  if (handoffPending) {
+    handoffPending = false;
+    call.returnVal = receiveFD (pid);
+  }
+
+  // The return value only matters when the call is skipped, which changes its
+  // id, so a call with untouched id and arguments needs no writeback at all.
+  if (call.id == original.id &&
+      memcmp (call.args, original.args, sizeof (call.args)) == 0)
+    return;
+
+  struct user_regs_struct& r = regs.modify();
+
+#ifdef __i386__
+  r.orig_eax = call.id;
+  r.ebx = call.args[0];
+  r.ecx = call.args[1];
+  r.edx = call.args[2];
+  r.esi = call.args[3];
+  r.edi = call.args[4];
+  r.ebp = call.args[5];
+  r.eax = call.returnVal;
+#else
+  r.orig_rax = call.id;
+  r.rdi = call.args[0];
+  r.rsi = call.args[1];
+  r.rdx = call.args[2];
+  r.r10 = call.args[3];
+  r.r8 = call.args[4];
+  r.r9 = call.args[5];
+  r.rax = call.returnVal;
+#endif
+
+  regs.flush();
+}
+
+/**
+ * Services a single pending seccomp user notification
+ */
+void
+SandboxPrivate::handleNotification()
+{
+#ifdef HAVE_SECCOMP_NOTIFY
+  struct seccomp_notif req;
+  struct seccomp_notif_resp resp;
+
+  memset (&req, 0, sizeof (req));
+  // Fails with ENOENT if the caller went away before we got to it
+  if (ioctl (notifyFD, SECCOMP_IOCTL_NOTIF_RECV, &req) < 0)
+    return;
+
+  // Nothing traps until the filter is loaded right before exec
+  if (!entered_main) {
+    entered_main = true;
+    findEnvScratch (req.pid);
+  }
+
+  Sandbox::SyscallCall call (req.pid);
+  call.id = req.data.nr;
+  for (size_t i = 0; i < 6; i++)
+    call.args[i] = req.data.args[i];
+
+  Sandbox::SyscallCall original (call);
+
+  notifyID = req.id;
+  notifyInspected = false;
+  handlingNotification = true;
+  dispatchSyscall (call);
+  handlingNotification = false;
+
+  memset (&resp, 0, sizeof (resp));
+  resp.id = req.id;
+
+  if (call.id == static_cast<Sandbox::Word>(-1)) {
+    long ret = call.returnVal;
+    if (ret < 0)
+      resp.error = ret;
+    else
+      resp.val = ret;
+  } else if (call.id == original.id &&
+             memcmp (call.args, original.args, sizeof (call.args)) == 0 &&
+             !notifyInspected) {
+    resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+  } else if (notifyInspected) {
+    // The kernel would read the call's memory again, after the handler did,
+    // so what it acts on need not be what the handler allowed
+    Debug() << "cannot continue syscall" << original.id << "after reading its memory";
+    resp.error = -ENOSYS;
+  } else {
+    // The kernel has no way to run a notified call with different arguments
+    Debug() << "cannot rewrite syscall" << original.id << "with user notifications";
+    resp.error = -ENOSYS;
+  }
+
+  ioctl (notifyFD, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+#endif // HAVE_SECCOMP_NOTIFY
+}
+
+int
+Sandbox::installFD(int localFD, int remoteFD)
+{
+#if defined(HAVE_SECCOMP_NOTIFY) && defined(SECCOMP_IOCTL_NOTIF_ADDFD)
+  if (m_p->backend == Backend::UserNotification && m_p->handlingNotification) {
+    struct seccomp_notif_addfd addfd;
+    int ret;
+
+    memset (&addfd, 0, sizeof (addfd));
+    addfd.id = m_p->notifyID;
+    addfd.flags = SECCOMP_ADDFD_FLAG_SETFD;
+    addfd.srcfd = localFD;
+    addfd.newfd = remoteFD;
+
+    ret = ioctl (m_p->notifyFD, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+    return ret < 0 ? -errno : ret;
+  }
+#endif
+  return -ENOSYS;
+}
+
+int
+Sandbox::copyFD(int remoteFD)
+{
+#ifdef HAVE_PIDFD_GETFD
+  if (m_p->pidFD >= 0) {
+    int fd = syscall (__NR_pidfd_getfd, m_p->pidFD, remoteFD, 0);
+    return fd < 0 ? -errno : fd;
+  }
+#endif // HAVE_PIDFD_GETFD
+  return -ENOSYS;
+}
+
+bool
+Sandbox::returnFD(SyscallCall& call, int localFD, int flags)
+{
+#if defined(HAVE_SECCOMP_NOTIFY) && defined(SECCOMP_IOCTL_NOTIF_ADDFD)
+  if (m_p->backend == Backend::UserNotification && m_p->handlingNotification) {
+    struct seccomp_notif_addfd addfd;
+    int ret;
+
+    memset (&addfd, 0, sizeof (addfd));
+    addfd.id = m_p->notifyID;
+    addfd.srcfd = localFD;
+    addfd.newfd_flags = flags & O_CLOEXEC;
+
+    ret = ioctl (m_p->notifyFD, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+    if (ret < 0)
+      return false;
+    call.id = -1;
+    call.returnVal = ret;
+    return true;
+  }
+#endif
+
+  if (!m_p->sendFD (localFD))
+    return false;
+
+  // Filled in by SandboxPrivate::receiveFD() once the handler returns
+  m_p->handoffFlags = flags;
+  call.id = -1;
+  call.returnVal = -EBADF;
+  return true;
+}
+
+bool
+Sandbox::mapFD(SyscallCall& call, int localFD)
+{
+  // Only a tracer can make the child run a syscall of our choosing
+  if (!m_p->sendFD (localFD))
+    return false;
+
+  m_p->handoffFlags = O_CLOEXEC;
+  m_p->handoffMap = true;
+  memcpy (m_p->handoffMapArgs, call.args, sizeof (call.args));
+  call.id = -1;
+  call.returnVal = -EBADF;
+  return true;
+}
+
+/**
+ * Sends @p localFD over the handoff socket, for receiveFD() to pass on to the
+ * child once the current syscall handler returns
+ */
+bool
+SandboxPrivate::sendFD(int localFD)
+{
+  char data = 0;
+  struct iovec iov = {&data, 1};
+  char control[CMSG_SPACE (sizeof (int))];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+
+  if (backend != Sandbox::Backend::Ptrace || handoffSocket[0] < 0 || handoffPending)
+    return false;
+
+  memset (&msg, 0, sizeof (msg));
+  memset (control, 0, sizeof (control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &localFD, sizeof (int));
+
+  if (sendmsg (handoffSocket[0], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    return false;
+
+  handoffPending = true;
+  handoffMap = false;
+  return true;
+}
+
+pid_t
+Sandbox::getChildPID() const
+{
+  return m_p->pid;
+}
+
+void
+Sandbox::releaseChild(int signal)
+{
+  SandboxPrivate *priv = m_p;
+
+  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+    (*i)->drain();
+
+  if (priv->backend == Backend::UserNotification) {
+    // The child's exit is still reaped through its pidfd
+    if (priv->notifyFD >= 0) {
+      // Any call still trapped after this fails with ENOSYS
+      uv_poll_stop (priv->notifyPoll);
+      close (priv->notifyFD);
+      priv->notifyFD = -1;
+    }
+    priv->ipcSockets.clear();
+    if (signal && !priv->childExited)
+      ::kill (priv->pid, signal);
+    return;
+  }
+
+  if (priv->useTracerThread) {
+    // ptrace only works from the tracer thread, which holds on to the child
+    // until it is reaped
+    priv->ipcSockets.clear();
+    if (signal && !priv->childExited)
+      ::kill (priv->pid, signal);
+    return;
+  }
+
+  // The dispatcher reaps the child once it exits
+  ptrace (PTRACE_SETOPTIONS, priv->pid, 0, 0);
+  priv->ipcSockets.clear();
+  ptrace (PTRACE_DETACH, m_p->pid, 0, signal);
+}
+
+Sandbox::Address
+Sandbox::getScratchAddress() const
+{
+  return m_p->scratch.base();
+}
+
+bool
+Sandbox::pokeData(pid_t pid, Address addr, Word word)
+{
+  return ptrace (PTRACE_POKEDATA, pid, addr, word);
+}
+
+/**
+ * Allocates scratch memory for thread @p tid, warning when the arena has
+ * run out
+ *
+ * @return Address of the allocation, or 0 if there was no room
+ */
+Sandbox::Address
+SandboxPrivate::allocScratch(pid_t tid, size_t length)
+{
+  Sandbox::Address addr = scratch.allocate (tid, length);
+
+  if (!addr)
+    Debug() << "scratch arena has no room for " << length << " bytes for thread " << tid;
+
+  return addr;
+}
+
+Sandbox::Address
+Sandbox::writeScratch(size_t length, const char* buf)
+{
+  Address curAddr = m_p->allocScratch (m_p->scratchTid, length);
+  if (curAddr)
+    writeData (m_p->pid, curAddr, length, buf);
+  return curAddr;
+}
+
+void
+Sandbox::resetScratch()
+{
+  m_p->scratch.rewind (m_p->scratchTid);
+}
+
+Sandbox::ScratchLease
+Sandbox::leaseScratch(pid_t tid, size_t length)
+{
+  return ScratchLease (this, tid, m_p->allocScratch (tid, length), length);
+}
+
+void
+Sandbox::setScratchSize(size_t size)
+{
+  m_p->scratchSize = size;
+}
+
+void
+Sandbox::setWindowSize(size_t size)
+{
+  m_p->windowSize = size;
+}
+
+char*
+Sandbox::windowBuffer(pid_t tid, size_t& length)
+{
+  ScratchArena& window = m_p->window;
+  Address addr;
+
+  if (!m_p->windowMap)
+    return nullptr;
+
+  // Nothing bigger than the overflow area could fit
+  length = std::min (length, window.size() / 2);
+  addr = window.allocate (tid, length);
+
+  // Settle for what fits in the thread's own slot
+  if (!addr && length > window.slotSize()) {
+    length = window.slotSize();
+    addr = window.allocate (tid, length);
+  }
+
+  return reinterpret_cast<char*>(addr);
+}
+
+void
+Sandbox::readFromWindow(SyscallCall& call, const char* buf, size_t length, Address addr)
+{
+  call.id = SYS_pread64;
+  call.args[0] = windowChildFD;
+  call.args[1] = addr;
+  call.args[2] = length;
+  call.args[3] = buf - m_p->windowMap;
+}
+
+void
+Sandbox::readvFromWindow(SyscallCall& call, const char* buf, Address iov, size_t count)
+{
+  // The high half of the offset is only used on 32-bit systems
+  call.id = SYS_preadv;
+  call.args[0] = windowChildFD;
+  call.args[1] = iov;
+  call.args[2] = count;
+  call.args[3] = buf - m_p->windowMap;
+  call.args[4] = 0;
+}
+
+Sandbox::ScratchLease::ScratchLease()
+  : m_sbox (nullptr),
+    m_tid (0),
+    m_addr (0),
+    m_length (0),
+    m_epoch (0)
+{
+}
+
+Sandbox::ScratchLease::ScratchLease(Sandbox* sandbox, pid_t tid, Address addr, size_t length)
+  : m_sbox (addr ? sandbox : nullptr),
+    m_tid (tid),
+    m_addr (addr),
+    m_length (addr ? length : 0),
+    m_epoch (sandbox->m_p->scratch.epoch())
+{
+}
+
+Sandbox::ScratchLease::ScratchLease(ScratchLease&& other)
+  : ScratchLease()
+{
+  *this = std::move (other);
+}
+
+Sandbox::ScratchLease&
+Sandbox::ScratchLease::operator=(ScratchLease&& other)
+{
+  if (this != &other) {
+    release();
+    std::swap (m_sbox, other.m_sbox);
+    std::swap (m_tid, other.m_tid);
+    std::swap (m_addr, other.m_addr);
+    std::swap (m_length, other.m_length);
+    std::swap (m_epoch, other.m_epoch);
+  }
+  return *this;
+}
+
+Sandbox::ScratchLease::~ScratchLease()
+{
+  release();
+}
+
+Sandbox::Address
+Sandbox::ScratchLease::address() const
+{
+  return m_addr;
+}
+
+size_t
+Sandbox::ScratchLease::length() const
+{
+  return m_length;
+}
+
+Sandbox::ScratchLease::operator bool() const
+{
+  return m_addr != 0;
+}
+
+bool
+Sandbox::ScratchLease::write(const void* buf, size_t length, size_t offset)
+{
+  if (!m_addr || offset > m_length || length > m_length - offset) {
+    errno = ENOSPC;
+    return false;
+  }
+
+  return m_sbox->writeData (m_tid, m_addr + offset, length, static_cast<const char*>(buf));
+}
+
+void
+Sandbox::ScratchLease::release()
+{
+  if (m_sbox)
+    m_sbox->m_p->scratch.release (m_tid, m_addr, m_length, m_epoch);
+  m_sbox = nullptr;
+  m_addr = 0;
+  m_length = 0;
+}
+
+bool
+Sandbox::writeData (pid_t pid, Address addr, size_t length, const char* buf)
+{
+  ssize_t ret = writeMemory (pid, addr, length, buf);
+  if (ret < 0)
+    return false;
+  if (static_cast<size_t>(ret) != length) {
+    if (!errno)
+      errno = EFAULT;
+    return false;
+  }
+  return true;
+}
+
+Sandbox::MemoryTransaction::MemoryTransaction(Sandbox* sandbox, pid_t pid)
+  : m_sbox (sandbox),
+    m_pid (pid)
+{
+}
+
+void
+Sandbox::MemoryTransaction::read(Address addr, size_t length, void* buf)
+{
+  Segment seg = {addr, length, static_cast<char*>(buf), 0};
+  if (length)
+    m_reads.push_back (seg);
+}
+
+void
+Sandbox::MemoryTransaction::write(Address addr, size_t length, const void* buf)
+{
+  // The data lives in m_writeData, which may move as more writes are queued,
+  // so only its offset is kept until commit()
+  Segment seg = {addr, length, nullptr, m_writeData.size()};
+  if (length) {
+    m_writeData.insert (m_writeData.end(), static_cast<const char*>(buf), static_cast<const char*>(buf) + length);
+    m_writes.push_back (seg);
+  }
+}
+
+Sandbox::Address
+Sandbox::MemoryTransaction::writeScratch(size_t length, const void* buf)
+{
+  Address addr = m_sbox->m_p->allocScratch (m_pid, length);
+  if (addr)
+    write (addr, length, buf);
+  return addr;
+}
+
+bool
+Sandbox::MemoryTransaction::transfer(std::vector<Segment>& segments, bool write)
+{
+  SandboxPrivate* priv = m_sbox->m_p;
+  std::vector<struct iovec> local;
+  std::vector<struct iovec> remote;
+  bool success = true;
+  int savedErrno = 0;
+
+  if (!write && !segments.empty() && priv->handlingNotification)
+    priv->notifyInspected = true;
+
+  for (auto i = segments.cbegin(); i != segments.cend(); i++) {
+    struct iovec l = {i->buf, i->length};
+    struct iovec r = {reinterpret_cast<void*>(i->addr), i->length};
+    local.push_back (l);
+    remote.push_back (r);
+  }
+
+  for (size_t start = 0; start < segments.size(); start += IOV_MAX) {
+    size_t count = std::min (segments.size() - start, static_cast<size_t>(IOV_MAX));
+    ssize_t done = 0;
+
+    if (priv->haveProcessVM) {
+      if (write)
+        done = process_vm_writev (m_pid, &local[start], count, &remote[start], count, 0);
+      else
+        done = process_vm_readv (m_pid, &local[start], count, &remote[start], count, 0);
+      if (done < 0) {
+        if (errno == ENOSYS)
+          priv->haveProcessVM = false;
+        done = 0;
+      }
+    }
+
+    // Anything the vectored call didn't get to is finished one segment at a
+    // time, which lets transferMemory() fall back to slower methods
+    for (size_t i = start; i < start + count; i++) {
+      size_t skip = std::min (static_cast<size_t>(done), segments[i].length);
+      done -= skip;
+      if (skip < segments[i].length) {
+        size_t remaining = segments[i].length - skip;
+        ssize_t ret = priv->transferMemory (m_pid, segments[i].addr + skip, remaining, segments[i].buf + skip, write);
+        if (ret < 0 || static_cast<size_t>(ret) != remaining) {
+          success = false;
+          savedErrno = errno ? errno : EFAULT;
+        }
+      }
+    }
+  }
+
+  if (!success)
+    errno = savedErrno;
+  return success;
+}
+
+bool
+Sandbox::MemoryTransaction::commit()
+{
+  bool success = true;
+  int savedErrno = 0;
+
+  for (auto i = m_writes.begin(); i != m_writes.end(); i++)
+    i->buf = m_writeData.data() + i->offset;
+
+  if (!transfer (m_reads, false)) {
+    success = false;
+    savedErrno = errno;
+  }
+
+  if (!transfer (m_writes, true)) {
+    success = false;
+    savedErrno = errno;
+  }
+
+  m_reads.clear();
+  m_writes.clear();
+  m_writeData.clear();
+
+  if (!success)
+    errno = savedErrno;
+  return success;
+}
+
+TraceeDispatcher&
+TraceeDispatcher::get()
+{
+  static TraceeDispatcher dispatcher;
+  return dispatcher;
+}
+
+void
+TraceeDispatcher::add(SandboxPrivate* sandbox)
+{
+  if (!m_started) {
+    uv_signal_init (uv_default_loop(), &m_signal);
+    m_signal.data = this;
+    uv_signal_start (&m_signal, TraceeDispatcher::handleSignal, SIGCHLD);
+    m_started = true;
+  }
+
+  m_groups[sandbox->pid] = sandbox;
+}
+
+void
+TraceeDispatcher::remove(SandboxPrivate* sandbox)
+{
+  for (auto i = m_groups.begin(); i != m_groups.end(); i++) {
+    if (i->second == sandbox)
+      i->second = nullptr;
+  }
+}
+
+void
+TraceeDispatcher::handleSignal(uv_signal_t* handle, int signum)
+{
+  static_cast<TraceeDispatcher*>(handle->data)->dispatch();
+}
+
+void
+TraceeDispatcher::dispatch()
+{
+  // Handlers only add groups, or clear their owner, so the iterator stays
+  // good while the stops are handled
+  for (auto i = m_groups.begin(); i != m_groups.end();) {
+    int status = 0;
+    pid_t pid;
+
+    while ((pid = waitpid (-i->first, &status, WNOHANG | __WALL)) > 0) {
+      if (i->second)
+        i->second->handleStop (pid, status);
+      else if (WIFSTOPPED (status))
+        ptrace (PTRACE_DETACH, pid, 0, 0);
+    }
+
+    if (pid < 0 && errno == ECHILD && !i->second)
+      i = m_groups.erase (i);
+    else
+      i++;
+  }
+}
+
+/**
+ * Counts the threads of process @p pid
+ */
+static size_t
+count_threads (pid_t pid)
+{
+  std::string path ("/proc/" + std::to_string (pid) + "/task");
+  DIR* dir = opendir (path.c_str());
+  struct dirent* entry;
+  size_t count = 0;
+
+  if (!dir)
+    return 0;
+
+  while ((entry = readdir (dir)) != nullptr) {
+    if (entry->d_name[0] != '.')
+      count++;
+  }
+
+  closedir (dir);
+  return count;
+}
+
+/**
+ * Handles a single wait status of a traced child. Embedder callbacks go
+ * through callEmbedder(), so this may run on the tracer thread.
+ */
+void
+SandboxPrivate::handleStop(pid_t pid, int status)
+{
+  if (WIFSTOPPED (status) && (status >> 16) == PTRACE_EVENT_STOP) {
+    // Only children from the spawn pool are seized rather than attached.
+    // Their threads start in this stop, and group-stops are reported by it.
+    ptrace (PTRACE_CONT, pid, 0, 0);
+  } else if (WIFSTOPPED (status)) {
+    if (WSTOPSIG (status) == SIGTRAP) {
+      int s = ((status >> 8) & ~SIGTRAP) >> 8;
+      if (s == PTRACE_EVENT_SECCOMP) {
+        handleSeccompEvent(pid);
+        resume (pid);
+      } else if (s == PTRACE_EVENT_EXIT) {
+        if (pid == this->pid) {
+          unsigned long msg = 0;
+          ptrace (PTRACE_GETEVENTMSG, pid, 0, &msg);
+          status = msg;
+          if (WIFSIGNALED (status) && WTERMSIG (status) == SIGSYS) {
+            struct user_regs_struct regs;
+            ptrace (PTRACE_GETREGS, pid, 0, &regs);
+            std::cout << "died on bad syscall " << regs.orig_rax << std::endl;
+          }
+          callEmbedder ([this, status] {
+            if (WIFSIGNALED (status)) {
+              d->handleSignal (WTERMSIG (status));
+              d->handleExit (WTERMSIG (status));
+            } else {
+              assert (WIFEXITED (status));
+              d->handleExit (WEXITSTATUS (status));
+            }
+            d->releaseChild(0);
+          }, false);
+          // The tracer thread keeps hold of the child until it is reaped
+          if (useTracerThread)
+            ptrace (PTRACE_CONT, pid, 0, 0);
+        } else {
+          ptrace (PTRACE_CONT, pid, 0, 0);
+        }
+      } else if (s == PTRACE_EVENT_EXEC) {
+        handleExecEvent(pid, true);
+        resume (pid);
+      } else if (s == PTRACE_EVENT_CLONE) {
+        pid_t childPID;
+        ptrace (PTRACE_GETEVENTMSG, pid, 0, &childPID);
+        ptrace (PTRACE_SETOPTIONS, childPID, 0,
+            PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
+        ptrace (PTRACE_CONT, childPID, 0, 0);
+        ptrace (PTRACE_CONT, pid, 0, 0);
+      } else {
+        assert(false);
+      }
+    } else {
+      int signal = WSTOPSIG (status);
+      if (signal == SIGSTOP && snapshotRequest && !haveSnapshot && pid == this->pid) {
+        if (count_threads (pid) > 1) {
+          // A copy would only get this thread, while the others might hold
+          // locks that it then waits on forever
+          refuseSnapshot();
+          ptrace (PTRACE_CONT, pid, 0, 0);
+        } else if (takeSnapshot (pid)) {
+          // Held in this stop for good, as the template for new instances
+          callEmbedder ([this] { d->handleSnapshot(); }, false);
+        } else {
+          // Not waiting on the reply yet, so try again once it is
+          ptrace (PTRACE_CONT, pid, 0, 0);
+          syscall (SYS_tgkill, pid, pid, SIGSTOP);
+        }
+        return;
+      }
+      callEmbedder ([this, signal] { d->handleSignal (signal); }, false);
+      ptrace (PTRACE_CONT, pid, 0, signal);
+    }
+  } else if (WIFCONTINUED (status)) {
+    ptrace (PTRACE_CONT, pid, 0, 0);
+  } else if (WIFSIGNALED (status) || WIFEXITED (status)) {
+    // Exits were already reported from PTRACE_EVENT_EXIT, so all that is left
+    // is forgetting about the child. The arenas belong to whichever thread
+    // runs the handlers, which is this one.
+    scratch.forget (pid);
+    window.forget (pid);
+    if (pid == this->pid) {
+      childExited = true;
+      if (!useTracerThread)
+        TraceeDispatcher::get().remove (this);
+    }
+  }
+}
+
+/**
+ * Continues thread @p pid out of a ptrace stop. Signals that arrived while
+ * it was stepped through injected syscalls are delivered now: the first
+ * along with PTRACE_CONT, and the rest sent again, to stop it once more.
+ */
+void
+SandboxPrivate::resume(pid_t pid)
+{
+  auto deferred = deferredSignals.find (pid);
+  int signal = 0;
+
+  if (deferred != deferredSignals.end()) {
+    std::vector<int> signals;
+
+    signals.swap (deferred->second);
+    deferredSignals.erase (deferred);
+    if (!signals.empty()) {
+      signal = signals[0];
+      for (size_t i = 1; i < signals.size(); i++)
+        syscall (SYS_tkill, pid, signals[i]);
+      callEmbedder ([this, signal] { d->handleSignal (signal); }, false);
+    }
+  }
+
+  ptrace (PTRACE_CONT, pid, 0, signal);
+}
+
+/**
+ * Answers the pending snapshot call with a failure. The child may try again,
+ * e.g. once it is down to one thread.
+ */
+void
+SandboxPrivate::refuseSnapshot()
+{
+  codius_result_t* result = codius_result_new ();
+
+  result->success = 0;
+  codius_send_reply (snapshotRequest, result);
+  codius_result_free (result);
+  codius_request_free (snapshotRequest);
+  snapshotRequest = nullptr;
+}
+
+/**
+ * Records the syscall that the child was stopped in as the point at which
+ * instances of its snapshot resume. The instruction that made the syscall is
+ * also used to run syscalls on the template's behalf.
+ *
+ * @return false if the child wasn't stopped in codius_sync_call()'s read of
+ * the reply header
+ */
+bool
+SandboxPrivate::takeSnapshot(pid_t pid)
+{
+  struct user_regs_struct regs;
+  Sandbox::Word insn;
+  long ret;
+
+  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0)
+    return false;
+
+  // Copies are sent the reply, so they must resume reading it
+  ret = regs.rax;
+  if (regs.orig_rax != __NR_read || regs.rdi != 3 ||
+      regs.rdx != sizeof (codius_rpc_header_t) ||
+      (ret != -ERESTARTSYS && ret != -ERESTARTNOINTR &&
+       ret != -ERESTARTNOHAND && ret != -ERESTART_RESTARTBLOCK))
+    return false;
+
+  errno = 0;
+  insn = ptrace (PTRACE_PEEKDATA, pid, regs.rip - 2, 0);
+  // syscall is 0f 05
+  if (errno != 0 || (insn & 0xffff) != 0x050f)
+    return false;
+
+  // Restart the syscall the same way the kernel would have
+  regs.rip -= 2;
+  regs.rax = ret == -ERESTART_RESTARTBLOCK ? __NR_restart_syscall : regs.orig_rax;
+  snapshotRegs = regs;
+  haveSnapshot = true;
+
+  return true;
+}
+
+/**
+ * Makes a stopped tracee run one syscall by single stepping over the syscall
+ * instruction at @p regs.rip. Seccomp stops on the way are let through
+ * without involving any handlers.
+ *
+ * @param forked Set to the new child's PID if the syscall forks
+ * @param signals Signals that arrive on the way are added to this, to be
+ * delivered once the tracee is continued. Without it they are discarded.
+ * @return Result of the syscall, or a negative error number
+ */
+static long
+inject_syscall (pid_t pid, struct user_regs_struct regs, long nr,
+                long arg0, long arg1, long arg2, long arg3 = 0,
+                long arg4 = 0, long arg5 = 0, pid_t* forked = nullptr,
+                std::vector<int>* signals = nullptr)
+{
+  int status;
+
+  regs.orig_rax = -1;
+  regs.rax = nr;
+  regs.rdi = arg0;
+  regs.rsi = arg1;
+  regs.rdx = arg2;
+  regs.r10 = arg3;
+  regs.r8 = arg4;
+  regs.r9 = arg5;
+
+  if (ptrace (PTRACE_SETREGS, pid, 0, &regs) < 0 ||
+      ptrace (PTRACE_SINGLESTEP, pid, 0, 0) < 0)
+    return -errno;
+
+  while (true) {
+    if (waitpid (pid, &status, __WALL) != pid || !WIFSTOPPED (status))
+      return -ECHILD;
+
+    int event = status >> 16;
+    if (event == PTRACE_EVENT_FORK && forked) {
+      unsigned long msg = 0;
+      ptrace (PTRACE_GETEVENTMSG, pid, 0, &msg);
+      *forked = msg;
+    } else if (event == 0 && WSTOPSIG (status) == SIGTRAP) {
+      break;
+    } else if (event == 0 && signals) {
+      signals->push_back (WSTOPSIG (status));
+    }
+
+    ptrace (PTRACE_SINGLESTEP, pid, 0, 0);
+  }
+
+  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0)
+    return -errno;
+
+  return regs.rax;
+}
+
+/**
+ * Single-steps a stopped child until it is back in userspace, ready for
+ * inject_syscall()
+ *
+ * @param signals Signals that arrive on the way are added to this, as for
+ * inject_syscall()
+ */
+static bool
+step_out (pid_t pid, std::vector<int>* signals)
+{
+  int status;
+
+  while (true) {
+    if (ptrace (PTRACE_SINGLESTEP, pid, 0, 0) < 0 ||
+        waitpid (pid, &status, __WALL) != pid || !WIFSTOPPED (status))
+      return false;
+    if ((status >> 16) != 0)
+      continue;
+    if (WSTOPSIG (status) == SIGTRAP)
+      return true;
+    // The next step would discard it
+    signals->push_back (WSTOPSIG (status));
+  }
+}
+
+/**
+ * Maps a private anonymous region of @p length bytes into a child that has
+ * just exec'd, for use as its scratch arena. A syscall instruction is put at
+ * the child's entry point for as long as it takes to run mmap().
+ *
+ * @param inEvent Whether the child is in PTRACE_EVENT_EXEC. Registers
+ * written there are overwritten by the return value of exec, so the child
+ * is stepped out of it first.
+ * @param signals Signals that arrive meanwhile, as for inject_syscall()
+ * @return Address of the region, or 0 on failure
+ */
+static Sandbox::Address
+map_scratch (pid_t pid, size_t length, bool inEvent, std::vector<int>* signals)
+{
+  struct user_regs_struct regs;
+  Sandbox::Word insn;
+  long addr;
+
+  if (length == 0)
+    return 0;
+
+  if (inEvent && !step_out (pid, signals))
+    return 0;
+
+  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0)
+    return 0;
+
+  errno = 0;
+  insn = ptrace (PTRACE_PEEKTEXT, pid, regs.rip, 0);
+  // syscall is 0f 05
+  if (errno != 0 || ptrace (PTRACE_POKETEXT, pid, regs.rip, (insn & ~0xffffUL) | 0x050f) < 0)
+    return 0;
+
+  addr = inject_syscall (pid, regs, __NR_mmap, 0, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, nullptr, signals);
+
+  ptrace (PTRACE_POKETEXT, pid, regs.rip, insn);
+  ptrace (PTRACE_SETREGS, pid, 0, &regs);
+
+  return addr > 0 ? addr : 0;
+}
+
+/**
+ * Has thread @p pid, stopped at the entry of a trapped syscall, receive the
+ * file sent over the handoff socket by sendFD(). The trapped call is skipped,
+ * and the child stepped back onto its syscall instruction to run recvmsg()
+ * instead. Registers are left for handleSeccompEvent() to restore.
+ *
+ * For Sandbox::mapFD(), the file is then mapped with the arguments of the
+ * trapped mmap() and closed again.
+ *
+ * @return Number of the file inside the child, or what mmap() returned, or a
+ * negative error number
+ */
+long
+SandboxPrivate::receiveFD(pid_t pid)
+{
+  struct Message {
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE (sizeof (int))];
+    char data;
+  } m;
+  struct user_regs_struct r = regs.get();
+  Sandbox::Address addr = allocScratch (pid, sizeof (m));
+  Sandbox::Word insn;
+  std::vector<int>* signals = &deferredSignals[pid];
+  struct cmsghdr* cmsg;
+  long ret;
+  int fd;
+
+  errno = 0;
+  insn = ptrace (PTRACE_PEEKTEXT, pid, r.rip - 2, 0);
+
+  // syscall is 0f 05, which is what the child gets sent back to
+  if (!addr) {
+    ret = -ENOMEM;
+  } else if (errno != 0 || (insn & 0xffff) != 0x050f) {
+    ret = -ENOSYS;
+  } else {
+    memset (&m, 0, sizeof (m));
+    m.msg.msg_iov = reinterpret_cast<struct iovec*>(addr + offsetof (Message, iov));
+    m.msg.msg_iovlen = 1;
+    m.msg.msg_control = reinterpret_cast<void*>(addr + offsetof (Message, control));
+    m.msg.msg_controllen = sizeof (m.control);
+    m.iov.iov_base = reinterpret_cast<void*>(addr + offsetof (Message, data));
+    m.iov.iov_len = 1;
+    r.orig_rax = -1;
+
+    if (transferMemory (pid, addr, sizeof (m), reinterpret_cast<char*>(&m), true) != sizeof (m) ||
+        ptrace (PTRACE_SETREGS, pid, 0, &r) < 0 || !step_out (pid, signals)) {
+      ret = -EFAULT;
+    } else {
+      r.rip -= 2;
+      // Never blocks, in case another thread got to the file first
+      ret = inject_syscall (pid, r, __NR_recvmsg, handoffChildFD, addr,
+                            MSG_DONTWAIT | (handoffFlags & O_CLOEXEC ? MSG_CMSG_CLOEXEC : 0),
+                            0, 0, 0, nullptr, signals);
+    }
+  }
+
+  if (ret >= 0) {
+    ret = -EMFILE;
+    if (transferMemory (pid, addr, sizeof (m), reinterpret_cast<char*>(&m), false) == sizeof (m) &&
+        !(m.msg.msg_flags & MSG_CTRUNC)) {
+      // msg_control points into the child, so find the header in our copy
+      m.msg.msg_control = m.control;
+      cmsg = CMSG_FIRSTHDR (&m.msg);
+      if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy (&fd, CMSG_DATA (cmsg), sizeof (fd));
+        ret = fd;
+      }
+    }
+
+    if (ret >= 0 && handoffMap) {
+      const Sandbox::Word* a = handoffMapArgs;
+      ret = inject_syscall (pid, r, __NR_mmap, a[0], a[1], a[2], a[3], fd, a[5], nullptr, signals);
+      inject_syscall (pid, r, __NR_close, fd, 0, 0, 0, 0, 0, nullptr, signals);
+    }
+  } else {
+    // Drop the file, so it isn't received by the next call instead
+    char data;
+    struct iovec iov = {&data, 1};
+    struct msghdr msg;
+    char control[CMSG_SPACE (sizeof (int))];
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    if (recvmsg (handoffSocket[1], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) >= 0 &&
+        (cmsg = CMSG_FIRSTHDR (&msg)) && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy (&fd, CMSG_DATA (cmsg), sizeof (fd));
+      close (fd);
+    }
+  }
+
+  return ret;
+}
+
+#ifdef HAVE_PIDFD_GETFD
+/**
+ * Connects an unconnected unix socket that the process behind @p pidFD has as
+ * @p remoteFD. Our copy of it is connected to a throwaway listener, which
+ * connects the child's end as well.
+ *
+ * @return Our end of the connection, or -1
+ */
+static int
+connect_remote_socket (int pidFD, int remoteFD)
+{
+  struct sockaddr_un addr;
+  socklen_t addrLen = sizeof (addr);
+  int remote, listener;
+  int local = -1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  remote = syscall (__NR_pidfd_getfd, pidFD, remoteFD, 0);
+  listener = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  // Binding to just the address family picks an unused abstract name
+  if (remote >= 0 && listener >= 0 &&
+      bind (listener, (struct sockaddr*)&addr, sizeof (sa_family_t)) == 0 &&
+      listen (listener, 1) == 0 &&
+      getsockname (listener, (struct sockaddr*)&addr, &addrLen) == 0 &&
+      connect (remote, (struct sockaddr*)&addr, addrLen) == 0)
+    local = accept (listener, nullptr, nullptr);
+
+  if (remote >= 0)
+    close (remote);
+  if (listener >= 0)
+    close (listener);
+
+  return local;
+}
+#endif // HAVE_PIDFD_GETFD
+
+/**
+ * Runs @p job on the loop thread. Without a tracer thread, that is right now.
+ *
+ * @param wait Whether to block until @p job has run
+ */
+void
+SandboxPrivate::callEmbedder(std::function<void()> job, bool wait)
+{
+  std::promise<void> done;
+
+  if (!useTracerThread) {
+    job();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock (tracerLock);
+    // The sandbox is going away, and nobody is left to run it
+    if (tracerStopping)
+      return;
+    TracerJob j = {job, wait ? &done : nullptr};
+    tracerJobs.push_back (j);
+  }
+
+  uv_async_send (tracerAsync);
+
+  if (wait)
+    done.get_future().wait();
+}
+
+void
+SandboxPrivate::runTracerJobs()
+{
+  std::deque<TracerJob> jobs;
+
+  {
+    std::lock_guard<std::mutex> lock (tracerLock);
+    jobs.swap (tracerJobs);
+  }
+
+  for (auto i = jobs.begin(); i != jobs.end(); i++) {
+    i->run();
+    if (i->done)
+      i->done->set_value();
+  }
+}
+
+static void
+handle_tracer_jobs(uv_async_t* handle, int status)
+{
+  SandboxWrap* wrap = static_cast<SandboxWrap*>(handle->data);
+  wrap->priv->runTracerJobs();
+}
+
+static void
+free_poll(uv_handle_t* handle)
+{
+  delete static_cast<SandboxWrap*>(handle->data);
+  delete reinterpret_cast<uv_poll_t*>(handle);
+}
+
+/**
+ * Closes one of the notify backend's polls, if there is one. The poll and
+ * its SandboxWrap are freed once libuv is done with them.
+ */
+static void
+close_poll(uv_poll_t*& poll)
+{
+  if (!poll)
+    return;
+
+  uv_close (reinterpret_cast<uv_handle_t*>(poll), free_poll);
+  poll = nullptr;
+}
+
+static void
+free_tracer_async(uv_handle_t* handle)
+{
+  delete static_cast<SandboxWrap*>(handle->data);
+  delete reinterpret_cast<uv_async_t*>(handle);
+}
+
+/**
+ * Sets up tracing from the first wait status of a freshly spawned child.
+ * Children from spawnVM() have already exec'd by then, so their first stop
+ * is the SIGTRAP sent after exec rather than PTRACE_EVENT_EXEC.
+ *
+ * @return false if the child is already gone, e.g. because exec failed
+ */
+bool
+SandboxPrivate::handleFirstStop(int status)
+{
+  if (WIFEXITED (status) || WIFSIGNALED (status)) {
+    childExited = true;
+    callEmbedder ([this, status] {
+      if (WIFSIGNALED (status)) {
+        d->handleSignal (WTERMSIG (status));
+        d->handleExit (WTERMSIG (status));
+      } else {
+        d->handleExit (WEXITSTATUS (status));
+      }
+    }, false);
+    return false;
+  }
+
+  ptrace (PTRACE_SETOPTIONS, pid, 0,
+      PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
+
+  if (WIFSTOPPED (status) && WSTOPSIG (status) == SIGTRAP)
+    handleExecEvent (pid, false);
+
+  return true;
+}
+
+/**
+ * Body of the tracer thread. The child is forked from this thread, so that
+ * this thread is its tracer. Stops are serviced until the child is reaped.
+ */
+void
+SandboxPrivate::runTracer()
+{
+  int status = 0;
+  pid_t stopped;
+
+  waitpid (pid, &status, 0);
+  if (handleFirstStop (status))
+    resume (pid);
+
+  while (!childExited) {
+    stopped = waitpid (-pid, &status, __WALL);
+
+    if (stopped < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    handleStop (stopped, status);
+  }
+
+  childExited = true;
+  callEmbedder ([this] { finishTracer(); }, false);
+}
+
+/**
+ * Cleans up after the tracer thread once it has nothing left to do
+ */
+void
+SandboxPrivate::finishTracer()
+{
+  if (tracer.joinable())
+    tracer.join();
+
+  if (tracerAsync) {
+    uv_close (reinterpret_cast<uv_handle_t*>(tracerAsync), free_tracer_async);
+    tracerAsync = nullptr;
+  }
+}
+
+/**
+ * Stops the tracer thread from the loop thread, without waiting for the
+ * loop to run any of the jobs it has queued
+ */
+void
+SandboxPrivate::stopTracer()
+{
+  std::deque<TracerJob> jobs;
+
+  if (!tracer.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock (tracerLock);
+    tracerStopping = true;
+    jobs.swap (tracerJobs);
+  }
+
+  for (auto i = jobs.begin(); i != jobs.end(); i++) {
+    if (i->done)
+      i->done->set_value();
+  }
+
+  if (!childExited)
+    ::kill (pid, SIGKILL);
+
+  finishTracer();
+}
+
+static void
+handle_notify(uv_poll_t* handle, int status, int events)
+{
+  SandboxWrap* wrap = static_cast<SandboxWrap*>(handle->data);
+  wrap->priv->handleNotification();
+}
+
+static void
+handle_child_exit(uv_poll_t* handle, int status, int events)
+{
+  SandboxWrap* wrap = static_cast<SandboxWrap*>(handle->data);
+  SandboxPrivate* priv = wrap->priv;
+
+  if (priv->childExited || waitpid (priv->pid, &status, WNOHANG) != priv->pid)
+    return;
+
+  uv_poll_stop (priv->exitPoll);
+  close (priv->pidFD);
+  priv->pidFD = -1;
+
+  if (WIFSIGNALED (status)) {
+    priv->childExited = true;
+    priv->d->handleSignal (WTERMSIG (status));
+    priv->d->handleExit (WTERMSIG (status));
+  } else if (WIFEXITED (status)) {
+    priv->childExited = true;
+    priv->d->handleExit (WEXITSTATUS (status));
+  } else {
+    return;
+  }
+  priv->d->releaseChild (0);
+}
+
+static void
+handle_ipc_read (SandboxIPC& ipc, void* data)
+{
+  codius_request_t* request;
+  SandboxWrap* wrap = static_cast<SandboxWrap*>(data);
+  SandboxPrivate* priv = wrap->priv;
+
+  request = codius_read_request (ipc.parent);
+  if (request == NULL)
+    error(EXIT_FAILURE, errno, "couldnt read IPC header");
+
+  if (priv->snapshotServer && !priv->useTracerThread &&
+      priv->backend == Sandbox::Backend::Ptrace &&
+      strcmp (request->api_name, "sandbox") == 0 &&
+      strcmp (request->method_name, "snapshot") == 0) {
+    // The template never gets to make a second call
+    if (priv->snapshotRequest) {
+      codius_request_free (request);
+      return;
+    }
+    // Stop the child where it waits for the reply, see handleStop()
+    priv->snapshotRequest = request;
+    syscall (SYS_tgkill, priv->pid, priv->pid, SIGSTOP);
+    return;
+  }
+
+  priv->d->handleIPC(request);
+}
+
+void
+Sandbox::traceChild()
+{
+  SandboxPrivate* priv = m_p;
+  uv_loop_t* loop = uv_default_loop ();
+  int status = 0;
+
+  ptrace (PTRACE_ATTACH, priv->pid, 0, 0);
+  waitpid (priv->pid, &status, 0);
+  if (!priv->handleFirstStop (status))
+    return;
+
+  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+    (*i)->startPoll(loop);
+
+  TraceeDispatcher::get().add (priv);
+  priv->resume (priv->pid);
+}
+
+void
+Sandbox::watchChild()
+{
+#ifdef HAVE_SECCOMP_NOTIFY
+  SandboxPrivate* priv = m_p;
+  uv_loop_t* loop = uv_default_loop ();
+  int remoteFD = -1;
+  char ack = 0;
+
+  close (priv->notifySocket[1]);
+
+  if (read (priv->notifySocket[0], &remoteFD, sizeof (remoteFD)) != sizeof (remoteFD))
+    error (EXIT_FAILURE, errno, "Could not find seccomp listener in child");
+
+  // Also becomes readable once the child exits
+  priv->pidFD = syscall (__NR_pidfd_open, priv->pid, 0);
+  if (priv->pidFD < 0)
+    error (EXIT_FAILURE, errno, "Could not open child pidfd");
+  priv->notifyFD = syscall (__NR_pidfd_getfd, priv->pidFD, remoteFD, 0);
+  if (priv->notifyFD < 0)
+    error (EXIT_FAILURE, errno, "Could not take seccomp listener from child");
+
+  if (write (priv->notifySocket[0], &ack, sizeof (ack)) != sizeof (ack))
+    error (EXIT_FAILURE, errno, "Could not release child");
+  close (priv->notifySocket[0]);
+
+  // Left over from a child spawned earlier
+  close_poll (priv->notifyPoll);
+  close_poll (priv->exitPoll);
+
+  // Each poll gets its own wrap, freed along with it
+  SandboxWrap* notifyWrap = new SandboxWrap;
+  notifyWrap->priv = priv;
+  priv->notifyPoll = new uv_poll_t;
+  uv_poll_init (loop, priv->notifyPoll, priv->notifyFD);
+  priv->notifyPoll->data = notifyWrap;
+
+  SandboxWrap* exitWrap = new SandboxWrap;
+  exitWrap->priv = priv;
+  priv->exitPoll = new uv_poll_t;
+  uv_poll_init (loop, priv->exitPoll, priv->pidFD);
+  priv->exitPoll->data = exitWrap;
+
+  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+    (*i)->startPoll(loop);
+
+  uv_poll_start (priv->notifyPoll, UV_READABLE, handle_notify);
+  uv_poll_start (priv->exitPoll, UV_READABLE, handle_child_exit);
+#endif // HAVE_SECCOMP_NOTIFY
+}
+
+void
+Sandbox::setPolicy(const SyscallPolicy& policy)
+{
+  m_p->policy = policy;
+}
+
+const SyscallPolicy&
+Sandbox::getPolicy() const
+{
+  return m_p->policy;
+}
+
+void
+Sandbox::setIdentity(const Identity& identity)
+{
+  const int calls[] = {
+    SCMP_SYS (getuid),
+    SCMP_SYS (geteuid),
+    SCMP_SYS (getgid),
+    SCMP_SYS (getegid),
+    SCMP_SYS (getppid),
+    SCMP_SYS (getresuid),
+    SCMP_SYS (getresgid),
+    SCMP_SYS (capget)
+  };
+  SandboxPrivate* priv = m_p;
+
+  m_p->identity = identity;
+  m_p->haveIdentity = true;
+
+  for (size_t i = 0; i < sizeof (calls) / sizeof (calls[0]); i++)
+    claimSyscall (calls[i], [priv](SyscallCall& call) {priv->answerIdentity (call);}, [] {return false;});
+}
+
+void
+Sandbox::setTracerThread(bool enabled)
+{
+  m_p->useTracerThread = enabled;
+}
+
+void
+Sandbox::setSnapshotServer(bool enabled)
+{
+  m_p->snapshotServer = enabled;
+}
+
+bool
+Sandbox::hasSnapshot() const
+{
+  return m_p->haveSnapshot;
+}
+
+void
+Sandbox::handleSnapshot()
+{
+}
+
+bool
+Sandbox::spawnFromSnapshot(Sandbox& server)
+{
+#ifdef HAVE_PIDFD_GETFD
+  SandboxPrivate* priv = m_p;
+  SandboxPrivate* tmpl = server.m_p;
+  SandboxWrap* wrap;
+  SandboxIPC* control;
+  codius_request_t request;
+  codius_result_t* result;
+  pid_t pid = 0;
+  int pidFD;
+  int status;
+  bool ok;
+
+  if (!tmpl->haveSnapshot || priv->useTracerThread || priv->pid)
+    return false;
+
+  wrap = new SandboxWrap;
+  wrap->priv = priv;
+  CallbackIPC::Ptr ipcSocket (new CallbackIPC (3));
+  ipcSocket->setCallback (handle_ipc_read, wrap);
+  control = ipcSocket.get();
+  addIPC (std::move (ipcSocket));
+
+  // CLONE_PARENT makes the copy our child, so that we reap it rather than the
+  // template, which never runs again
+  ptrace (PTRACE_SETOPTIONS, tmpl->pid, 0,
+      PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK);
+  if (inject_syscall (tmpl->pid, tmpl->snapshotRegs, __NR_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0, 0, &pid) <= 0 || pid <= 0)
+    return false;
+
+  // The copy starts out stopped, and inherits the template's process group
+  if (waitpid (pid, &status, __WALL) != pid || !WIFSTOPPED (status))
+    return false;
+  setpgid (pid, pid);
+
+  // Give the copy a fresh socket in place of each of the template's channels
+  pidFD = syscall (__NR_pidfd_open, pid, 0);
+  ok = pidFD >= 0;
+  for (auto i = priv->ipcSockets.begin(); ok && i != priv->ipcSockets.end(); i++) {
+    long remote = inject_syscall (pid, tmpl->snapshotRegs, __NR_socket, AF_UNIX, SOCK_STREAM, 0);
+    int local = remote >= 0 ? connect_remote_socket (pidFD, remote) : -1;
+
+    ok = local >= 0;
+    if (ok) {
+      inject_syscall (pid, tmpl->snapshotRegs, __NR_close, (*i)->dupAs, 0, 0);
+      ok = inject_syscall (pid, tmpl->snapshotRegs, __NR_fcntl, remote, F_DUPFD, (*i)->dupAs) == (*i)->dupAs;
+      inject_syscall (pid, tmpl->snapshotRegs, __NR_close, remote, 0, 0);
+      (*i)->adopt (local);
+    }
+  }
+
+  // The window is shared with the template, so the copy goes without
+  if (ok && tmpl->windowFD >= 0)
+    inject_syscall (pid, tmpl->snapshotRegs, __NR_close, windowChildFD, 0, 0);
+  if (ok && tmpl->handoffSocket[1] >= 0)
+    inject_syscall (pid, tmpl->snapshotRegs, __NR_close, handoffChildFD, 0, 0);
+  if (pidFD >= 0)
+    close (pidFD);
+
+  if (!ok) {
+    ::kill (pid, SIGKILL);
+    waitpid (pid, nullptr, __WALL);
+    return false;
+  }
+
+  // Back to the interrupted read of the snapshot call's reply
+  ptrace (PTRACE_SETREGS, pid, 0, &tmpl->snapshotRegs);
+
+  priv->pid = pid;
+  priv->backend = Backend::Ptrace;
+  priv->entered_main = true;
+  priv->scratch.assign (tmpl->scratch.base(), tmpl->scratch.size());
+  priv->vfs->copyState (*tmpl->vfs);
+
+  request = *tmpl->snapshotRequest;
+  request._fd = control->parent;
+  result = codius_result_new ();
+  result->success = 1;
+  codius_send_reply (&request, result);
+  codius_result_free (result);
+
+  ptrace (PTRACE_SETOPTIONS, pid, 0,
+      PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
+
+  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+    (*i)->startPoll (uv_default_loop());
+
+  TraceeDispatcher::get().add (priv);
+  ptrace (PTRACE_CONT, pid, 0, 0);
+
+  return true;
+#else
+  return false;
+#endif // HAVE_PIDFD_GETFD
+}
+
+void
+Sandbox::setSpawnPool(std::shared_ptr<SpawnPool> pool)
+{
+  m_p->spawnPool = pool;
+}
+
+/**
+ * Turns @p envp into the "NAME=value" strings a child is started with,
+ * including the scratch buffer
+ */
+static std::vector<std::string>
+child_environment (std::map<std::string, std::string>& envp)
+{
+  std::vector<std::string> env;
+
+  for (auto i = envp.cbegin(); i != envp.cend(); i++)
+    env.push_back (i->first + "=" + i->second);
+  env.push_back ("CODIUS_SCRATCH_BUFFER=" + std::string (envScratchLength, static_cast<char>(CODIUS_MAGIC_BYTES)));
+
+  return env;
+}
+
+/**
+ * Hands the same program, environment and IPC channels that
+ * Sandbox::execChild() would use to a warm child from the spawn pool, which
+ * already runs under our filter. The child is seized on the way.
+ *
+ * @return PID of the child, or -1 if it has to be forked after all
+ */
+pid_t
+SandboxPrivate::spawnFromPool(char** argv, std::map<std::string, std::string>& envp)
+{
+  if (!filter)
+    return -1;
+
+  return spawnPool->spawn (argv, child_environment (envp), childFDs(), filter,
+      PTRACE_O_EXITKILL | PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE);
+}
+
+/**
+ * Returns pairs of (our file descriptor, number it gets in the child) for
+ * everything a child is given besides stdin
+ */
+std::vector<std::pair<int, int> >
+SandboxPrivate::childFDs() const
+{
+  std::vector<std::pair<int, int> > fds;
+
+  for (auto i = ipcSockets.cbegin(); i != ipcSockets.cend(); i++)
+    fds.push_back (std::make_pair ((*i)->child, (*i)->dupAs));
+
+  if (windowFD >= 0)
+    fds.push_back (std::make_pair (windowFD, windowChildFD));
+
+  if (handoffSocket[1] >= 0)
+    fds.push_back (std::make_pair (handoffSocket[1], handoffChildFD));
+
+  return fds;
+}
+
+/**
+ * Moves @p fd out of the way if it is one of the numbers our own files get
+ * in a child, as dup2() onto itself would leave it close-on-exec, and an
+ * earlier dup2() could replace it
+ */
+static int
+clear_of_child_fds (int fd)
+{
+  int moved;
+
+  if (fd != windowChildFD && fd != handoffChildFD)
+    return fd;
+
+  moved = fcntl (fd, F_DUPFD_CLOEXEC, std::max (windowChildFD, handoffChildFD) + 1);
+  close (fd);
+  return moved;
+}
+
+/**
+ * Creates the data window for the next child, unless it is turned off
+ */
+void
+SandboxPrivate::openWindow()
+{
+  // Unlike scratch memory, the window is never shared between threads, so it
+  // has to fit at least eight slots
+  size_t slotSize = std::min (windowSlotSize, windowSize / 16);
+
+  closeWindow();
+
+  if (windowSize == 0)
+    return;
+
+  if (slotSize < windowMinSlotSize) {
+    Debug() << "data window of " << windowSize << " bytes is too small";
+    return;
+  }
+
+  windowFD = clear_of_child_fds (memfd_create ("codius-window", MFD_CLOEXEC));
+
+  if (windowFD >= 0 && ftruncate (windowFD, windowSize) == 0) {
+    void* map = mmap (nullptr, windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, windowFD, 0);
+    if (map != MAP_FAILED)
+      windowMap = static_cast<char*>(map);
+  }
+
+  if (!windowMap) {
+    Debug() << "could not create data window: " << strerror (errno);
+    closeWindow();
+    return;
+  }
+
+  window.assign (reinterpret_cast<Sandbox::Address>(windowMap), windowSize, slotSize);
+}
+
+void
+SandboxPrivate::closeWindow()
+{
+  if (windowMap)
+    munmap (windowMap, windowSize);
+  if (windowFD >= 0)
+    close (windowFD);
+  windowMap = nullptr;
+  windowFD = -1;
+  window.assign (0, 0);
+}
+
+/**
+ * Creates the socket that Sandbox::returnFD() sends files to the next child
+ * over. Datagrams keep one file from being received along with another.
+ */
+void
+SandboxPrivate::openHandoff()
+{
+  closeHandoff();
+
+  if (socketpair (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, handoffSocket) < 0) {
+    Debug() << "could not create handoff socket: " << strerror (errno);
+    handoffSocket[0] = handoffSocket[1] = -1;
+    return;
+  }
+
+  handoffSocket[0] = clear_of_child_fds (handoffSocket[0]);
+  handoffSocket[1] = clear_of_child_fds (handoffSocket[1]);
+  if (handoffSocket[0] < 0 || handoffSocket[1] < 0)
+    closeHandoff();
+}
+
+void
+SandboxPrivate::closeHandoff()
+{
+  for (int i = 0; i < 2; i++) {
+    if (handoffSocket[i] >= 0)
+      close (handoffSocket[i]);
+    handoffSocket[i] = -1;
+  }
+}
+
+/**
+ * Returns the compiled filter for children of this sandbox. Sandboxes with
+ * the same policy and the same kind of identity share one program.
+ */
+SyscallPolicy::Program
+SandboxPrivate::buildFilter(uint32_t trap) const
+{
+  if (!haveIdentity && windowFD < 0 && handoffSocket[1] < 0)
+    return policy.cachedBPF (trap);
+
+  SyscallPolicy p (policy);
+
+  if (haveIdentity)
+    applyIdentity (p);
+
+  // Targets of reads rewritten by Sandbox::readFromWindow()
+  if (windowFD >= 0) {
+    p.allow (SCMP_SYS (pread64), {SCMP_A0 (SCMP_CMP_EQ, windowChildFD)});
+    p.allow (SCMP_SYS (preadv), {SCMP_A0 (SCMP_CMP_EQ, windowChildFD)});
+  }
+
+  // Run by SandboxPrivate::receiveFD()
+  if (handoffSocket[1] >= 0)
+    p.allow (SCMP_SYS (recvmsg), {SCMP_A0 (SCMP_CMP_EQ, handoffChildFD)});
+
+  return p.cachedBPF (trap);
+}
+
+/**
+ * Finds @p file the way execvp(3) would once @p envp is the environment
+ */
+static std::string
+resolve_program (const char* file, std::map<std::string, std::string>& envp)
+{
+  auto path = envp.find ("PATH");
+  std::string dirs = path != envp.end() ? path->second : "/bin:/usr/bin";
+
+  if (strchr (file, '/'))
+    return file;
+
+  for (size_t start = 0; start <= dirs.size();) {
+    size_t end = dirs.find (':', start);
+    if (end == std::string::npos)
+      end = dirs.size();
+    std::string dir = dirs.substr (start, end - start);
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + file;
+    if (access (candidate.c_str(), X_OK) == 0)
+      return candidate;
+    start = end + 1;
+  }
+
+  return file;
+}
+
+/**
+ * Starts the child with ::spawnVM(). Only used for Sandbox::Backend::Ptrace.
+ *
+ * @return PID of the child, or -1 if it has to be forked after all
+ */
+pid_t
+SandboxPrivate::spawnVM(char** argv, std::map<std::string, std::string>& envp)
+{
+  std::vector<std::string> env = child_environment (envp);
+  std::string path = resolve_program (argv[0], envp);
+  std::vector<char*> envStrings;
+  VMSpawnArgs args;
+
+  if (!filter)
+    return -1;
+
+  for (auto i = env.begin(); i != env.end(); i++)
+    envStrings.push_back (&(*i)[0]);
+  envStrings.push_back (nullptr);
+
+  args.path = path.c_str();
+  args.argv = argv;
+  args.envp = envStrings.data();
+
+  // Keeps stdin, like Sandbox::execChild()
+  args.keep.push_back (0);
+  args.fds = childFDs();
+  for (auto i = args.fds.cbegin(); i != args.fds.cend(); i++)
+    args.keep.push_back (i->second);
+
+  args.filter = filter.get();
+
+  return ::spawnVM (args);
+}
+
+Sandbox::SyscallHandler
+Sandbox::claimSyscall(int syscall, SyscallHandler handler)
+{
+  return claimSyscall (syscall, handler, nullptr);
+}
+
+Sandbox::SyscallHandler
+Sandbox::claimSyscall(int syscall, SyscallHandler handler, std::function<bool()> needsLoop)
+{
+  assert (syscall >= 0);
+
+  std::lock_guard<std::mutex> lock (m_p->handlersLock);
+
+  if (static_cast<size_t>(syscall) >= m_p->handlers.size())
+    m_p->handlers.resize (syscall + 1);
+
+  SyscallHandler previous = std::move (m_p->handlers[syscall].handler);
+  m_p->handlers[syscall].handler = handler;
+  m_p->handlers[syscall].needsLoop = needsLoop;
+  return previous;
+}
+
+Sandbox::HandlerStats
+Sandbox::getHandlerStats(int syscall) const
+{
+  std::lock_guard<std::mutex> lock (m_p->handlersLock);
 
-  uv_signal_start (&priv->signal, handle_trap, SIGCHLD);
-  ptrace (PTRACE_CONT, priv->pid, 0, 0);
+  if (syscall < 0 || static_cast<size_t>(syscall) >= m_p->handlers.size())
+    return HandlerStats();
+  return m_p->handlers[syscall].stats;
 }
 
 VFS&
@@ -0,0 +1,178 @@
+#include "scratch-arena.h"
+
+ScratchArena::ScratchArena()
+  : m_base (0),
+    m_size (0),
+    m_slotSize (0),
+    m_overflow {0, 0, 0, 0},
+    m_epoch (0)
+{
+}
+
+void
+ScratchArena::assign(Address base, size_t size, size_t slotSize)
+{
+  size_t count = slotSize ? (size / 2) / slotSize : 0;
+
+  m_base = base;
+  m_size = size;
+  m_slotSize = count ? slotSize : size;
+  m_slots.clear();
+  m_epoch++;
+
+  if (!base || !size) {
+    m_base = 0;
+    m_size = 0;
+    m_slotSize = 0;
+    m_overflow = Slot {0, 0, 0, 0};
+    return;
+  }
+
+  if (count == 0) {
+    m_slots.push_back (Slot {0, base, base + size, base});
+    m_overflow = Slot {0, base + size, base + size, base + size};
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Address start = base + i * slotSize;
+    m_slots.push_back (Slot {0, start, start + slotSize, start});
+  }
+
+  m_overflow = Slot {0, base + count * slotSize, base + size, base + count * slotSize};
+}
+
+ScratchArena::Address
+ScratchArena::base() const
+{
+  return m_base;
+}
+
+size_t
+ScratchArena::size() const
+{
+  return m_size;
+}
+
+size_t
+ScratchArena::slotSize() const
+{
+  return m_slotSize;
+}
+
+uint64_t
+ScratchArena::epoch() const
+{
+  return m_epoch;
+}
+
+/**
+ * Finds the slot of thread @p tid, or gives it a free one if @p create is set
+ */
+ScratchArena::Slot*
+ScratchArena::slotFor(pid_t tid, bool create)
+{
+  Slot* unused = nullptr;
+
+  // Too small to split, so shared by every thread
+  if (m_slots.size() == 1 && m_slots[0].end == m_base + m_size)
+    return &m_slots[0];
+
+  for (auto i = m_slots.begin(); i != m_slots.end(); i++) {
+    if (i->tid == tid)
+      return &*i;
+    if (i->tid == 0 && !unused)
+      unused = &*i;
+  }
+
+  if (create && unused) {
+    unused->tid = tid;
+    unused->next = unused->start;
+    return unused;
+  }
+
+  return nullptr;
+}
+
+/**
+ * Carves @p length bytes off the front of the unused part of @p slot
+ *
+ * @return Address of the allocation, or 0 if it doesn't fit
+ */
+ScratchArena::Address
+ScratchArena::take(Slot& slot, size_t length)
+{
+  Address start = slot.next;
+
+  // Round up to nearest word boundary
+  if (start % sizeof (Address) != 0)
+    start += sizeof (Address) - start % sizeof (Address);
+
+  if (start > slot.end || length > slot.end - start)
+    return 0;
+
+  slot.next = start + length;
+  return start;
+}
+
+ScratchArena::Address
+ScratchArena::allocate(pid_t tid, size_t length)
+{
+  Slot* slot = slotFor (tid, true);
+  Address addr;
+
+  if (slot && (addr = take (*slot, length)))
+    return addr;
+
+  if (m_overflow.tid != 0 && m_overflow.tid != tid)
+    return 0;
+
+  addr = take (m_overflow, length);
+  if (addr)
+    m_overflow.tid = tid;
+  return addr;
+}
+
+void
+ScratchArena::release(pid_t tid, Address addr, size_t length, uint64_t epoch)
+{
+  Slot* slot = slotFor (tid, false);
+
+  if (epoch != m_epoch || !addr)
+    return;
+
+  if (slot && addr >= slot->start && addr + length == slot->next) {
+    slot->next = addr;
+  } else if (m_overflow.tid == tid && addr >= m_overflow.start && addr + length == m_overflow.next) {
+    // Still owned until the next rewind(), as the syscall the memory was
+    // leased for may not have run yet
+    m_overflow.next = addr;
+  }
+}
+
+void
+ScratchArena::rewind(pid_t tid)
+{
+  Slot* slot = slotFor (tid, false);
+
+  m_epoch++;
+
+  if (slot)
+    slot->next = slot->start;
+
+  if (m_overflow.tid == tid) {
+    m_overflow.tid = 0;
+    m_overflow.next = m_overflow.start;
+  }
+}
+
+void
+ScratchArena::forget(pid_t tid)
+{
+  Slot* slot = slotFor (tid, false);
+
+  rewind (tid);
+
+  if (slot)
+    slot->tid = 0;
+}
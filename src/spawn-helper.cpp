@@ -0,0 +1,221 @@
+/**
+ * codius-spawn-helper: forks warm children for a SpawnPool, so that the
+ * process running the sandboxes never has to. See spawn-helper.h for the
+ * protocol.
+ */
+#include "spawn-helper.h"
+#include "spawn-vm.h"
+#include "fd-util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <vector>
+
+#ifndef PR_SET_PTRACER
+#define PR_SET_PTRACER 0x59616d61
+#endif
+
+static bool
+read_all (int fd, void* buf, size_t length)
+{
+  char* p = static_cast<char*>(buf);
+
+  while (length > 0) {
+    ssize_t ret = read (fd, p, length);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    p += ret;
+    length -= ret;
+  }
+
+  return true;
+}
+
+/**
+ * Runs in a warm child, which already holds the sandbox's filter. Waits to
+ * be seized and given a payload, then becomes the sandboxed program.
+ */
+static void __attribute__ ((noreturn))
+run_warm_child (int control, const std::vector<struct sock_filter>& filter)
+{
+  SpawnPayload payload;
+  char cmsgBuf[CMSG_SPACE (sizeof (int) * spawnMaxFDs)];
+  struct iovec iov = {&payload, sizeof (payload)};
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  std::vector<int> received;
+  std::vector<char> strings;
+  std::vector<char*> argv;
+  std::vector<char*> envp;
+  ssize_t ret;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = sizeof (cmsgBuf);
+
+  do {
+    ret = recvmsg (control, &msg, MSG_WAITALL);
+  } while (ret < 0 && errno == EINTR);
+
+  // The pool went away before using us
+  if (ret == 0)
+    _exit (EXIT_SUCCESS);
+
+  if (ret != sizeof (payload) || payload.fdCount > spawnMaxFDs)
+    error (EXIT_FAILURE, errno, "Could not receive spawn payload");
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      int* fds = reinterpret_cast<int*>(CMSG_DATA (cmsg));
+      received.insert (received.end(), fds, fds + count);
+    }
+  }
+
+  strings.resize (payload.stringLength);
+
+  if (received.size() != payload.fdCount ||
+      !read_all (control, strings.data(), strings.size()))
+    error (EXIT_FAILURE, errno, "Could not receive spawn payload");
+
+  // The received descriptors may sit where others need to go, so move them
+  // all out of the way first
+  for (size_t i = 0; i < received.size(); i++) {
+    int moved = fcntl (received[i], F_DUPFD, control + 1);
+    close (received[i]);
+    received[i] = moved;
+  }
+
+  for (size_t i = 0; i < received.size(); i++) {
+    if (dup2 (received[i], payload.dupAs[i]) != payload.dupAs[i])
+      error (EXIT_FAILURE, errno, "Could not bind IPC channel across #%d", payload.dupAs[i]);
+    close (received[i]);
+  }
+
+  for (size_t i = 0, start = 0; i < strings.size(); i++) {
+    if (strings[i] == 0) {
+      if (argv.size() < payload.argc)
+        argv.push_back (&strings[start]);
+      else
+        envp.push_back (&strings[start]);
+      start = i + 1;
+    }
+  }
+
+  if (argv.size() != payload.argc || envp.size() != payload.envc || argv.empty())
+    error (EXIT_FAILURE, 0, "Malformed spawn payload");
+
+  argv.push_back (nullptr);
+  envp.push_back (nullptr);
+
+  // Receiving descriptors is more than a sandbox may do, so this waits
+  // until the payload is in. We are seized by now, so nothing the filter
+  // traps until exec goes unanswered.
+  if (installFilter (filter, 0) < 0)
+    error (EXIT_FAILURE, errno, "Could not lock down sandbox");
+
+  environ = envp.data();
+
+  if (execvp (argv[0], argv.data()) < 0) {
+    error (EXIT_FAILURE, errno, "Could not start sandboxed module");
+  }
+  __builtin_unreachable();
+}
+
+/**
+ * Forks one warm child and hands the pool its control socket
+ *
+ * @return false if the pool is gone
+ */
+static bool
+fork_warm_child (const std::vector<struct sock_filter>& filter, pid_t tracer)
+{
+  char cmsgBuf[CMSG_SPACE (sizeof (int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  int sockets[2];
+  pid_t pid;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+    error (EXIT_FAILURE, errno, "Could not create warm child channel");
+
+  pid = fork();
+
+  if (pid == 0) {
+    signal (SIGCHLD, SIG_DFL);
+    if (dup3 (sockets[1], warmControlFD, O_CLOEXEC) != warmControlFD)
+      _exit (EXIT_FAILURE);
+    closeInheritedFDs (std::vector<int> {warmControlFD});
+    setpgid (0, 0);
+
+    // Lets the sandbox seize us even under Yama's restricted ptrace scope.
+    // Fails harmlessly where Yama isn't there.
+    prctl (PR_SET_PTRACER, tracer);
+
+    prctl (PR_SET_NO_NEW_PRIVS, 1);
+    run_warm_child (warmControlFD, filter);
+  }
+
+  close (sockets[1]);
+
+  // The pool finds out a fork failed from the control socket hanging up
+  if (pid < 0)
+    pid = 0;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof (pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = sizeof (cmsgBuf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &sockets[0], sizeof (int));
+
+  bool sent = sendmsg (spawnHelperFD, &msg, MSG_NOSIGNAL) == sizeof (pid);
+  close (sockets[0]);
+  return sent;
+}
+
+int
+main (int argc, char** argv)
+{
+  std::vector<struct sock_filter> filter;
+  uint32_t length;
+  pid_t tracer = getppid();
+  char request;
+
+  // Warm children are reaped by the kernel once their tracer is done with
+  // them
+  signal (SIGCHLD, SIG_IGN);
+
+  if (!read_all (spawnHelperFD, &length, sizeof (length)))
+    return EXIT_FAILURE;
+
+  filter.resize (length);
+  if (!read_all (spawnHelperFD, filter.data(), filter.size() * sizeof (struct sock_filter)))
+    return EXIT_FAILURE;
+
+  while (read_all (spawnHelperFD, &request, sizeof (request))) {
+    if (!fork_warm_child (filter, tracer))
+      break;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+#include "spawn-pool.h"
+#include "spawn-vm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static bool
+write_all (int fd, const void* buf, size_t length, int flags = 0)
+{
+  const char* p = static_cast<const char*>(buf);
+
+  while (length > 0) {
+    ssize_t ret = send (fd, p, length, MSG_NOSIGNAL | flags);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    p += ret;
+    length -= ret;
+  }
+
+  return true;
+}
+
+SpawnPool::SpawnPool(size_t size, const std::string& helper)
+  : m_size (size),
+    m_helperPath (helper),
+    m_helper (-1),
+    m_helperSocket (-1),
+    m_helperWatch (nullptr),
+    m_pending (0),
+    m_lost (0)
+{}
+
+static void
+free_watch (uv_handle_t* handle)
+{
+  delete reinterpret_cast<uv_poll_t*>(handle);
+}
+
+SpawnPool::~SpawnPool()
+{
+  // Warm children exit once their control socket is closed, and are reaped
+  // by the helper
+  for (auto i = m_children.cbegin(); i != m_children.cend(); i++) {
+    unwatch (*i);
+    close (i->control);
+  }
+
+  stopHelper();
+}
+
+size_t
+SpawnPool::available() const
+{
+  return m_children.size();
+}
+
+/**
+ * Starts codius-spawn-helper, hands it @p filter and asks it for a full pool
+ *
+ * @return false if the helper could not be started
+ */
+bool
+SpawnPool::startHelper(const SyscallPolicy::Program& filter)
+{
+  std::vector<char*> argv {const_cast<char*>(m_helperPath.c_str()), nullptr};
+  uint32_t length = filter->size();
+  VMSpawnArgs args;
+  int sockets[2];
+
+  m_filter = filter;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+    return false;
+
+  args.path = m_helperPath.c_str();
+  args.argv = argv.data();
+  args.envp = environ;
+  args.fds.push_back (std::make_pair (sockets[1], spawnHelperFD));
+  args.keep = {STDERR_FILENO, spawnHelperFD};
+  args.filter = nullptr;
+
+  m_helper = spawnVM (args);
+  close (sockets[1]);
+
+  if (m_helper < 0 ||
+      !write_all (sockets[0], &length, sizeof (length)) ||
+      !write_all (sockets[0], filter->data(), filter->size() * sizeof (struct sock_filter))) {
+    close (sockets[0]);
+    if (m_helper > 0)
+      waitpid (m_helper, nullptr, 0);
+    m_helper = -1;
+    return false;
+  }
+
+  fcntl (sockets[0], F_SETFL, fcntl (sockets[0], F_GETFL) | O_NONBLOCK);
+  m_helperSocket = sockets[0];
+  m_helperWatch = new uv_poll_t;
+  m_helperWatch->data = this;
+  uv_poll_init_socket (uv_default_loop(), m_helperWatch, m_helperSocket);
+  uv_poll_start (m_helperWatch, UV_READABLE, SpawnPool::helperReply);
+
+  topUp();
+  return true;
+}
+
+/**
+ * Closes our end of the helper's socket, which makes it exit, and reaps it
+ */
+void
+SpawnPool::stopHelper()
+{
+  if (m_helperSocket < 0)
+    return;
+
+  uv_poll_stop (m_helperWatch);
+  uv_close (reinterpret_cast<uv_handle_t*>(m_helperWatch), free_watch);
+  m_helperWatch = nullptr;
+  close (m_helperSocket);
+  m_helperSocket = -1;
+  waitpid (m_helper, nullptr, 0);
+  m_helper = -1;
+  m_pending = 0;
+}
+
+/**
+ * Asks the helper for as many warm children as the pool is short of. The
+ * helper forks them on its own time, so this never blocks.
+ */
+void
+SpawnPool::topUp()
+{
+  char request = 0;
+
+  while (m_helperSocket >= 0 && m_lost <= m_size &&
+         m_children.size() + m_pending < m_size &&
+         write_all (m_helperSocket, &request, sizeof (request), MSG_DONTWAIT))
+    m_pending++;
+}
+
+/**
+ * Takes a warm child from the helper
+ */
+void
+SpawnPool::helperReply(uv_poll_t* handle, int status, int events)
+{
+  SpawnPool* self = static_cast<SpawnPool*>(handle->data);
+  char cmsgBuf[CMSG_SPACE (sizeof (int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  Child child;
+  ssize_t ret;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &child.pid;
+  iov.iov_len = sizeof (child.pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = sizeof (cmsgBuf);
+
+  do {
+    ret = recvmsg (self->m_helperSocket, &msg, MSG_CMSG_CLOEXEC);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && errno == EAGAIN)
+    return;
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (ret != sizeof (child.pid) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    // The helper died, so the pool stays empty from now on
+    self->stopHelper();
+    return;
+  }
+
+  memcpy (&child.control, CMSG_DATA (cmsg), sizeof (int));
+  self->m_pending--;
+
+  if (child.pid <= 0) {
+    close (child.control);
+    self->m_lost++;
+    self->topUp();
+    return;
+  }
+
+  // The child never writes to its end, so anything it has to say means it
+  // died
+  child.watch = new uv_poll_t;
+  child.watch->data = self;
+  uv_poll_init_socket (uv_default_loop(), child.watch, child.control);
+  uv_poll_start (child.watch, UV_READABLE, SpawnPool::childGone);
+  self->m_children.push_back (child);
+}
+
+/**
+ * Stops watching a warm child's control socket, before it is closed
+ */
+void
+SpawnPool::unwatch(const Child& child)
+{
+  uv_poll_stop (child.watch);
+  uv_close (reinterpret_cast<uv_handle_t*>(child.watch), free_watch);
+}
+
+/**
+ * Replaces a warm child that died while it was waiting in the pool, unless
+ * they keep dying
+ */
+void
+SpawnPool::childGone(uv_poll_t* handle, int status, int events)
+{
+  SpawnPool* self = static_cast<SpawnPool*>(handle->data);
+
+  for (auto i = self->m_children.begin(); i != self->m_children.end(); i++) {
+    if (i->watch == handle) {
+      Child child = *i;
+      self->m_children.erase (i);
+      self->discard (child, false);
+      self->m_lost++;
+      self->topUp();
+      return;
+    }
+  }
+}
+
+/**
+ * Gets rid of a warm child that could not be used. The helper reaps it,
+ * unless we have seized it already.
+ */
+void
+SpawnPool::discard(const Child& child, bool seized)
+{
+  int status;
+
+  unwatch (child);
+  close (child.control);
+  ::kill (child.pid, SIGKILL);
+
+  while (seized && waitpid (child.pid, &status, __WALL) == child.pid &&
+         !WIFEXITED (status) && !WIFSIGNALED (status))
+    ptrace (PTRACE_CONT, child.pid, 0, 0);
+}
+
+pid_t
+SpawnPool::spawn(char** argv, const std::vector<std::string>& envp,
+                 const std::vector<std::pair<int, int> >& fds,
+                 const SyscallPolicy::Program& filter, long options)
+{
+  SpawnPayload payload;
+  std::vector<char> strings;
+  char cmsgBuf[CMSG_SPACE (sizeof (int) * maxFDs)];
+  struct iovec iov = {&payload, sizeof (payload)};
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+
+  if (!m_filter && filter) {
+    startHelper (filter);
+    return -1;
+  }
+
+  if (filter != m_filter || fds.size() > maxFDs)
+    return -1;
+
+  memset (&payload, 0, sizeof (payload));
+  payload.fdCount = fds.size();
+
+  for (payload.argc = 0; argv[payload.argc]; payload.argc++)
+    strings.insert (strings.end(), argv[payload.argc], argv[payload.argc] + strlen (argv[payload.argc]) + 1);
+
+  for (auto i = envp.cbegin(); i != envp.cend(); i++)
+    strings.insert (strings.end(), i->c_str(), i->c_str() + i->size() + 1);
+  payload.envc = envp.size();
+  payload.stringLength = strings.size();
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (!fds.empty()) {
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = CMSG_SPACE (sizeof (int) * fds.size());
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int) * fds.size());
+    for (size_t i = 0; i < fds.size(); i++) {
+      reinterpret_cast<int*>(CMSG_DATA (cmsg))[i] = fds[i].first;
+      payload.dupAs[i] = fds[i].second;
+    }
+  }
+
+  while (!m_children.empty()) {
+    Child child = m_children.front();
+    m_children.pop_front();
+    topUp();
+
+    // Most likely killed while it sat in the pool
+    if (ptrace (PTRACE_SEIZE, child.pid, 0, options) < 0) {
+      discard (child, false);
+      continue;
+    }
+
+    if (sendmsg (child.control, &msg, MSG_NOSIGNAL) != sizeof (payload) ||
+        !write_all (child.control, strings.data(), strings.size())) {
+      discard (child, true);
+      continue;
+    }
+
+    m_lost = 0;
+    unwatch (child);
+    close (child.control);
+    return child.pid;
+  }
+
+  return -1;
+}
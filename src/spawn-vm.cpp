@@ -0,0 +1,90 @@
+#include "spawn-vm.h"
+#include "fd-util.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+
+int
+installFilter(const std::vector<struct sock_filter>& filter, unsigned int flags)
+{
+  struct sock_fprog prog;
+
+  prog.len = filter.size();
+  prog.filter = const_cast<struct sock_filter*>(filter.data());
+
+  return syscall (__NR_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+}
+
+static void
+vm_child_fail (const char* msg)
+{
+  if (write (STDERR_FILENO, msg, strlen (msg)) < 0) {}
+  _exit (127);
+}
+
+/**
+ * Runs in a child started by spawnVM(), on its own stack but in its parent's
+ * memory, while the parent waits for it to exec.
+ */
+static int
+vm_child_main (void* data)
+{
+  VMSpawnArgs* args = static_cast<VMSpawnArgs*>(data);
+
+  // Handlers belong to the parent and would run against its state
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction sa;
+    if (sigaction (sig, nullptr, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+      sa.sa_handler = SIG_DFL;
+      sa.sa_flags = 0;
+      sigaction (sig, &sa, nullptr);
+    }
+  }
+
+  for (auto i = args->fds.cbegin(); i != args->fds.cend(); i++) {
+    if (dup2 (i->first, i->second) != i->second)
+      vm_child_fail ("Could not bind IPC channel\n");
+  }
+
+  closeInheritedFDs (args->keep, true);
+
+  if (args->filter) {
+    setpgid (0, 0);
+
+    // Stopped by the SIGTRAP that follows exec, before any of its code runs
+    ptrace (PTRACE_TRACEME, 0, 0);
+
+    prctl (PR_SET_NO_NEW_PRIVS, 1);
+    if (installFilter (*args->filter, 0) < 0)
+      vm_child_fail ("Could not lock down sandbox\n");
+  }
+
+  sigprocmask (SIG_SETMASK, &args->mask, nullptr);
+
+  execve (args->path, args->argv, args->envp);
+  vm_child_fail ("Could not start sandboxed module\n");
+  return 127;
+}
+
+pid_t
+spawnVM(VMSpawnArgs& args)
+{
+  static const size_t stackSize = 64 * 1024;
+  std::vector<char> stack (stackSize);
+  sigset_t all;
+  pid_t child;
+
+  // No handler may run in the child while it shares our memory
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &args.mask);
+  child = clone (vm_child_main, stack.data() + stack.size(),
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+  pthread_sigmask (SIG_SETMASK, &args.mask, nullptr);
+
+  return child;
+}
@@ -0,0 +1,376 @@
+#include "syscall-policy.h"
+#include "vfs.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+
+// SCMP_FLTATR_CTL_OPTIMIZE first appeared in libseccomp 2.5
+#if defined(SCMP_VER_MAJOR) && (SCMP_VER_MAJOR > 2 || (SCMP_VER_MAJOR == 2 && SCMP_VER_MINOR >= 5))
+#define HAVE_SCMP_OPTIMIZE
+#endif
+
+void
+SyscallPolicy::add(int syscall, Action action, int errnum, std::initializer_list<Condition> conditions)
+{
+  Rule rule = {syscall, action, errnum, std::vector<Condition> (conditions)};
+  m_rules.push_back (rule);
+}
+
+void
+SyscallPolicy::kill(int syscall)
+{
+  add (syscall, Action::Kill, 0, {});
+}
+
+void
+SyscallPolicy::allow(int syscall, std::initializer_list<Condition> conditions)
+{
+  add (syscall, Action::Allow, 0, conditions);
+}
+
+void
+SyscallPolicy::trap(int syscall, std::initializer_list<Condition> conditions)
+{
+  add (syscall, Action::Trap, 0, conditions);
+}
+
+void
+SyscallPolicy::fail(int syscall, int errnum, std::initializer_list<Condition> conditions)
+{
+  add (syscall, Action::Errno, errnum, conditions);
+}
+
+void
+SyscallPolicy::remove(int syscall)
+{
+  m_rules.erase (std::remove_if (m_rules.begin(), m_rules.end(),
+        [syscall](const Rule& r) { return r.syscall == syscall; }),
+      m_rules.end());
+}
+
+const std::vector<SyscallPolicy::Rule>&
+SyscallPolicy::rules() const
+{
+  return m_rules;
+}
+
+void
+SyscallPolicy::setPriority(int syscall, uint8_t priority)
+{
+  m_priorities[syscall] = priority;
+}
+
+void
+SyscallPolicy::setLayout(Layout layout)
+{
+  m_layout = layout;
+}
+
+SyscallPolicy::Layout
+SyscallPolicy::getLayout() const
+{
+  return m_layout;
+}
+
+scmp_filter_ctx
+SyscallPolicy::compile(uint32_t trapAction) const
+{
+  scmp_filter_ctx ctx = seccomp_init (SCMP_ACT_KILL);
+
+  if (!ctx)
+    return nullptr;
+
+#ifdef HAVE_SCMP_OPTIMIZE
+  // Priorities are ignored by the binary tree. An older libseccomp.so
+  // rejects the attribute and we stay linear.
+  if (m_layout == Layout::BinaryTree)
+    seccomp_attr_set (ctx, SCMP_FLTATR_CTL_OPTIMIZE, 2);
+#endif // HAVE_SCMP_OPTIMIZE
+
+  for (auto i = m_priorities.cbegin(); i != m_priorities.cend(); i++)
+    seccomp_syscall_priority (ctx, i->first, i->second);
+
+  for (auto i = m_rules.cbegin(); i != m_rules.cend(); i++) {
+    uint32_t action = SCMP_ACT_KILL;
+
+    switch (i->action) {
+      case Action::Kill:
+        // Already the default action, which libseccomp refuses as a rule
+        continue;
+      case Action::Allow:
+        action = SCMP_ACT_ALLOW;
+        break;
+      case Action::Trap:
+        action = trapAction;
+        break;
+      case Action::Errno:
+        action = SCMP_ACT_ERRNO (i->errnum);
+        break;
+    }
+
+    if (seccomp_rule_add_array (ctx, action, i->syscall, i->conditions.size(), i->conditions.data()) < 0) {
+      seccomp_release (ctx);
+      return nullptr;
+    }
+  }
+
+  return ctx;
+}
+
+std::vector<struct sock_filter>
+SyscallPolicy::exportBPF(uint32_t trapAction) const
+{
+  std::vector<struct sock_filter> program;
+  scmp_filter_ctx ctx = compile (trapAction);
+  FILE* out;
+
+  if (!ctx)
+    return program;
+
+  out = tmpfile();
+
+  if (out && seccomp_export_bpf (ctx, fileno (out)) == 0) {
+    off_t size = lseek (fileno (out), 0, SEEK_END);
+
+    if (size > 0) {
+      program.resize (size / sizeof (struct sock_filter));
+      if (pread (fileno (out), program.data(), size, 0) != size)
+        program.clear();
+    }
+  }
+
+  if (out)
+    fclose (out);
+  seccomp_release (ctx);
+
+  return program;
+}
+
+/**
+ * Returns a string that only another policy compiling to the same filter
+ * has
+ */
+std::string
+SyscallPolicy::cacheKey(uint32_t trapAction) const
+{
+  std::string key;
+  auto append = [&key](const void* data, size_t length) {
+    key.append (static_cast<const char*>(data), length);
+  };
+
+  size_t priorities = m_priorities.size();
+
+  append (&trapAction, sizeof (trapAction));
+  append (&m_layout, sizeof (m_layout));
+  append (&priorities, sizeof (priorities));
+
+  for (auto i = m_priorities.cbegin(); i != m_priorities.cend(); i++) {
+    append (&i->first, sizeof (i->first));
+    append (&i->second, sizeof (i->second));
+  }
+
+  for (auto i = m_rules.cbegin(); i != m_rules.cend(); i++) {
+    size_t count = i->conditions.size();
+    append (&i->syscall, sizeof (i->syscall));
+    append (&i->action, sizeof (i->action));
+    append (&i->errnum, sizeof (i->errnum));
+    append (&count, sizeof (count));
+    for (auto j = i->conditions.cbegin(); j != i->conditions.cend(); j++) {
+      append (&j->arg, sizeof (j->arg));
+      append (&j->op, sizeof (j->op));
+      append (&j->datum_a, sizeof (j->datum_a));
+      append (&j->datum_b, sizeof (j->datum_b));
+    }
+  }
+
+  return key;
+}
+
+SyscallPolicy::Program
+SyscallPolicy::cachedBPF(uint32_t trapAction) const
+{
+  static std::mutex lock;
+  static std::map<std::string, Program> cache;
+  std::string key = cacheKey (trapAction);
+
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    auto found = cache.find (key);
+    if (found != cache.end())
+      return found->second;
+  }
+
+  // Compiled without the lock held. Two threads racing on a new policy both
+  // compile it, and the first to finish wins.
+  std::vector<struct sock_filter> program = exportBPF (trapAction);
+
+  if (program.empty())
+    return nullptr;
+
+  std::lock_guard<std::mutex> guard (lock);
+  auto inserted = cache.insert (std::make_pair (key, std::make_shared<const std::vector<struct sock_filter> > (std::move (program))));
+  return inserted.first->second;
+}
+
+SyscallPolicy
+SyscallPolicy::defaultPolicy()
+{
+  SyscallPolicy p;
+
+  // A duplicate in case the seccomp_init() call is accidentally modified
+  p.kill (SCMP_SYS (ptrace));
+
+  // This is actually caught via PTRACE_EVENT_EXEC
+  p.allow (SCMP_SYS (execve));
+  p.allow (SCMP_SYS (clone));
+
+  // Used to track chdir calls
+  p.trap (SCMP_SYS (chdir));
+  p.trap (SCMP_SYS (fchdir));
+
+  // These interact with the VFS layer
+  p.trap (SCMP_SYS (open));
+  p.trap (SCMP_SYS (access));
+  p.trap (SCMP_SYS (openat));
+  p.trap (SCMP_SYS (stat));
+  p.trap (SCMP_SYS (lstat));
+  p.trap (SCMP_SYS (getcwd));
+  p.trap (SCMP_SYS (readlink));
+
+  // These only need the VFS when used on a virtual file descriptor
+#define VFS_FILTER(x) p.trap (SCMP_SYS (x), {SCMP_A0 (SCMP_CMP_GE, VFS::firstVirtualFD)}); \
+                      p.allow (SCMP_SYS (x), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD)});
+  VFS_FILTER (read);
+  VFS_FILTER (close);
+  VFS_FILTER (ioctl);
+  VFS_FILTER (fstat);
+  VFS_FILTER (lseek);
+  VFS_FILTER (write);
+  VFS_FILTER (getdents);
+#ifdef __NR_readdir
+  VFS_FILTER (readdir);
+#endif // __NR_readdir
+  VFS_FILTER (getdents64);
+  VFS_FILTER (readv);
+  VFS_FILTER (writev);
+
+#undef VFS_FILTER
+
+  // Mapping a virtual file descriptor is done by the VFS. Anonymous mappings
+  // ignore the descriptor, which is usually -1 and so compares as huge.
+  p.trap (SCMP_SYS (mmap), {SCMP_A3 (SCMP_CMP_MASKED_EQ, MAP_ANONYMOUS, 0),
+                            SCMP_A4 (SCMP_CMP_GE, VFS::firstVirtualFD)});
+  p.allow (SCMP_SYS (mmap), {SCMP_A3 (SCMP_CMP_MASKED_EQ, MAP_ANONYMOUS, MAP_ANONYMOUS)});
+  p.allow (SCMP_SYS (mmap), {SCMP_A4 (SCMP_CMP_LT, VFS::firstVirtualFD)});
+
+  // Flag manipulation on a real file descriptor is harmless. Everything else,
+  // such as F_DUPFD, needs its arguments sanitized. F_GETFD through F_SETFL
+  // are numbered 1 to 4, so the rules below cover every command exactly once.
+  p.allow (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_EQ, F_GETFD)});
+  p.allow (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_EQ, F_SETFD)});
+  p.allow (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_EQ, F_GETFL)});
+  p.allow (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_EQ, F_SETFL)});
+  p.trap (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_GE, VFS::firstVirtualFD)});
+  p.trap (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_LT, F_GETFD)});
+  p.trap (SCMP_SYS (fcntl), {SCMP_A0 (SCMP_CMP_LT, VFS::firstVirtualFD), SCMP_A1 (SCMP_CMP_GT, F_SETFL)});
+
+  // These are traced to implement socket remapping
+  p.trap (SCMP_SYS (socket));
+  p.trap (SCMP_SYS (connect));
+  p.trap (SCMP_SYS (bind));
+  p.trap (SCMP_SYS (setsockopt));
+  p.trap (SCMP_SYS (getsockname));
+  p.trap (SCMP_SYS (getpeername));
+  p.trap (SCMP_SYS (getsockopt));
+
+  // These need their return values faked in some way
+  p.trap (SCMP_SYS (uname));
+  p.trap (SCMP_SYS (getrlimit));
+  p.trap (SCMP_SYS (getuid));
+  p.trap (SCMP_SYS (getgid));
+  p.trap (SCMP_SYS (geteuid));
+  p.trap (SCMP_SYS (getegid));
+  p.trap (SCMP_SYS (getppid));
+  p.trap (SCMP_SYS (getpgrp));
+  p.trap (SCMP_SYS (getgroups));
+  p.trap (SCMP_SYS (getresuid));
+  p.trap (SCMP_SYS (getresgid));
+  p.trap (SCMP_SYS (capget));
+  p.trap (SCMP_SYS (gettid));
+
+  // All of these are allowed because they either:
+  // * Can't cause any harm outside the sandbox
+  // * Require some file descriptor from a previously-sanitized call to i.e.
+  // open()
+  p.allow (SCMP_SYS (fsync));
+  p.allow (SCMP_SYS (fdatasync));
+  p.allow (SCMP_SYS (sync));
+  p.allow (SCMP_SYS (poll));
+  p.allow (SCMP_SYS (mprotect));
+  p.allow (SCMP_SYS (munmap));
+  p.allow (SCMP_SYS (madvise));
+  p.allow (SCMP_SYS (brk));
+  p.allow (SCMP_SYS (rt_sigaction));
+  p.allow (SCMP_SYS (rt_sigprocmask));
+  p.allow (SCMP_SYS (select));
+  p.allow (SCMP_SYS (sched_yield));
+  p.allow (SCMP_SYS (getpid));
+  p.allow (SCMP_SYS (accept));
+  p.allow (SCMP_SYS (listen));
+  p.allow (SCMP_SYS (exit));
+  p.allow (SCMP_SYS (gettimeofday));
+  p.allow (SCMP_SYS (tkill));
+  p.allow (SCMP_SYS (epoll_create));
+  p.allow (SCMP_SYS (restart_syscall));
+  p.allow (SCMP_SYS (clock_gettime));
+  p.allow (SCMP_SYS (clock_getres));
+  p.allow (SCMP_SYS (clock_nanosleep));
+  p.allow (SCMP_SYS (ioctl));
+  p.allow (SCMP_SYS (nanosleep));
+  p.allow (SCMP_SYS (exit_group));
+  p.allow (SCMP_SYS (epoll_wait));
+  p.allow (SCMP_SYS (epoll_ctl));
+  p.allow (SCMP_SYS (tgkill));
+  p.allow (SCMP_SYS (pselect6));
+  p.allow (SCMP_SYS (ppoll));
+  p.allow (SCMP_SYS (arch_prctl));
+  p.allow (SCMP_SYS (prctl));
+  p.allow (SCMP_SYS (set_robust_list));
+  p.allow (SCMP_SYS (get_robust_list));
+  p.allow (SCMP_SYS (epoll_pwait));
+  p.allow (SCMP_SYS (accept4));
+  p.allow (SCMP_SYS (eventfd2));
+  p.allow (SCMP_SYS (epoll_create1));
+  p.allow (SCMP_SYS (pipe2));
+  p.allow (SCMP_SYS (futex));
+  p.allow (SCMP_SYS (set_tid_address));
+  p.allow (SCMP_SYS (set_thread_area));
+
+  // Most frequent syscalls of a node.js contract first, for when the filter
+  // is laid out linearly
+  const int hot[] = {
+    SCMP_SYS (futex),
+    SCMP_SYS (epoll_wait),
+    SCMP_SYS (read),
+    SCMP_SYS (write),
+    SCMP_SYS (clock_gettime),
+    SCMP_SYS (epoll_ctl),
+    SCMP_SYS (mmap),
+    SCMP_SYS (munmap),
+    SCMP_SYS (mprotect),
+    SCMP_SYS (madvise),
+    SCMP_SYS (brk),
+    SCMP_SYS (close),
+    SCMP_SYS (fstat),
+    SCMP_SYS (rt_sigprocmask)
+  };
+
+  for (size_t i = 0; i < sizeof (hot) / sizeof (hot[0]); i++)
+    p.setPriority (hot[i], 255 - i);
+
+  return p;
+}
@@ -2,21 +2,33 @@
 #include <dirent.h>
 #include <memory.h>
 #include <iostream>
+#include <algorithm>
+#include <functional>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <cassert>
 #include <error.h>
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <asm-generic/posix_types.h>
 #include "dirent-builder.h"
 
 VFS::VFS(Sandbox* sandbox)
-  : m_sbox (sandbox)
+  : m_sbox (sandbox),
+    m_resolver (m_mountpoints),
+    m_delegate (false),
+    m_needsLoop (false),
+    m_fileStats (),
+    m_requestsPending (false),
+    m_flushRequested (false),
+    m_ttlRequested (false)
 {
   m_whitelist.push_back ("/lib64/tls/x86_64/libc.so.6");
   m_whitelist.push_back ("/lib64/tls/x86_64/libdl.so.2");
@@ -50,27 +62,164 @@ VFS::VFS(Sandbox* sandbox)
 void
 VFS::mountFilesystem(const std::string& path, std::shared_ptr<Filesystem> fs)
 {
-  m_mountpoints.insert (std::make_pair (path, fs));
+  m_mountpoints.mount (path, fs);
+  m_resolver.clear();
+  if (fs->needsLoop())
+    m_needsLoop = true;
+}
+
+bool
+VFS::needsLoop() const
+{
+  return m_needsLoop;
+}
+
+int
+VFS::resolvePath(const std::string& path, const std::string& base, bool followLast,
+                 bool create, std::string& resolved,
+                 const PathResolver::Dentry** dentry)
+{
+  bool missing;
+  int ret;
+
+  applyCacheRequests();
+  ret = m_resolver.resolve (path, base, followLast, resolved, missing, dentry);
+
+  if (ret == 0 && missing && !create)
+    return -ENOENT;
+  return ret;
+}
+
+void
+VFS::flushCache()
+{
+  std::lock_guard<std::mutex> lock (m_requestLock);
+  m_flushRequested = true;
+  m_requestsPending = true;
+}
+
+void
+VFS::setNegativeCacheTTL(std::chrono::milliseconds ttl)
+{
+  std::lock_guard<std::mutex> lock (m_requestLock);
+  m_ttlRequested = true;
+  m_requestedTTL = ttl;
+  m_requestsPending = true;
+}
+
+/**
+ * Runs what flushCache() and setNegativeCacheTTL() asked for. Called by the
+ * handlers before they touch the cache, so it never changes under them.
+ */
+void
+VFS::applyCacheRequests()
+{
+  bool flush;
+  bool setTTL;
+  std::chrono::milliseconds ttl;
+
+  if (!m_requestsPending)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock (m_requestLock);
+    flush = m_flushRequested;
+    setTTL = m_ttlRequested;
+    ttl = m_requestedTTL;
+    m_flushRequested = m_ttlRequested = false;
+    m_requestsPending = false;
+  }
+
+  if (setTTL)
+    m_resolver.setNegativeTTL (ttl);
+
+  if (flush) {
+    m_resolver.newGeneration();
+    for (auto i = m_files.cbegin(); i != m_files.cend(); i++) {
+      if (*i)
+        (*i)->invalidateAttributes();
+    }
+  }
+}
+
+VFS::CacheStats
+VFS::cacheStats() const
+{
+  CacheStats stats = {m_resolver.hits() + m_fileStats.hits,
+                      m_resolver.misses() + m_fileStats.misses};
+  return stats;
+}
+
+/**
+ * Drops the cached attributes of @p path and of every file open on it, after
+ * it was changed
+ */
+void
+VFS::attributesChanged(const std::string& path)
+{
+  auto open = m_openPaths.find (path);
+
+  m_resolver.invalidate (path);
+  if (open != m_openPaths.end()) {
+    for (auto i = open->second.cbegin(); i != open->second.cend(); i++)
+      m_files[*i - firstVirtualFD]->invalidateAttributes();
+  }
+}
+
+/**
+ * Most bytes one call moves through a buffer of ours. Longer reads and writes
+ * come back short, as they do from the kernel past MAX_RW_COUNT.
+ */
+static const size_t max_transfer = 1024 * 1024;
+
+/**
+ * Adds up the lengths in @p iov, which are the child's to choose
+ *
+ * @return The total, or -EINVAL if it overflows a ssize_t as readv() says
+ */
+static ssize_t
+iov_total (const std::vector<struct iovec>& iov)
+{
+  size_t total = 0;
+
+  for (auto i = iov.cbegin(); i != iov.cend(); i++) {
+    if (i->iov_len > static_cast<size_t>(SSIZE_MAX) - total)
+      return -EINVAL;
+    total += i->iov_len;
+  }
+  return total;
 }
 
 std::string
-VFS::getFilename(pid_t pid, Sandbox::Address addr) const
+VFS::cwdPath() const
 {
-  std::vector<char> buf (1024);
-  m_sbox->copyString (pid, addr, buf.size(), buf.data());
-  return std::string (buf.data());
+  return m_cwd ? m_cwd->path() : "/";
 }
 
-File::Ptr
+int
+VFS::getFilename(pid_t pid, Sandbox::Address addr, std::string& fname) const
+{
+  // Whatever went wrong reading it, the kernel would call it a fault
+  if (!m_sbox->readString (pid, addr, PATH_MAX, fname))
+    return errno == ENAMETOOLONG ? -ENAMETOOLONG : -EFAULT;
+  return 0;
+}
+
+File*
 VFS::getFile(int fd) const
 {
-  assert (isVirtualFD (fd));
-  return m_openFiles.at(fd);
+  if (!isVirtualFD (fd) || static_cast<size_t>(fd - firstVirtualFD) >= m_files.size())
+    return nullptr;
+  return m_files[fd - firstVirtualFD].get();
 }
 
 int
 File::close()
 {
+  if (m_mapFD >= 0) {
+    ::close (m_mapFD);
+    m_mapFD = -1;
+  }
   if (m_localFD > 0) {
     int ret = m_fs->close(m_localFD);
     m_localFD = -1;
@@ -82,29 +231,32 @@ File::close()
 std::pair<std::string, std::shared_ptr<Filesystem> >
 VFS::getFilesystem(const std::string& path) const
 {
-  std::string searchPath (path);
-  std::string longest_mount;
-  if (path[0] == '.')
-    searchPath = m_cwd->path() + path;
-  for(auto i = m_mountpoints.cbegin(); i != m_mountpoints.cend(); i++) {
-    if (searchPath.compare(0, i->first.size(), i->first) == 0) {
-      std::string newPath (searchPath.substr (i->first.size()-1));
-      return std::make_pair (newPath, i->second);
-    }
+  MountTable::Match match;
+  std::string searchPath;
+
+  if (path[0] != '/') {
+    searchPath = PathResolver::normalize (path, cwdPath());
+    match = m_mountpoints.lookup (searchPath.data(), searchPath.size());
+  } else {
+    match = m_mountpoints.lookup (path.data(), path.size());
   }
-  return std::make_pair (std::string(), nullptr);
-}
 
-int File::s_nextFD = VFS::firstVirtualFD;
+  if (!match.fs)
+    return std::make_pair (std::string(), nullptr);
+  if (match.restLength == 0)
+    return std::make_pair (std::string ("/"), *match.fs);
+  return std::make_pair (std::string (match.rest, match.restLength), *match.fs);
+}
 
-File::File(int localFD, const std::string& path, std::shared_ptr<Filesystem>& fs)
+File::File(int localFD, int flags, const std::string& path, std::shared_ptr<Filesystem>& fs, int virtualFD)
   : m_localFD (localFD),
+    m_mapFD (-1),
+    m_virtualFD (virtualFD),
+    m_flags (flags),
+    m_attrValid (false),
     m_path (path),
     m_fs (fs)
 {
-  //FIXME: gcc-4.8 lacks stdatomic.h, so we're stuck with gcc builtins :(
-  //see also: https://gcc.gnu.org/bugzilla/show_bug.cgi?id=58016
-  m_virtualFD = __sync_fetch_and_add (&s_nextFD, 1);
 }
 
 std::string
@@ -116,37 +268,72 @@ File::path() const
 void
 VFS::do_readlink (Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
   if (!isWhitelisted (fname)) {
     call.id = -1;
-    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+    std::string path;
+    err = resolvePath (fname, cwdPath(), false, false, path);
+    if (err < 0) {
+      call.returnVal = err;
+      return;
+    }
+    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
     if (fs.second) {
-      std::vector<char> buf (call.args[2]);
+      std::vector<char> buf (std::min<size_t> (call.args[2], PATH_MAX));
       call.returnVal = fs.second->readlink (fs.first.c_str(), buf.data(), buf.size());
       m_sbox->writeData (call.pid, call.args[1], std::min(buf.size(), call.returnVal), buf.data());
     } else {
       call.returnVal = -ENOENT;
     }
+  } else {
+    passThrough (call, fname);
   }
 }
 
 void
 VFS::do_openat (Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[1]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[1], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
+  std::string base (cwdPath());
+  int dirfd = call.args[0];
 
-  if (fname[0] != '/') {
-    std::string fdPath;
-    if (call.args[0] == AT_FDCWD) {
-      fdPath = m_cwd->path();
-    } else if (isVirtualFD (call.args[0])) {
-      File::Ptr file = getFile (call.args[0]);
-      fdPath = file->path();
+  if (fname[0] != '/' && isVirtualFD (dirfd)) {
+    File* file = getFile (dirfd);
+    if (!file) {
+      call.id = -1;
+      call.returnVal = -EBADF;
+      return;
     }
-    fname = fdPath + fname;
+    base = file->path();
+  } else if (fname[0] != '/' && dirfd != AT_FDCWD) {
+    // Directories are only ever opened through us, so the kernel fails this
+    // with EBADF or ENOTDIR, whichever is right
+    std::string dir ("/proc/" + std::to_string (call.pid) + "/fd/" + std::to_string (dirfd));
+    struct stat sbuf;
+
+    if (m_sbox->getBackend() == Sandbox::Backend::UserNotification &&
+        ::lstat (dir.c_str(), &sbuf) < 0) {
+      call.id = -1;
+      call.returnVal = -EBADF;
+    } else {
+      passThrough (call, dir + "/" + fname);
+    }
+    return;
   }
 
-  openFile (call, fname, call.args[2], call.args[3]);
+  openFile (call, fname, base, call.args[2], call.args[3]);
 }
 
 
@@ -156,53 +343,206 @@ File::~File ()
 }
 
 File::Ptr
-VFS::makeFile (int fd, const std::string& path, std::shared_ptr<Filesystem>& fs)
+VFS::makeFile (int fd, int flags, const std::string& path, std::shared_ptr<Filesystem>& fs)
 {
-  File::Ptr f(new File (fd, path, fs));
-  m_openFiles.insert (std::make_pair (f->virtualFD(), f));
+  size_t slot = m_files.size();
+
+  // The lowest free number, as POSIX wants
+  if (!m_freeSlots.empty()) {
+    std::pop_heap (m_freeSlots.begin(), m_freeSlots.end(), std::greater<int>());
+    slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+  } else {
+    m_files.emplace_back();
+  }
+
+  File::Ptr f(new File (fd, flags, path, fs, firstVirtualFD + slot));
+  m_files[slot] = f;
+  m_openPaths[path].push_back (f->virtualFD());
   return f;
 }
 
+void
+VFS::releaseFD (int fd)
+{
+  auto open = m_openPaths.find (m_files[fd - firstVirtualFD]->path());
+
+  open->second.erase (std::find (open->second.begin(), open->second.end(), fd));
+  if (open->second.empty())
+    m_openPaths.erase (open);
+  m_files[fd - firstVirtualFD].reset();
+  m_freeSlots.push_back (fd - firstVirtualFD);
+  std::push_heap (m_freeSlots.begin(), m_freeSlots.end(), std::greater<int>());
+}
+
 void
 VFS::do_access (Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
   if (!isWhitelisted (fname)) {
     call.id = -1;
-    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+    std::string path;
+    const PathResolver::Dentry* dentry;
+    err = resolvePath (fname, cwdPath(), true, false, path, &dentry);
+    if (err < 0) {
+      call.returnVal = err;
+      return;
+    }
+    // Only existence is answered from the cache. Whether a mode is granted
+    // also depends on read-only mounts, ACLs and the Filesystem's policy.
+    if (call.args[1] == F_OK && dentry && dentry->exists) {
+      call.returnVal = 0;
+      return;
+    }
+    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
     if (fs.second) {
       call.returnVal = fs.second->access (fs.first.c_str(), call.args[1]);
     } else {
       call.returnVal = -ENOENT;
     }
+  } else {
+    passThrough (call, fname);
   }
 }
 
 void
-VFS::openFile(Sandbox::SyscallCall& call, const std::string& fname, int flags, mode_t mode)
+VFS::openFile(Sandbox::SyscallCall& call, const std::string& fname, const std::string& base, int flags, mode_t mode)
 {
   if (!isWhitelisted (fname)) {
     call.id = -1;
-    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+    std::string path;
+    int err = resolvePath (fname, base, !(flags & O_NOFOLLOW), flags & O_CREAT, path);
+    if (err < 0) {
+      call.returnVal = err;
+      return;
+    }
+    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
     if (fs.second) {
       int fd = fs.second->open (fs.first.c_str(), flags, mode);
-      if (fd) {
-        File::Ptr file (makeFile (fd, fname, fs.second));
+      // The file might not have been there before, or have been emptied
+      if (fd >= 0 && (flags & (O_CREAT | O_TRUNC)))
+        attributesChanged (path);
+      // So might the directory's size, times and link count
+      if (fd >= 0 && (flags & O_CREAT))
+        attributesChanged (path.substr (0, std::max<size_t> (path.rfind ('/'), 1)));
+      if (fd >= 0 && m_delegate && delegateFile (call, *fs.second, fd, flags)) {
+        fs.second->close (fd);
+      } else if (fd >= 0) {
+        File::Ptr file (makeFile (fd, flags, path, fs.second));
         call.returnVal = file->virtualFD();
       } else {
-        call.returnVal = -errno;
+        call.returnVal = fd == -1 ? -errno : fd;
       }
     } else {
       call.returnVal = -ENOENT;
     }
+  } else {
+    passThrough (call, fname);
+  }
+}
+
+/**
+ * Lets @p call on the host path @p fname through. A call stopped by a seccomp
+ * user notification can only be let through as it stands, and by then
+ * another thread may have changed the path we read, so the call is made here
+ * on @p fname instead.
+ */
+void
+VFS::passThrough(Sandbox::SyscallCall& call, std::string fname)
+{
+  Sandbox::Word id = call.id;
+
+  if (m_sbox->getBackend() != Sandbox::Backend::UserNotification)
+    return;
+
+  // Our own /proc/self is not the child's
+  if (fname.compare (0, 11, "/proc/self/") == 0)
+    fname.replace (0, 10, "/proc/" + std::to_string (call.pid));
+
+  call.id = -1;
+  if (id == SYS_open || id == SYS_openat) {
+    int flags = id == SYS_open ? call.args[1] : call.args[2];
+    mode_t mode = id == SYS_open ? call.args[2] : call.args[3];
+    int fd = ::open (fname.c_str(), flags | O_CLOEXEC, mode);
+
+    if (fd < 0) {
+      call.returnVal = -errno;
+    } else {
+      if (!m_sbox->returnFD (call, fd, flags & O_CLOEXEC))
+        call.returnVal = -EMFILE;
+      ::close (fd);
+    }
+  } else if (id == SYS_stat || id == SYS_lstat) {
+    struct stat sbuf;
+    int ret = id == SYS_stat ? ::stat (fname.c_str(), &sbuf) : ::lstat (fname.c_str(), &sbuf);
+
+    if (ret < 0)
+      call.returnVal = -errno;
+    else if (m_sbox->writeData (call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf))
+      call.returnVal = 0;
+    else
+      call.returnVal = -EFAULT;
+  } else if (id == SYS_access) {
+    call.returnVal = ::access (fname.c_str(), call.args[1]) < 0 ? -errno : 0;
+  } else if (id == SYS_readlink) {
+    std::vector<char> buf (std::min<size_t> (call.args[2], PATH_MAX));
+    ssize_t len = ::readlink (fname.c_str(), buf.data(), buf.size());
+
+    if (len < 0)
+      call.returnVal = -errno;
+    else if (m_sbox->writeData (call.pid, call.args[1], len, buf.data()))
+      call.returnVal = len;
+    else
+      call.returnVal = -EFAULT;
+  } else {
+    call.id = id;
   }
 }
 
+/**
+ * Makes @p call return a copy of the host file behind @p fd, if it is a
+ * regular file opened read-only
+ *
+ * @return Whether @p call was answered. @p fd is still ours either way.
+ */
+bool
+VFS::delegateFile(Sandbox::SyscallCall& call, Filesystem& fs, int fd, int flags)
+{
+  int native = fs.nativeFD (fd);
+  struct stat sbuf;
+
+  if (native < 0 || (flags & O_ACCMODE) != O_RDONLY || (flags & (O_DIRECTORY | O_PATH)))
+    return false;
+
+  if (::fstat (native, &sbuf) < 0 || !S_ISREG (sbuf.st_mode))
+    return false;
+
+  return m_sbox->returnFD (call, native, flags & O_CLOEXEC);
+}
+
+void
+VFS::setDelegation(bool enabled)
+{
+  m_delegate = enabled;
+}
+
 void
 VFS::do_open (Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
-  openFile (call, fname, call.args[1], call.args[2]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
+  openFile (call, fname, cwdPath(), call.args[1], call.args[2]);
 }
 
 int
@@ -223,15 +563,34 @@ File::fs() const
   return m_fs;
 }
 
+int
+File::flags() const
+{
+  return m_flags;
+}
+
+int
+File::reopen(Filesystem& fs, const std::string& localPath)
+{
+  off_t pos = lseek (0, SEEK_CUR);
+  int fd = fs.reopen (localPath.c_str(), m_flags & ~(O_CREAT | O_EXCL | O_TRUNC), m_fs->nativeFD (m_localFD));
+
+  if (fd >= 0 && pos > 0 && fs.lseek (fd, pos, SEEK_SET) != pos) {
+    fs.close (fd);
+    return -1;
+  }
+  return fd;
+}
+
 void
 VFS::do_close (Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
     call.id = -1;
-    File::Ptr fh = getFile (call.args[0]);
+    File* fh = getFile (call.args[0]);
     if (fh) {
       call.returnVal = fh->close ();
-      m_openFiles.erase (fh->virtualFD());
+      releaseFD (fh->virtualFD());
     } else {
       call.returnVal = -EBADF;
     }
@@ -249,13 +608,28 @@ VFS::do_read (Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
     call.id = -1;
-    File::Ptr file = getFile (call.args[0]);
-    std::vector<char> buf (call.args[2]);
+    File* file = getFile (call.args[0]);
+    size_t length = call.args[2];
+    char* window = file ? m_sbox->windowBuffer (call.pid, length) : nullptr;
+
+    // Let the kernel copy it over from the window
+    if (window) {
+      ssize_t readCount = file->read (window, length);
+      if (readCount > 0)
+        m_sbox->readFromWindow (call, window, readCount, call.args[1]);
+      else
+        call.returnVal = readCount < 0 ? -errno : 0;
+      return;
+    }
+
+    std::vector<char> buf (std::min<size_t> (call.args[2], max_transfer));
     if (file) {
       ssize_t readCount = file->read (buf.data(), buf.size());
       if (readCount >= 0) {
-        m_sbox->writeData (call.pid, call.args[1], readCount, buf.data());
-        call.returnVal = readCount;
+        if (m_sbox->writeData (call.pid, call.args[1], readCount, buf.data()))
+          call.returnVal = readCount;
+        else
+          call.returnVal = -EFAULT;
       } else {
         call.returnVal = -errno;
       }
@@ -268,17 +642,40 @@ VFS::do_read (Sandbox::SyscallCall& call)
 int
 File::fstat (struct stat* buf)
 {
-  return m_fs->fstat (m_localFD, buf);
+  if (!m_attrValid) {
+    int ret = m_fs->fstat (m_localFD, &m_attr);
+    if (ret != 0)
+      return ret;
+    m_attrValid = true;
+  }
+  *buf = m_attr;
+  return 0;
+}
+
+bool
+File::attributesCached() const
+{
+  return m_attrValid;
+}
+
+void
+File::invalidateAttributes()
+{
+  m_attrValid = false;
 }
 
 void
 VFS::do_fstat (Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
-    File::Ptr file = getFile (call.args[0]);
+    File* file = getFile (call.args[0]);
     call.id = -1;
     if (file) {
       struct stat sbuf;
+      if (file->attributesCached())
+        m_fileStats.hits++;
+      else
+        m_fileStats.misses++;
       call.returnVal = file->fstat (&sbuf);
       if (call.returnVal == 0)
         m_sbox->writeData(call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
@@ -298,12 +695,126 @@ void
 VFS::do_write (Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
-    File::Ptr file = getFile (call.args[0]);
+    File* file = getFile (call.args[0]);
     call.id = -1;
     if (file) {
-      std::vector<char> buf (call.args[2]);
-      m_sbox->copyData (call.pid, call.args[1], buf.size(), buf.data());
-      call.returnVal = file->write (buf.data(), buf.size());
+      std::vector<char> buf (std::min<size_t> (call.args[2], max_transfer));
+      ssize_t copied = m_sbox->readMemory (call.pid, call.args[1], buf.size(), buf.data());
+      if (copied > 0 || buf.size() == 0)
+        call.returnVal = file->write (buf.data(), std::max<ssize_t> (copied, 0));
+      else
+        call.returnVal = -EFAULT;
+      if (call.returnVal > 0)
+        attributesChanged (file->path());
+    } else {
+      call.returnVal = -EBADF;
+    }
+  }
+}
+
+void
+VFS::do_readv (Sandbox::SyscallCall& call)
+{
+  if (isVirtualFD (call.args[0])) {
+    File* file = getFile (call.args[0]);
+    call.id = -1;
+    if (!file) {
+      call.returnVal = -EBADF;
+    } else if (call.args[2] > IOV_MAX) {
+      call.returnVal = -EINVAL;
+    } else {
+      std::vector<struct iovec> iov (call.args[2]);
+
+      if (!m_sbox->copyData (call.pid, call.args[1], iov.size() * sizeof (struct iovec), iov.data())) {
+        call.returnVal = -EFAULT;
+        return;
+      }
+
+      ssize_t requested = iov_total (iov);
+      if (requested < 0) {
+        call.returnVal = requested;
+        return;
+      }
+      size_t total = std::min<size_t> (requested, max_transfer);
+
+      // preadv() fills every iovec, so the window is only used when the
+      // whole read fits, and short reads are copied over as before
+      size_t room = total;
+      char* window = m_sbox->windowBuffer (call.pid, room);
+      std::vector<char> buf;
+      char* data = window;
+
+      if (!window || room != total) {
+        buf.resize (total);
+        data = buf.data();
+      }
+
+      ssize_t readCount = file->read (data, total);
+      if (readCount < 0) {
+        call.returnVal = -errno;
+        return;
+      }
+
+      if (data == window && readCount > 0 && static_cast<size_t>(readCount) == static_cast<size_t>(requested)) {
+        m_sbox->readvFromWindow (call, window, call.args[1], iov.size());
+        return;
+      }
+
+      Sandbox::MemoryTransaction txn (m_sbox, call.pid);
+      size_t offset = 0;
+      for (auto i = iov.cbegin(); i != iov.cend() && offset < static_cast<size_t>(readCount); i++) {
+        size_t length = std::min (i->iov_len, readCount - offset);
+        txn.write (reinterpret_cast<Sandbox::Address>(i->iov_base), length, data + offset);
+        offset += length;
+      }
+
+      if (txn.commit())
+        call.returnVal = readCount;
+      else
+        call.returnVal = -EFAULT;
+    }
+  }
+}
+
+void
+VFS::do_writev (Sandbox::SyscallCall& call)
+{
+  if (isVirtualFD (call.args[0])) {
+    File* file = getFile (call.args[0]);
+    call.id = -1;
+    if (!file) {
+      call.returnVal = -EBADF;
+    } else if (call.args[2] > IOV_MAX) {
+      call.returnVal = -EINVAL;
+    } else {
+      std::vector<struct iovec> iov (call.args[2]);
+
+      if (!m_sbox->copyData (call.pid, call.args[1], iov.size() * sizeof (struct iovec), iov.data())) {
+        call.returnVal = -EFAULT;
+        return;
+      }
+
+      ssize_t requested = iov_total (iov);
+      if (requested < 0) {
+        call.returnVal = requested;
+        return;
+      }
+
+      std::vector<char> buf (std::min<size_t> (requested, max_transfer));
+      Sandbox::MemoryTransaction txn (m_sbox, call.pid);
+      size_t offset = 0;
+      for (auto i = iov.cbegin(); i != iov.cend() && offset < buf.size(); i++) {
+        size_t length = std::min (i->iov_len, buf.size() - offset);
+        txn.read (reinterpret_cast<Sandbox::Address>(i->iov_base), length, buf.data() + offset);
+        offset += length;
+      }
+
+      if (txn.commit())
+        call.returnVal = file->write (buf.data(), buf.size());
+      else
+        call.returnVal = -EFAULT;
+      if (call.returnVal > 0)
+        attributesChanged (file->path());
     }
   }
 }
@@ -312,10 +823,19 @@ void
 VFS::do_getdents (Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
-    File::Ptr file = getFile (call.args[0]);
+    File* file = getFile (call.args[0]);
     call.id = -1;
-    if (file) {
-      std::vector<char> buf (call.args[2]);
+    size_t length = call.args[2];
+    char* window = file ? m_sbox->windowBuffer (call.pid, length) : nullptr;
+
+    if (window) {
+      int readCount = file->getdents ((struct linux_dirent*)window, length);
+      if (readCount > 0)
+        m_sbox->readFromWindow (call, window, readCount, call.args[1]);
+      else
+        call.returnVal = readCount;
+    } else if (file) {
+      std::vector<char> buf (std::min<size_t> (call.args[2], max_transfer));
       struct linux_dirent* dirents = (struct linux_dirent*)buf.data();
       call.returnVal = file->getdents (dirents, buf.size());
       if ((int)call.returnVal > 0)
@@ -329,9 +849,9 @@ VFS::do_getdents (Sandbox::SyscallCall& call)
 void
 VFS::do_fchdir(Sandbox::SyscallCall& call)
 {
-  File::Ptr fh = getFile (call.args[0]);
+  File* fh = getFile (call.args[0]);
   if (fh) {
-    m_cwd = fh;
+    m_cwd = m_files[fh->virtualFD() - firstVirtualFD];
     call.returnVal = 0;
   } else {
     call.returnVal = -EBADF;
@@ -341,7 +861,13 @@ VFS::do_fchdir(Sandbox::SyscallCall& call)
 void
 VFS::do_chdir(Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
   call.returnVal = setCWD (fname);
 }
 
@@ -355,45 +881,92 @@ VFS::getCWD() const
 int
 VFS::setCWD(const std::string& fname)
 {
-  std::string trimmedFname (fname);
-  if (trimmedFname[fname.length()-1] == '/')
-    trimmedFname = std::string(fname.cbegin(), fname.cend()-1);
-  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (trimmedFname);
+  std::string path;
+  int err = resolvePath (fname, cwdPath(), true, false, path);
+  if (err < 0)
+    return err;
+  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
   if (fs.second) {
     int fd = fs.second->open (fs.first.c_str(), O_DIRECTORY, 0);
-    m_cwd = File::Ptr (new File (fd, trimmedFname, fs.second));
+    m_cwd = File::Ptr (new File (fd, O_DIRECTORY, path, fs.second));
     return 0;
   } else {
     return -ENOENT;
   }
 }
 
-#define HANDLE_CALL(x) case SYS_##x: do_##x(ret);break;
+/**
+ * Opens @p file again in this VFS, from the Filesystem its path leads to
+ *
+ * @return The new File, or null if it couldn't be opened
+ */
+File::Ptr
+VFS::cloneFile (File& file, int virtualFD)
+{
+  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (file.path());
+  int fd = fs.second ? file.reopen (*fs.second, fs.first) : -1;
+
+  if (fd < 0)
+    return nullptr;
+  return File::Ptr (new File (fd, file.flags(), file.path(), fs.second, virtualFD));
+}
 
-Sandbox::SyscallCall
-VFS::handleSyscall(const Sandbox::SyscallCall& call)
+void
+VFS::copyState(const VFS& other)
 {
-  Sandbox::SyscallCall ret(call);
-  switch (call.id) {
-    HANDLE_CALL (open);
-    HANDLE_CALL (close);
-    HANDLE_CALL (read);
-    HANDLE_CALL (fstat);
-    HANDLE_CALL (getdents);
-    HANDLE_CALL (openat);
-    HANDLE_CALL (lseek);
-    HANDLE_CALL (write);
-    HANDLE_CALL (access);
-    HANDLE_CALL (chdir);
-    HANDLE_CALL (stat);
-    HANDLE_CALL (lstat);
-    HANDLE_CALL (getcwd);
-    HANDLE_CALL (readlink);
+  m_files.clear();
+  m_freeSlots.clear();
+  m_openPaths.clear();
+  m_cwd.reset();
+
+  m_files.resize (other.m_files.size());
+  for (size_t slot = 0; slot < other.m_files.size(); slot++) {
+    const File::Ptr& file = other.m_files[slot];
+
+    if (file)
+      m_files[slot] = cloneFile (*file, firstVirtualFD + slot);
+
+    if (m_files[slot]) {
+      m_openPaths[file->path()].push_back (firstVirtualFD + slot);
+      // After fchdir(), the current directory is one of the open files
+      if (file == other.m_cwd)
+        m_cwd = m_files[slot];
+    } else {
+      m_freeSlots.push_back (slot);
+      std::push_heap (m_freeSlots.begin(), m_freeSlots.end(), std::greater<int>());
+    }
   }
-  return ret;
+
+  if (other.m_cwd && !m_cwd)
+    m_cwd = cloneFile (*other.m_cwd, other.m_cwd->virtualFD());
 }
 
-#undef HANDLE_CALL
+#define CLAIM_CALL(x) m_sbox->claimSyscall (SYS_##x, [this](Sandbox::SyscallCall& call) {applyCacheRequests(); do_##x (call);}, \
+                                           [this] {return needsLoop();})
+
+void
+VFS::claimSyscalls()
+{
+  CLAIM_CALL (open);
+  CLAIM_CALL (close);
+  CLAIM_CALL (read);
+  CLAIM_CALL (fstat);
+  CLAIM_CALL (getdents);
+  CLAIM_CALL (openat);
+  CLAIM_CALL (lseek);
+  CLAIM_CALL (write);
+  CLAIM_CALL (readv);
+  CLAIM_CALL (writev);
+  CLAIM_CALL (access);
+  CLAIM_CALL (chdir);
+  CLAIM_CALL (stat);
+  CLAIM_CALL (lstat);
+  CLAIM_CALL (getcwd);
+  CLAIM_CALL (readlink);
+  CLAIM_CALL (mmap);
+}
+
+#undef CLAIM_CALL
 
 off_t
 File::lseek(off_t offset, int whence)
@@ -404,9 +977,70 @@ File::lseek(off_t offset, int whence)
 ssize_t
 File::write(void* buf, size_t count)
 {
+  // Later mappings have to see what was written
+  if (m_mapFD >= 0) {
+    ::close (m_mapFD);
+    m_mapFD = -1;
+  }
+  m_attrValid = false;
   return m_fs->write (m_localFD, buf, count);
 }
 
+int
+File::mapFD()
+{
+  int native = m_fs->nativeFD (m_localFD);
+  struct stat sbuf;
+  std::vector<char> buf (64 * 1024);
+  off_t pos, done = 0;
+  ssize_t len;
+
+  if (native >= 0)
+    return native;
+  if (m_mapFD >= 0)
+    return m_mapFD;
+
+  if (fstat (&sbuf) < 0 || (pos = lseek (0, SEEK_CUR)) < 0 || lseek (0, SEEK_SET) < 0)
+    return -1;
+
+  m_mapFD = memfd_create (m_path.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (m_mapFD >= 0 && ftruncate (m_mapFD, sbuf.st_size) == 0) {
+    while (done < sbuf.st_size && (len = read (buf.data(), buf.size())) > 0) {
+      if (pwrite (m_mapFD, buf.data(), len, done) != len)
+        break;
+      done += len;
+    }
+  }
+
+  lseek (pos, SEEK_SET);
+
+  // Sealed, so the child can't change what other mappings see
+  if (m_mapFD >= 0 && (done != sbuf.st_size ||
+      fcntl (m_mapFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)) {
+    ::close (m_mapFD);
+    m_mapFD = -1;
+    errno = EIO;
+  }
+
+  return m_mapFD;
+}
+
+void
+VFS::do_mmap(Sandbox::SyscallCall& call)
+{
+  if (isVirtualFD (call.args[4]) && !(call.args[3] & MAP_ANONYMOUS)) {
+    File* file = getFile (call.args[4]);
+    int fd = file ? file->mapFD() : -1;
+    if (!file) {
+      call.id = -1;
+      call.returnVal = -EBADF;
+    } else if (fd < 0 || !m_sbox->mapFD (call, fd)) {
+      call.id = -1;
+      call.returnVal = -ENODEV;
+    }
+  }
+}
+
 void
 VFS::do_getcwd(Sandbox::SyscallCall& call)
 {
@@ -418,36 +1052,76 @@ VFS::do_getcwd(Sandbox::SyscallCall& call)
 void
 VFS::do_lstat(Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
   if (!isWhitelisted (fname)) {
     call.id = -1;
-    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+    std::string path;
+    const PathResolver::Dentry* dentry;
+    err = resolvePath (fname, cwdPath(), false, false, path, &dentry);
+    if (err < 0) {
+      call.returnVal = err;
+      return;
+    }
+    if (dentry && dentry->exists) {
+      call.returnVal = 0;
+      m_sbox->writeData (call.pid, call.args[1], sizeof (dentry->attr), (const char*)&dentry->attr);
+      return;
+    }
+    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
     if (fs.second) {
       struct stat sbuf;
-      call.returnVal = fs.second->lstat (fname.c_str(), &sbuf);
+      call.returnVal = fs.second->lstat (fs.first.c_str(), &sbuf);
       if (call.returnVal == 0)
         m_sbox->writeData (call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
     } else {
       call.returnVal = -ENOENT;
     }
+   } else {
+    passThrough (call, fname);
   }
 }
 
 void
 VFS::do_stat(Sandbox::SyscallCall& call)
 {
-  std::string fname = getFilename (call.pid, call.args[0]);
+  std::string fname;
+  int err = getFilename (call.pid, call.args[0], fname);
+  if (err < 0) {
+    call.id = -1;
+    call.returnVal = err;
+    return;
+  }
   if (!isWhitelisted (fname)) {
     call.id = -1;
-    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+    std::string path;
+    const PathResolver::Dentry* dentry;
+    err = resolvePath (fname, cwdPath(), true, false, path, &dentry);
+    if (err < 0) {
+      call.returnVal = err;
+      return;
+    }
+    if (dentry && dentry->exists) {
+      call.returnVal = 0;
+      m_sbox->writeData (call.pid, call.args[1], sizeof (dentry->attr), (const char*)&dentry->attr);
+      return;
+    }
+    std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (path);
     if (fs.second) {
       struct stat sbuf;
-      call.returnVal = fs.second->stat (fname.c_str(), &sbuf);
+      call.returnVal = fs.second->stat (fs.first.c_str(), &sbuf);
       if (call.returnVal == 0)
         m_sbox->writeData (call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
     } else {
       call.returnVal = -ENOENT;
     }
+   } else {
+    passThrough (call, fname);
   }
 }
 
@@ -456,7 +1130,7 @@ VFS::do_lseek(Sandbox::SyscallCall& call)
 {
   if (isVirtualFD (call.args[0])) {
     call.id = -1;
-    File::Ptr file = getFile (call.args[0]);
+    File* file = getFile (call.args[0]);
     if (file) {
       call.returnVal = file->lseek (call.args[1], call.args[2]);
     } else {
@@ -0,0 +1,85 @@
+#include "mount-table.h"
+#include "native-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <string.h>
+
+class MountTableTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (MountTableTest);
+  CPPUNIT_TEST (testLongestPrefix);
+  CPPUNIT_TEST (testComponents);
+  CPPUNIT_TEST (testNoRoot);
+  CPPUNIT_TEST_SUITE_END ();
+
+  std::shared_ptr<Filesystem> root, app, modules;
+
+  std::string rest(const MountTable::Match& match) {
+    return std::string (match.rest, match.restLength);
+  }
+
+  MountTable::Match lookup(const MountTable& table, const char* path) {
+    return table.lookup (path, strlen (path));
+  }
+
+public:
+  void setUp() {
+    root.reset (new NativeFilesystem ("/"));
+    app.reset (new NativeFilesystem ("/"));
+    modules.reset (new NativeFilesystem ("/"));
+  }
+
+  void testLongestPrefix() {
+    MountTable table;
+    // Inserted in an order that a lexical walk would get wrong
+    table.mount ("/", root);
+    table.mount ("/app/node_modules/", modules);
+    table.mount ("/app/", app);
+    CPPUNIT_ASSERT_EQUAL ((size_t)3, table.size());
+
+    MountTable::Match match = lookup (table, "/app/node_modules/x/index.js");
+    CPPUNIT_ASSERT (match.fs && *match.fs == modules);
+    CPPUNIT_ASSERT_EQUAL (std::string ("/x/index.js"), rest (match));
+
+    match = lookup (table, "/app/index.js");
+    CPPUNIT_ASSERT (match.fs && *match.fs == app);
+    CPPUNIT_ASSERT_EQUAL (std::string ("/index.js"), rest (match));
+
+    match = lookup (table, "/etc/passwd");
+    CPPUNIT_ASSERT (match.fs && *match.fs == root);
+    CPPUNIT_ASSERT_EQUAL (std::string ("/etc/passwd"), rest (match));
+
+    match = lookup (table, "/app");
+    CPPUNIT_ASSERT (match.fs && *match.fs == app);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, match.restLength);
+  }
+
+  void testComponents() {
+    MountTable table;
+    table.mount ("/", root);
+    table.mount ("//app//", app);
+
+    // Only whole components match
+    MountTable::Match match = lookup (table, "/application/x");
+    CPPUNIT_ASSERT (match.fs && *match.fs == root);
+
+    match = lookup (table, "/app//x");
+    CPPUNIT_ASSERT (match.fs && *match.fs == app);
+    CPPUNIT_ASSERT_EQUAL (std::string ("//x"), rest (match));
+
+    // Mounting again replaces
+    table.mount ("/app", modules);
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, table.size());
+    CPPUNIT_ASSERT (*lookup (table, "/app/x").fs == modules);
+  }
+
+  void testNoRoot() {
+    MountTable table;
+    table.mount ("/app", app);
+
+    CPPUNIT_ASSERT (lookup (table, "/etc/passwd").fs == nullptr);
+    CPPUNIT_ASSERT (lookup (table, "app/x").fs == nullptr);
+    CPPUNIT_ASSERT (lookup (table, "").fs == nullptr);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (MountTableTest);
@@ -0,0 +1,197 @@
+#include "path-resolver.h"
+#include "native-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+class PathResolverTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (PathResolverTest);
+  CPPUNIT_TEST (testNormalize);
+  CPPUNIT_TEST (testSymlinks);
+  CPPUNIT_TEST (testParentOfSymlink);
+  CPPUNIT_TEST (testErrors);
+  CPPUNIT_TEST (testEviction);
+  CPPUNIT_TEST (testNegative);
+  CPPUNIT_TEST (testAttributes);
+  CPPUNIT_TEST_SUITE_END ();
+
+  MountTable mounts;
+  std::string dir;
+
+  void touch(const std::string& path) {
+    ::close (::open (path.c_str(), O_CREAT | O_WRONLY, 0644));
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-resolver-XXXXXX";
+    CPPUNIT_ASSERT (mkdtemp (tmpl));
+    dir = tmpl;
+
+    mkdir ((dir + "/lib").c_str(), 0755);
+    mkdir ((dir + "/lib/sub").c_str(), 0755);
+    touch (dir + "/lib/index.js");
+    symlink ("lib/sub", (dir + "/deep").c_str());
+    symlink ("lib", (dir + "/current").c_str());
+    symlink ("../lib/index.js", (dir + "/lib/main.js").c_str());
+    symlink ("loop", (dir + "/loop").c_str());
+
+    mounts.mount ("/", std::shared_ptr<Filesystem> (new NativeFilesystem ("/")));
+  }
+
+  void tearDown() {
+    unlink ((dir + "/loop").c_str());
+    unlink ((dir + "/lib/main.js").c_str());
+    unlink ((dir + "/current").c_str());
+    unlink ((dir + "/deep").c_str());
+    unlink ((dir + "/lib/index.js").c_str());
+    rmdir ((dir + "/lib/sub").c_str());
+    rmdir ((dir + "/lib").c_str());
+    rmdir (dir.c_str());
+  }
+
+  void testNormalize() {
+    CPPUNIT_ASSERT_EQUAL (std::string ("/app/x"), PathResolver::normalize ("x", "/app"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("/x"), PathResolver::normalize ("/app/../x", "/cwd"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("/app/x"), PathResolver::normalize ("./x//", "/app/"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("/"), PathResolver::normalize ("../../..", "/app"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("/"), PathResolver::normalize ("", "/"));
+  }
+
+  void testSymlinks() {
+    PathResolver resolver (mounts);
+    std::string resolved;
+    bool missing;
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("current/main.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/index.js", resolved);
+    CPPUNIT_ASSERT (!missing);
+
+    // Only the last component is left alone
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("current/main.js", dir, false, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/main.js", resolved);
+
+    // Answered from the cache once the files are gone
+    size_t cached = resolver.size();
+    unlink ((dir + "/lib/main.js").c_str());
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve (dir + "/current/main.js", "/", true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/index.js", resolved);
+    CPPUNIT_ASSERT_EQUAL (cached, resolver.size());
+
+    resolver.invalidate (dir + "/lib/main.js");
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve (dir + "/current/main.js", "/", true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/main.js", resolved);
+    CPPUNIT_ASSERT (missing);
+  }
+
+  void testParentOfSymlink() {
+    PathResolver resolver (mounts);
+    const PathResolver::Dentry* dentry;
+    std::string resolved;
+    bool missing;
+
+    // ".." leaves the directory the symlink led to, not the one holding it
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("deep/../index.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/index.js", resolved);
+    CPPUNIT_ASSERT (!missing);
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve (dir + "/deep/..", "/", false, resolved, missing, &dentry));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib", resolved);
+    CPPUNIT_ASSERT (dentry && S_ISDIR (dentry->attr.st_mode));
+
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, resolver.resolve ("deep/../../nothing/..", dir, true, resolved, missing));
+  }
+
+  void testErrors() {
+    PathResolver resolver (mounts);
+    std::string resolved;
+    bool missing;
+
+    CPPUNIT_ASSERT_EQUAL (-ELOOP, resolver.resolve ("loop", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, resolver.resolve ("nothing/x", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, resolver.resolve ("lib/index.js/x", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, resolver.resolve ("lib/index.js/", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, resolver.resolve ("lib/index.js/..", dir, true, resolved, missing));
+
+    // A trailing slash follows a symlink to a directory, even when the last
+    // component isn't followed otherwise
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("current/", dir, false, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib", resolved);
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("lib/new.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib/new.js", resolved);
+    CPPUNIT_ASSERT (missing);
+  }
+
+  void testEviction() {
+    PathResolver resolver (mounts, 2);
+    std::string resolved;
+    bool missing;
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("lib/index.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, resolver.size());
+
+    resolver.clear();
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, resolver.size());
+
+    PathResolver uncached (mounts, 0);
+    CPPUNIT_ASSERT_EQUAL (0, uncached.resolve ("current", dir, true, resolved, missing));
+    CPPUNIT_ASSERT_EQUAL (dir + "/lib", resolved);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, uncached.size());
+  }
+
+  void testNegative() {
+    PathResolver resolver (mounts);
+    std::string resolved;
+    bool missing;
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("lib/new.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT (missing);
+
+    // Still missing until the next generation
+    touch (dir + "/lib/new.js");
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("lib/new.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT (missing);
+    resolver.newGeneration();
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("lib/new.js", dir, true, resolved, missing));
+    CPPUNIT_ASSERT (!missing);
+    unlink ((dir + "/lib/new.js").c_str());
+
+    resolver.setNegativeTTL (std::chrono::milliseconds (1));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, resolver.resolve ("gone/x", dir, true, resolved, missing));
+    mkdir ((dir + "/gone").c_str(), 0755);
+    usleep (2000);
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("gone/x", dir, true, resolved, missing));
+    CPPUNIT_ASSERT (missing);
+    rmdir ((dir + "/gone").c_str());
+  }
+
+  void testAttributes() {
+    PathResolver resolver (mounts);
+    const PathResolver::Dentry* dentry;
+    std::string resolved;
+    bool missing;
+    struct stat sbuf;
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("current/main.js", dir, true, resolved, missing, &dentry));
+    CPPUNIT_ASSERT (dentry && dentry->exists);
+    CPPUNIT_ASSERT_EQUAL (0, ::stat ((dir + "/lib/index.js").c_str(), &sbuf));
+    CPPUNIT_ASSERT_EQUAL (sbuf.st_ino, dentry->attr.st_ino);
+    CPPUNIT_ASSERT (S_ISREG (dentry->attr.st_mode));
+
+    unsigned long misses = resolver.misses();
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("current/main.js", dir, false, resolved, missing, &dentry));
+    CPPUNIT_ASSERT (S_ISLNK (dentry->attr.st_mode));
+    CPPUNIT_ASSERT_EQUAL (misses, resolver.misses());
+    CPPUNIT_ASSERT (resolver.hits() > 0);
+
+    CPPUNIT_ASSERT_EQUAL (0, resolver.resolve ("/", "/", true, resolved, missing, &dentry));
+    CPPUNIT_ASSERT (dentry == nullptr);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (PathResolverTest);
@@ -1,13 +1,16 @@
 #include "sandbox.h"
 #include "sandbox-ipc.h"
+#include "spawn-pool.h"
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <string.h>
 #include <condition_variable>
 #include <mutex>
 #include <uv.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #ifndef BUILD_PATH
@@ -19,6 +22,10 @@
 #define STRINGIFY(s) strx(s)
 
 #define TESTER_BINARY STRINGIFY(BUILD_PATH) "/build/Debug/syscall-tester"
+#define HELPER_BINARY STRINGIFY(BUILD_PATH) "/build/Debug/codius-spawn-helper"
+
+// A forked child has this at the same address as we do
+static char childData[64];
 
 bool operator< (const Sandbox::SyscallCall& first, const Sandbox::SyscallCall& other)
 {
@@ -51,13 +58,14 @@ public:
     addIPC(std::unique_ptr<TestIPC> (new TestIPC(STDERR_FILENO)));
   }
 
-  SyscallCall handleSyscall(const SyscallCall& call) override {
-    history.push_back (call);
+  void watch(int syscall) {
+    claimSyscall (syscall, [this](SyscallCall& call) {
+      history.push_back (call);
 
-    if (remap.find (call.id) != remap.cend()) {
-      return remap[call];
-    }
-    return call;
+      if (remap.find (call) != remap.cend()) {
+        call = remap[call];
+      }
+    });
   }
 
   void handleIPC(codius_request_t*) override {}
@@ -83,6 +91,9 @@ class SandboxTest : public CppUnit::TestFixture {
   CPPUNIT_TEST_SUITE (SandboxTest);
   CPPUNIT_TEST (testSimpleProgram);
   CPPUNIT_TEST (testExitStatus);
+  CPPUNIT_TEST (testSpawnPool);
+  CPPUNIT_TEST (testMemoryTransaction);
+  CPPUNIT_TEST (testClaimSyscall);
   CPPUNIT_TEST_SUITE_END ();
 
 private:
@@ -138,6 +149,104 @@ public:
       CPPUNIT_ASSERT_EQUAL (EFAULT, sbox->exitStatus);
     }
 
+    void testSpawnPool()
+    {
+      std::shared_ptr<SpawnPool> pool (new SpawnPool (1, HELPER_BINARY));
+      CPPUNIT_ASSERT_EQUAL ((size_t)0, pool->available());
+
+      // The first child starts the helper with its filter
+      sbox->setSpawnPool (pool);
+      _run (SYS_exit);
+      sbox->waitExit();
+      CPPUNIT_ASSERT_EQUAL (0, sbox->exitStatus);
+
+      while (pool->available() == 0)
+        uv_run (uv_default_loop(), UV_RUN_ONCE);
+
+      sbox.reset (new TestSandbox());
+      sbox->setSpawnPool (pool);
+      _run (SYS_exit);
+      CPPUNIT_ASSERT_EQUAL ((size_t)0, pool->available());
+      sbox->waitExit();
+      CPPUNIT_ASSERT_EQUAL (0, sbox->exitStatus);
+    }
+
+    void testMemoryTransaction()
+    {
+      Sandbox::Address addr = reinterpret_cast<Sandbox::Address>(childData);
+      char first[8] = {0};
+      char last[8] = {0};
+      char before[8] = {0};
+      char after[8] = {0};
+      pid_t pid;
+
+      strcpy (childData, "0123456789abcdef");
+      pid = fork();
+      if (pid == 0) {
+        for (;;)
+          pause();
+      }
+      CPPUNIT_ASSERT (pid > 0);
+      memset (childData, 0, sizeof (childData));
+
+      Sandbox::MemoryTransaction txn (sbox.get(), pid);
+      txn.read (addr, 4, first);
+      txn.read (addr + 12, 4, last);
+      txn.read (addr + 4, 4, before);
+      txn.write (addr + 4, 4, "WXYZ");
+      txn.write (addr + 8, 4, "wxyz");
+      CPPUNIT_ASSERT (txn.commit());
+      CPPUNIT_ASSERT_EQUAL (std::string ("0123"), std::string (first));
+      CPPUNIT_ASSERT_EQUAL (std::string ("cdef"), std::string (last));
+      // Reads see the memory from before the writes
+      CPPUNIT_ASSERT_EQUAL (std::string ("4567"), std::string (before));
+
+      // One bad address fails the commit, but the rest is still done
+      memset (first, 0, sizeof (first));
+      txn.read (0, 4, before);
+      txn.read (addr + 4, 8, after);
+      txn.write (0, 4, "fail");
+      txn.write (addr, 4, "ABCD");
+      CPPUNIT_ASSERT (!txn.commit());
+      CPPUNIT_ASSERT_EQUAL (std::string ("WXYZwxyz"), std::string (after, sizeof (after)));
+
+      txn.read (addr, 4, first);
+      CPPUNIT_ASSERT (txn.commit());
+      CPPUNIT_ASSERT_EQUAL (std::string ("ABCD"), std::string (first));
+
+      kill (pid, SIGKILL);
+      waitpid (pid, nullptr, 0);
+    }
+
+    void testClaimSyscall()
+    {
+      int calls = 0;
+      Sandbox::SyscallHandler counter = [&calls](Sandbox::SyscallCall&) {calls++;};
+      Sandbox::SyscallCall call;
+
+      // Nobody claims accept
+      CPPUNIT_ASSERT (!sbox->claimSyscall (SYS_accept, counter));
+
+      // The VFS hands over read, and the previous claim comes back
+      CPPUNIT_ASSERT (sbox->claimSyscall (SYS_read, counter));
+      Sandbox::SyscallHandler previous = sbox->claimSyscall (SYS_read, nullptr);
+      CPPUNIT_ASSERT (previous);
+      previous (call);
+      CPPUNIT_ASSERT_EQUAL (1, calls);
+      CPPUNIT_ASSERT (!sbox->claimSyscall (SYS_read, nullptr));
+
+      // setIdentity() takes getuid from whoever had it
+      sbox->claimSyscall (SYS_getuid, counter);
+      sbox->setIdentity (Sandbox::Identity {1000, 1000, 1});
+      previous = sbox->claimSyscall (SYS_getuid, nullptr);
+      CPPUNIT_ASSERT (previous);
+      call.id = SYS_getuid;
+      previous (call);
+      CPPUNIT_ASSERT_EQUAL (1, calls);
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)-1, call.id);
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)1000, call.returnVal);
+    }
+
     void testInterceptSyscall()
     {
       _run (SYS_accept);
@@ -0,0 +1,107 @@
+#include "scratch-arena.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class ScratchArenaTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (ScratchArenaTest);
+  CPPUNIT_TEST (testBounds);
+  CPPUNIT_TEST (testThreads);
+  CPPUNIT_TEST (testOverflow);
+  CPPUNIT_TEST (testRelease);
+  CPPUNIT_TEST (testSlotSize);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testBounds() {
+    ScratchArena arena;
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (1, 1));
+
+    // Too small to split, like the buffer in the environment
+    arena.assign (0x1001, 2047);
+    ScratchArena::Address first = arena.allocate (1, 10);
+    CPPUNIT_ASSERT_EQUAL (0x1008ul, first);
+    CPPUNIT_ASSERT_EQUAL (0x1018ul, arena.allocate (1, 100));
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (1, 2040));
+
+    arena.rewind (1);
+    CPPUNIT_ASSERT_EQUAL (first, arena.allocate (1, 2040));
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (1, 1));
+
+    // Every thread shares it
+    arena.rewind (2);
+    CPPUNIT_ASSERT_EQUAL (first, arena.allocate (1, 10));
+  }
+
+  void testThreads() {
+    ScratchArena arena;
+    arena.assign (0x10000, 64 * 1024);
+
+    ScratchArena::Address a = arena.allocate (1, 16);
+    ScratchArena::Address b = arena.allocate (2, 16);
+    CPPUNIT_ASSERT (a != 0 && b != 0);
+    CPPUNIT_ASSERT (b >= a + ScratchArena::defaultSlotSize);
+
+    // Rewinding one thread leaves the other's memory alone
+    arena.rewind (1);
+    CPPUNIT_ASSERT_EQUAL (a, arena.allocate (1, 16));
+    CPPUNIT_ASSERT (arena.allocate (2, 16) > b);
+
+    // A thread that went away gives its slot to the next one
+    arena.forget (2);
+    CPPUNIT_ASSERT_EQUAL (b, arena.allocate (3, 16));
+  }
+
+  void testOverflow() {
+    ScratchArena arena;
+    arena.assign (0x10000, 8 * 1024);
+
+    ScratchArena::Address big = arena.allocate (1, 3000);
+    CPPUNIT_ASSERT (big >= 0x10000 + 4 * 1024);
+
+    // The overflow area belongs to one thread at a time
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (2, 3000));
+    CPPUNIT_ASSERT (arena.allocate (2, 16) != 0);
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (1, 4096));
+
+    // Its syscall may not have run yet, so releasing isn't enough
+    arena.release (1, big, 3000, arena.epoch());
+    CPPUNIT_ASSERT_EQUAL (0ul, arena.allocate (2, 3000));
+
+    arena.rewind (1);
+    CPPUNIT_ASSERT_EQUAL (big, arena.allocate (2, 3000));
+  }
+
+  void testRelease() {
+    ScratchArena arena;
+    arena.assign (0x10000, 64 * 1024);
+
+    ScratchArena::Address a = arena.allocate (1, 16);
+    ScratchArena::Address b = arena.allocate (1, 16);
+    arena.release (1, b, 16, arena.epoch());
+    CPPUNIT_ASSERT_EQUAL (b, arena.allocate (1, 16));
+
+    // Stale leases don't hand out memory that was allocated again
+    uint64_t epoch = arena.epoch();
+    arena.rewind (1);
+    a = arena.allocate (1, 16);
+    arena.release (1, a, 16, epoch);
+    CPPUNIT_ASSERT (arena.allocate (1, 16) > a);
+  }
+
+  void testSlotSize() {
+    ScratchArena arena;
+    arena.assign (0x10000, 1024 * 1024, 64 * 1024);
+    CPPUNIT_ASSERT_EQUAL (64 * 1024ul, arena.slotSize());
+
+    ScratchArena::Address a = arena.allocate (1, 64 * 1024);
+    ScratchArena::Address b = arena.allocate (2, 64 * 1024);
+    CPPUNIT_ASSERT_EQUAL (0x10000ul, a);
+    CPPUNIT_ASSERT_EQUAL (0x20000ul, b);
+
+    // Too big for the slots, so the whole arena is one
+    arena.assign (0x10000, 100 * 1024, 64 * 1024);
+    CPPUNIT_ASSERT_EQUAL (100 * 1024ul, arena.slotSize());
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (ScratchArenaTest);
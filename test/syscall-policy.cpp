@@ -0,0 +1,196 @@
+#include "syscall-policy.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <algorithm>
+
+/**
+ * Runs @p filter the way the kernel would for syscall @p nr, with all
+ * arguments 0, and counts the instructions it takes to come to @p verdict
+ *
+ * @return false if the filter used an instruction this doesn't know, or
+ * ran off its end
+ */
+static bool
+run_filter (const std::vector<struct sock_filter>& filter, int nr,
+            uint32_t& verdict, size_t& steps)
+{
+  struct seccomp_data data;
+  uint32_t mem[BPF_MEMWORDS] = {0};
+  uint32_t a = 0;
+  uint32_t x = 0;
+
+  memset (&data, 0, sizeof (data));
+  data.nr = nr;
+  data.arch = AUDIT_ARCH_X86_64;
+
+  steps = 0;
+
+  for (size_t pc = 0; pc < filter.size(); pc++) {
+    const struct sock_filter& op = filter[pc];
+    bool taken;
+
+    steps++;
+
+    switch (op.code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        if (op.k + sizeof (a) > sizeof (data))
+          return false;
+        memcpy (&a, reinterpret_cast<const char*>(&data) + op.k, sizeof (a));
+        continue;
+      case BPF_LD | BPF_IMM:
+        a = op.k;
+        continue;
+      case BPF_LD | BPF_MEM:
+        a = mem[op.k % BPF_MEMWORDS];
+        continue;
+      case BPF_LDX | BPF_IMM:
+        x = op.k;
+        continue;
+      case BPF_LDX | BPF_MEM:
+        x = mem[op.k % BPF_MEMWORDS];
+        continue;
+      case BPF_ST:
+        mem[op.k % BPF_MEMWORDS] = a;
+        continue;
+      case BPF_STX:
+        mem[op.k % BPF_MEMWORDS] = x;
+        continue;
+      case BPF_ALU | BPF_AND | BPF_K:
+        a &= op.k;
+        continue;
+      case BPF_ALU | BPF_OR | BPF_K:
+        a |= op.k;
+        continue;
+      case BPF_MISC | BPF_TAX:
+        x = a;
+        continue;
+      case BPF_MISC | BPF_TXA:
+        a = x;
+        continue;
+      case BPF_RET | BPF_K:
+        verdict = op.k;
+        return true;
+      case BPF_JMP | BPF_JA:
+        pc += op.k;
+        continue;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+        taken = a == op.k;
+        break;
+      case BPF_JMP | BPF_JGT | BPF_K:
+        taken = a > op.k;
+        break;
+      case BPF_JMP | BPF_JGE | BPF_K:
+        taken = a >= op.k;
+        break;
+      case BPF_JMP | BPF_JSET | BPF_K:
+        taken = (a & op.k) != 0;
+        break;
+      default:
+        return false;
+    }
+
+    pc += taken ? op.jt : op.jf;
+  }
+
+  return false;
+}
+
+class SyscallPolicyTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (SyscallPolicyTest);
+  CPPUNIT_TEST (testRemove);
+  CPPUNIT_TEST (testConditions);
+  CPPUNIT_TEST (testCompile);
+  CPPUNIT_TEST (testCompileFailure);
+  CPPUNIT_TEST (testExport);
+  CPPUNIT_TEST (testCachedBPF);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testRemove() {
+    SyscallPolicy policy;
+    policy.trap (SCMP_SYS (uname));
+    policy.allow (SCMP_SYS (getpid));
+    policy.trap (SCMP_SYS (uname), {SCMP_A0 (SCMP_CMP_EQ, 0)});
+    policy.remove (SCMP_SYS (uname));
+    CPPUNIT_ASSERT_EQUAL ((size_t)1, policy.rules().size());
+    CPPUNIT_ASSERT_EQUAL (SCMP_SYS (getpid), policy.rules()[0].syscall);
+  }
+
+  void testConditions() {
+    SyscallPolicy policy;
+    policy.fail (SCMP_SYS (fcntl), EPERM, {SCMP_A0 (SCMP_CMP_LT, 10), SCMP_A1 (SCMP_CMP_EQ, F_GETFL)});
+    const SyscallPolicy::Rule& rule = policy.rules()[0];
+    CPPUNIT_ASSERT (rule.action == SyscallPolicy::Action::Errno);
+    CPPUNIT_ASSERT_EQUAL (EPERM, rule.errnum);
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, rule.conditions.size());
+    CPPUNIT_ASSERT_EQUAL (1u, rule.conditions[1].arg);
+  }
+
+  void testCompile() {
+    scmp_filter_ctx ctx = SyscallPolicy::defaultPolicy().compile (SCMP_ACT_TRACE (0));
+    CPPUNIT_ASSERT (ctx != nullptr);
+    seccomp_release (ctx);
+  }
+
+  void testCompileFailure() {
+    SyscallPolicy policy (SyscallPolicy::defaultPolicy());
+    // There is no seventh argument, so libseccomp refuses the rule
+    policy.allow (SCMP_SYS (uname), {{6, SCMP_CMP_EQ, 0, 0}});
+    CPPUNIT_ASSERT (policy.compile (SCMP_ACT_TRACE (0)) == nullptr);
+    CPPUNIT_ASSERT (policy.exportBPF (SCMP_ACT_TRACE (0)).empty());
+    CPPUNIT_ASSERT (policy.cachedBPF (SCMP_ACT_TRACE (0)) == nullptr);
+  }
+
+  void testExport() {
+    SyscallPolicy policy (SyscallPolicy::defaultPolicy());
+    policy.setLayout (SyscallPolicy::Layout::Linear);
+    std::vector<struct sock_filter> linear = policy.exportBPF (SCMP_ACT_TRACE (0));
+    policy.setLayout (SyscallPolicy::Layout::BinaryTree);
+    std::vector<struct sock_filter> tree = policy.exportBPF (SCMP_ACT_TRACE (0));
+    size_t linearRead, linearWorst = 0, treeWorst = 0;
+    uint32_t verdict;
+    CPPUNIT_ASSERT (linear.size() > 0);
+    CPPUNIT_ASSERT (tree.size() > 0);
+
+    // Both layouts have to come to the same verdict for every syscall
+    for (int nr = 0; nr < 450; nr++) {
+      size_t linearSteps, treeSteps;
+      uint32_t linearVerdict, treeVerdict;
+      CPPUNIT_ASSERT (run_filter (linear, nr, linearVerdict, linearSteps));
+      CPPUNIT_ASSERT (run_filter (tree, nr, treeVerdict, treeSteps));
+      CPPUNIT_ASSERT_EQUAL (linearVerdict, treeVerdict);
+      linearWorst = std::max (linearWorst, linearSteps);
+      treeWorst = std::max (treeWorst, treeSteps);
+    }
+
+    // read is among the syscalls the linear layout checks first, well ahead
+    // of those without a priority
+    run_filter (linear, SCMP_SYS (read), verdict, linearRead);
+    CPPUNIT_ASSERT (linearRead * 4 < linearWorst);
+
+#if defined(SCMP_VER_MAJOR) && (SCMP_VER_MAJOR > 2 || (SCMP_VER_MAJOR == 2 && SCMP_VER_MINOR >= 5))
+    // The binary tree trades that for a much shorter worst case
+    CPPUNIT_ASSERT (treeWorst * 2 < linearWorst);
+#endif
+  }
+
+  void testCachedBPF() {
+    SyscallPolicy policy (SyscallPolicy::defaultPolicy());
+    SyscallPolicy::Program first = policy.cachedBPF (SCMP_ACT_TRACE (0));
+    SyscallPolicy::Program again = SyscallPolicy (policy).cachedBPF (SCMP_ACT_TRACE (0));
+    CPPUNIT_ASSERT (first != nullptr);
+    CPPUNIT_ASSERT (first == again);
+    CPPUNIT_ASSERT_EQUAL (policy.exportBPF (SCMP_ACT_TRACE (0)).size(), first->size());
+
+    policy.fail (SCMP_SYS (uname), EPERM);
+    CPPUNIT_ASSERT (policy.cachedBPF (SCMP_ACT_TRACE (0)) != first);
+    CPPUNIT_ASSERT (policy.cachedBPF (SCMP_ACT_TRACE (1)) != policy.cachedBPF (SCMP_ACT_TRACE (0)));
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (SyscallPolicyTest);
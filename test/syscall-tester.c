@@ -7,10 +7,13 @@
 int main(int argc, char** argv)
 {
   int callNum = atoi (argv[1]);
+  int repeat = argc > 2 ? atoi (argv[2]) : 1;
   int args[5];
+  int i;
 
   memset (args, 0, sizeof (args));
-  syscall (callNum, args[0], args[1], args[2], args[3], args[4], args[5]);
+  for (i = 0; i < repeat; i++)
+    syscall (callNum, args[0], args[1], args[2], args[3], args[4], args[5]);
 
   return errno;
 }
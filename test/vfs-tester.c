@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+/*
+ * Runs inside a sandbox for test/vfs.cpp. Each mode returns 0 if everything
+ * the child saw was right, or the number of the first check that failed.
+ * Files are as created by VFSTest::setUp().
+ */
+
+#define DATA_LENGTH 100000
+#define OTHER_LENGTH 4096
+#define WINDOW_FD 1023
+
+static volatile sig_atomic_t signals;
+
+static void
+count_signal (int signum)
+{
+  signals++;
+}
+
+static int
+open_in (const char* dir, const char* name)
+{
+  char path[4096];
+
+  strcpy (path, dir);
+  strcat (path, "/");
+  strcat (path, name);
+  return open (path, O_RDONLY);
+}
+
+/* Whether @p buf holds @p length bytes of "data" starting at @p offset */
+static int
+is_data (const char* buf, size_t offset, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    if ((unsigned char)buf[i] != (offset + i) % 251)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+is_other (const char* buf, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    if (buf[i] != 'o')
+      return 0;
+  }
+  return 1;
+}
+
+/* Reads until @p length bytes or the end of the file */
+static ssize_t
+read_all (int fd, char* buf, size_t length)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < length && (ret = read (fd, buf + done, length - done)) > 0)
+    done += ret;
+  return done;
+}
+
+/*
+ * Files opened read-only are real descriptors, which are read without the
+ * sandbox. The sandbox signals us while it hands each one over.
+ */
+static int
+test_delegate (const char* dir)
+{
+  static char buf[DATA_LENGTH];
+  struct rlimit limit;
+  int fd, other;
+
+  fd = open_in (dir, "data");
+  if (fd < 0 || fd >= 4096)
+    return 1;
+  if (read_all (fd, buf, sizeof (buf)) != DATA_LENGTH || !is_data (buf, 0, DATA_LENGTH))
+    return 2;
+  if (signals != 1)
+    return 3;
+
+  /* Every number below fd is taken, so there is no room for the next one */
+  getrlimit (RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = fd + 1;
+  if (setrlimit (RLIMIT_NOFILE, &limit) < 0)
+    return 4;
+  errno = 0;
+  if (open_in (dir, "data") != -1 || errno != EMFILE)
+    return 5;
+  if (signals != 2)
+    return 6;
+
+  /* The file that didn't fit must not turn up in its place */
+  close (fd);
+  other = open_in (dir, "other");
+  if (other != fd)
+    return 7;
+  if (read_all (other, buf, sizeof (buf)) != OTHER_LENGTH || !is_other (buf, OTHER_LENGTH))
+    return 8;
+  if (signals != 3)
+    return 9;
+
+  return 0;
+}
+
+/*
+ * Virtual files are mapped by handing the child a real descriptor, which is
+ * the file itself on a native mount or a sealed copy of it otherwise. The
+ * sandbox signals us while it does.
+ */
+static int
+test_mmap (const char* dir)
+{
+  char buf[100];
+  char* map;
+  int fd;
+
+  fd = open_in (dir, "data");
+  if (fd < 4096)
+    return 1;
+  map = mmap (NULL, 8192, PROT_READ, MAP_PRIVATE, fd, 8192);
+  if (map == MAP_FAILED)
+    return 2;
+  if (!is_data (map, 8192, 8192))
+    return 3;
+  if (signals != 1)
+    return 4;
+  munmap (map, 8192);
+
+  /* Copying the file for the mapping leaves its offset alone */
+  if (read (fd, buf, sizeof (buf)) != sizeof (buf) || !is_data (buf, 0, sizeof (buf)))
+    return 5;
+
+  map = mmap (NULL, DATA_LENGTH, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED || !is_data (map, 0, DATA_LENGTH))
+    return 6;
+  if (signals != 2)
+    return 7;
+  munmap (map, DATA_LENGTH);
+
+  close (fd);
+  errno = 0;
+  if (mmap (NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0) != MAP_FAILED || errno != EBADF)
+    return 8;
+
+  return 0;
+}
+
+static char window[1024 * 1024];
+
+/* Zeroes the window, so that whatever turns up in it was just put there */
+static int
+clear_window ()
+{
+  struct stat sbuf;
+
+  if (fstat (WINDOW_FD, &sbuf) < 0 || sbuf.st_size > sizeof (window))
+    return 0;
+  memset (window, 0, sbuf.st_size);
+  return pwrite (WINDOW_FD, window, sbuf.st_size, 0) == sbuf.st_size;
+}
+
+/* Whether @p buf was copied to us out of the window */
+static int
+in_window (const char* buf, size_t length)
+{
+  ssize_t size = pread (WINDOW_FD, window, sizeof (window), 0);
+
+  return size > 0 && memmem (window, size, buf, length) != NULL;
+}
+
+/*
+ * Reads of virtual files come in through the window: the sandbox leaves the
+ * data there and turns the read into a pread() of it.
+ */
+static int
+test_window (const char* dir)
+{
+  static char buf[DATA_LENGTH];
+  struct iovec iov[2];
+  int fd;
+
+  fd = open_in (dir, "data");
+  if (fd < 4096)
+    return 1;
+
+  if (!clear_window ())
+    return 2;
+  if (lseek (fd, 1000, SEEK_SET) != 1000)
+    return 3;
+  if (read (fd, buf, 5000) != 5000 || !is_data (buf, 1000, 5000))
+    return 4;
+  if (!in_window (buf, 5000))
+    return 5;
+
+  if (!clear_window ())
+    return 6;
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 3000;
+  iov[1].iov_base = buf + 4000;
+  iov[1].iov_len = 2000;
+  if (readv (fd, iov, 2) != 5000 || !is_data (buf, 6000, 3000) || !is_data (buf + 4000, 9000, 2000))
+    return 7;
+  if (!in_window (buf, 3000) || !in_window (buf + 4000, 2000))
+    return 8;
+
+  /* Short reads stop at the end of the file */
+  if (lseek (fd, DATA_LENGTH - 100, SEEK_SET) != DATA_LENGTH - 100)
+    return 9;
+  if (read (fd, buf, 4096) != 100 || !is_data (buf, DATA_LENGTH - 100, 100))
+    return 10;
+  if (read (fd, buf, 4096) != 0)
+    return 11;
+
+  if (lseek (fd, DATA_LENGTH - 300, SEEK_SET) != DATA_LENGTH - 300)
+    return 12;
+  memset (buf, 0, 6000);
+  iov[0].iov_len = 200;
+  iov[1].iov_len = 2000;
+  if (readv (fd, iov, 2) != 300 || !is_data (buf, DATA_LENGTH - 300, 200) || !is_data (buf + 4000, DATA_LENGTH - 100, 100))
+    return 13;
+  if (buf[4100] != 0)
+    return 14;
+
+  close (fd);
+  return 0;
+}
+
+/*
+ * Virtual fds are handed out lowest first, like the kernel's, and numbers
+ * that aren't open are refused.
+ */
+static int
+test_fds (const char* dir)
+{
+  char buf[OTHER_LENGTH];
+  int data, other, again, i;
+
+  data = open_in (dir, "data");
+  other = open_in (dir, "other");
+  if (data != 4096 || other != 4097)
+    return 1;
+
+  close (data);
+  data = open_in (dir, "other");
+  if (data != 4096)
+    return 2;
+  if (read_all (data, buf, sizeof (buf)) != OTHER_LENGTH || !is_other (buf, OTHER_LENGTH))
+    return 3;
+
+  if (close (data) != 0)
+    return 4;
+  errno = 0;
+  if (close (data) != -1 || errno != EBADF)
+    return 5;
+  errno = 0;
+  if (read (data, buf, sizeof (buf)) != -1 || errno != EBADF)
+    return 6;
+  errno = 0;
+  if (read (5000, buf, sizeof (buf)) != -1 || errno != EBADF)
+    return 7;
+  errno = 0;
+  if (close (5000) != -1 || errno != EBADF)
+    return 8;
+
+  /* Both are free now, and the lower one goes first */
+  close (other);
+  data = open_in (dir, "data");
+  again = open_in (dir, "data");
+  if (data != 4096 || again != 4097)
+    return 9;
+
+  /* Each open has its own offset */
+  if (read (data, buf, 100) != 100 || !is_data (buf, 0, 100))
+    return 10;
+  if (read (again, buf, 50) != 50 || !is_data (buf, 0, 50))
+    return 11;
+  if (read (data, buf, 100) != 100 || !is_data (buf, 100, 100))
+    return 12;
+  close (data);
+  close (again);
+
+  for (i = 0; i < 1000; i++) {
+    data = open_in (dir, "data");
+    if (data != 4096 || close (data) != 0)
+      return 13;
+  }
+
+  return 0;
+}
+
+/*
+ * Calls on whitelisted host paths go through, even when the sandbox can't
+ * let them through to the kernel after reading their path
+ */
+static int
+test_host (const char* dir)
+{
+  struct stat sbuf, fdbuf;
+  char buf[4096];
+  ssize_t len;
+  int fd;
+
+  if (lstat ("/proc/self/exe", &sbuf) < 0 || !S_ISLNK (sbuf.st_mode))
+    return 1;
+  len = readlink ("/proc/self/exe", buf, sizeof (buf) - 1);
+  if (len <= 0)
+    return 2;
+  buf[len] = 0;
+  if (!strstr (buf, "/vfs-tester"))
+    return 3;
+  if (access ("/proc/self/exe", X_OK) < 0)
+    return 4;
+
+  fd = open ("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fd >= 4096 || !(fcntl (fd, F_GETFD) & FD_CLOEXEC))
+    return 5;
+  if (stat ("/proc/self/exe", &sbuf) < 0 || fstat (fd, &fdbuf) < 0 || sbuf.st_ino != fdbuf.st_ino)
+    return 6;
+
+  /* Relative to a descriptor that isn't a directory, or isn't open */
+  errno = 0;
+  if (openat (fd, "data", O_RDONLY) != -1 || errno != ENOTDIR)
+    return 7;
+  close (fd);
+  errno = 0;
+  if (openat (fd, "data", O_RDONLY) != -1 || errno != EBADF)
+    return 8;
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  struct sigaction sa;
+
+  if (argc < 3)
+    return 100;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = count_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  if (strcmp (argv[1], "delegate") == 0)
+    return test_delegate (argv[2]);
+  if (strcmp (argv[1], "mmap") == 0)
+    return test_mmap (argv[2]);
+  if (strcmp (argv[1], "window") == 0)
+    return test_window (argv[2]);
+  if (strcmp (argv[1], "fds") == 0)
+    return test_fds (argv[2]);
+  if (strcmp (argv[1], "host") == 0)
+    return test_host (argv[2]);
+
+  return 101;
+}
@@ -0,0 +1,244 @@
+#include "sandbox.h"
+#include "vfs.h"
+#include "native-filesystem.h"
+#include "syscall-policy.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <functional>
+#include <set>
+#include <thread>
+#include <uv.h>
+
+#ifndef BUILD_PATH
+#define BUILD_PATH "./"
+#endif
+
+#define strx(s) #s
+
+#define STRINGIFY(s) strx(s)
+
+#define VFS_TESTER_BINARY STRINGIFY(BUILD_PATH) "/build/Debug/vfs-tester"
+
+/**
+ * Sends the child SIGUSR1 whenever one of its files is about to be handed
+ * over, which is while the sandbox steps the child through receiving it.
+ * Without @p native it has no host descriptors to give, like a filesystem
+ * that is made up by the embedder.
+ */
+class SignallingFilesystem : public NativeFilesystem {
+public:
+  SignallingFilesystem(bool native = true) : NativeFilesystem ("/"),
+                                             child (0),
+                                             m_native (native) {}
+
+  int nativeFD(int fd) override {
+    if (child)
+      ::kill (child, SIGUSR1);
+    return m_native ? NativeFilesystem::nativeFD (fd) : -1;
+  }
+
+  pid_t child;
+
+private:
+  bool m_native;
+};
+
+/**
+ * Notes the thread that opens files, and whether it asks for the loop
+ */
+class ThreadFilesystem : public NativeFilesystem {
+public:
+  ThreadFilesystem(bool loop) : NativeFilesystem ("/"),
+                                m_loop (loop) {}
+
+  int open(const char* name, int flags, int mode) override {
+    opener = std::this_thread::get_id();
+    return NativeFilesystem::open (name, flags, mode);
+  }
+
+  bool needsLoop() const override {
+    return m_loop;
+  }
+
+  std::thread::id opener;
+
+private:
+  bool m_loop;
+};
+
+class VFSSandbox : public Sandbox {
+public:
+  VFSSandbox() : Sandbox(),
+                 exitStatus (-1) {
+    // The tester is an ordinary libc program, so anything the policy has no
+    // opinion on is let through. The window rules add to pread64/preadv.
+    SyscallPolicy policy (getPolicy());
+    std::set<int> ruled;
+
+    for (auto i = policy.rules().cbegin(); i != policy.rules().cend(); i++)
+      ruled.insert (i->syscall);
+    for (int nr = 0; nr < 450; nr++) {
+      if (!ruled.count (nr) && nr != SYS_pread64 && nr != SYS_preadv)
+        policy.allow (nr);
+    }
+    setPolicy (policy);
+  }
+
+  void handleIPC(codius_request_t*) override {}
+
+  void handleSignal(int signal) override {}
+
+  void handleExit(int status) override {
+    exitStatus = status;
+  }
+
+  int run(const std::string& mode, const std::string& dir, Backend backend = Backend::Ptrace) {
+    std::map<std::string, std::string> envp;
+    char* argv[] = {strdup (VFS_TESTER_BINARY), strdup (mode.c_str()), strdup (dir.c_str()), nullptr};
+
+    exitStatus = -1;
+    spawn (argv, envp, backend);
+    for (size_t i = 0; argv[i]; i++)
+      free (argv[i]);
+    return getChildPID();
+  }
+
+  int waitExit() {
+    uv_loop_t* loop = uv_default_loop ();
+    while (exitStatus == -1)
+      uv_run (loop, UV_RUN_NOWAIT);
+    return exitStatus;
+  }
+
+  int exitStatus;
+};
+
+class VFSTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (VFSTest);
+  CPPUNIT_TEST (testDelegation);
+  CPPUNIT_TEST (testMapNative);
+  CPPUNIT_TEST (testMapSynthetic);
+  CPPUNIT_TEST (testWindow);
+  CPPUNIT_TEST (testFileTable);
+  CPPUNIT_TEST (testTracerThread);
+  CPPUNIT_TEST (testHostPaths);
+  CPPUNIT_TEST (testHostPathsNotify);
+  CPPUNIT_TEST_SUITE_END ();
+
+  std::unique_ptr<VFSSandbox> sbox;
+  std::string dir;
+
+  void fill(const std::string& name, size_t length, std::function<char(size_t)> byte) {
+    std::string data (length, 0);
+    int fd = ::open ((dir + "/" + name).c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+    for (size_t i = 0; i < length; i++)
+      data[i] = byte (i);
+    CPPUNIT_ASSERT (::write (fd, data.data(), length) == static_cast<ssize_t>(length));
+    ::close (fd);
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-vfs-XXXXXX";
+    CPPUNIT_ASSERT (mkdtemp (tmpl));
+    dir = tmpl;
+
+    // Checked by vfs-tester
+    fill ("data", 100000, [](size_t i) { return static_cast<char>(i % 251); });
+    fill ("other", 4096, [](size_t) { return 'o'; });
+
+    sbox = std::unique_ptr<VFSSandbox> (new VFSSandbox());
+  }
+
+  void tearDown() {
+    sbox.reset (nullptr);
+    unlink ((dir + "/data").c_str());
+    unlink ((dir + "/other").c_str());
+    rmdir (dir.c_str());
+  }
+
+  void testDelegation() {
+    std::shared_ptr<SignallingFilesystem> fs (new SignallingFilesystem());
+
+    sbox->getVFS().mountFilesystem ("/", fs);
+    sbox->getVFS().setDelegation (true);
+    fs->child = sbox->run ("delegate", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    // Delegated files are read without stopping
+    CPPUNIT_ASSERT_EQUAL ((uint64_t)0, sbox->getHandlerStats (SYS_read).calls);
+  }
+
+  void testMapNative() {
+    std::shared_ptr<SignallingFilesystem> fs (new SignallingFilesystem());
+
+    sbox->getVFS().mountFilesystem ("/", fs);
+    fs->child = sbox->run ("mmap", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+  }
+
+  void testMapSynthetic() {
+    std::shared_ptr<SignallingFilesystem> fs (new SignallingFilesystem (false));
+
+    sbox->getVFS().mountFilesystem ("/", fs);
+    fs->child = sbox->run ("mmap", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+  }
+
+  void testWindow() {
+    sbox->getVFS().mountFilesystem ("/", std::shared_ptr<Filesystem> (new NativeFilesystem ("/")));
+    sbox->setWindowSize (256 * 1024);
+    sbox->run ("window", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    CPPUNIT_ASSERT (sbox->getHandlerStats (SYS_read).calls >= 3);
+    CPPUNIT_ASSERT (sbox->getHandlerStats (SYS_readv).calls >= 2);
+  }
+
+  void testFileTable() {
+    sbox->getVFS().mountFilesystem ("/", std::shared_ptr<Filesystem> (new NativeFilesystem ("/")));
+    sbox->run ("fds", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    CPPUNIT_ASSERT ((sbox->getVFS().getFile (4096) == nullptr));
+  }
+
+  void testTracerThread() {
+    std::shared_ptr<ThreadFilesystem> fs (new ThreadFilesystem (false));
+
+    sbox->getVFS().mountFilesystem ("/", fs);
+    sbox->setTracerThread (true);
+    sbox->run ("fds", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    CPPUNIT_ASSERT (fs->opener != std::thread::id());
+    CPPUNIT_ASSERT (fs->opener != std::this_thread::get_id());
+
+    // Once any mount needs the loop, so does the whole VFS. The first
+    // tracer thread is done with by now.
+    std::shared_ptr<ThreadFilesystem> loopFS (new ThreadFilesystem (true));
+    sbox->getVFS().mountFilesystem ("/", loopFS);
+    sbox->run ("fds", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    CPPUNIT_ASSERT (loopFS->opener == std::this_thread::get_id());
+  }
+
+  void testHostPaths() {
+    sbox->getVFS().mountFilesystem ("/", std::shared_ptr<Filesystem> (new NativeFilesystem ("/")));
+    sbox->run ("host", dir);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+  }
+
+  void testHostPathsNotify() {
+    sbox->getVFS().mountFilesystem ("/", std::shared_ptr<Filesystem> (new NativeFilesystem ("/")));
+    sbox->run ("host", dir, Sandbox::Backend::UserNotification);
+    CPPUNIT_ASSERT_EQUAL (0, sbox->waitExit());
+    // Found without an exec event
+    CPPUNIT_ASSERT (sbox->getScratchAddress() != 0);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (VFSTest);